@@ -34,6 +34,9 @@ extern ADC_HandleTypeDef hadc1;
 
 /* USER CODE BEGIN Private defines */
 
+// Conversions of the motor current sense per PWM period, averaged by the driver
+#define ADC1_CURRENT_OVERSAMPLING 4
+
 /* USER CODE END Private defines */
 
 void MX_ADC1_Init(void);
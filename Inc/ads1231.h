@@ -1,30 +1,58 @@
 #ifndef ADS1231_H
 #define ADS1231_H
 
+#include "circular_buffer.h"
 #include "drivers/sensor.h"
 #include "math/linear_fit.h"
 #include "platform.h"
 
+/**
+ * The converter pulls DOUT low when a conversion is ready. That edge interrupts on the MISO pin's EXTI line and the
+ * 24 bits are clocked out right there by toggling the GPIO registers directly, a few microseconds per sample with no
+ * SPI setup. Every conversion lands in a queue stamped with the time it became ready.
+ */
 class ADS1231 : public ISensor {
 public:
+    // The converter runs at 10 or 80 SPS, this rides out the main loop being held up for a while
+    static constexpr size_t QUEUE_SIZE = 16;
+
+    // MISO has to be one of these. They share EXTI9_5_IRQHandler, the only EXTI handler there is.
+    static constexpr uint32_t DATA_READY_PINS = GPIO_PIN_5 | GPIO_PIN_6 | GPIO_PIN_7 | GPIO_PIN_8 | GPIO_PIN_9;
+
+    /**
+     * zero_offset is subtracted from the fit's output as samples are taken, so a change to it applies to the ones
+     * already queued too
+     */
     ADS1231(GPIO_TypeDef *powerdown_port, uint32_t powerdown_pin, SPI_HandleTypeDef *hspi, GPIO_TypeDef *miso_port,
-            uint32_t miso_pin, GPIO_TypeDef *sclk_port, uint32_t sclk_pin, LinearFit const *linear_fit_mv);
+            uint32_t miso_pin, GPIO_TypeDef *sclk_port, uint32_t sclk_pin, LinearFit const *linear_fit_mv,
+            float const *zero_offset);
 
     void init();
 
     float read_volts();
 
+    // Latest conversion
     float read();
 
-    /**
-     * Check if a measurement is ready, if it is get the value.
-     */
-    bool update();
+    // Stamped with when the conversion became ready
+    bool read_sample(Sample *sample);
+
+    // Conversions dropped because the queue was full
+    uint32_t get_num_overruns() const;
+
+    // Conversions dropped because micros() wasn't past the last queued one's timestamp, e.g. it went backwards
+    uint32_t get_num_clock_faults() const;
 
     void set_powerdown(bool pwrdn);
 
+    // Runs from the EXTI interrupt
+    void data_ready_isr(uint16_t pin);
+
 private:
     static constexpr uint32_t kOffsetBinaryCodeZero = (1 << 23);  // 2^23 is the halfway point
+    // The output clips here when the input is out of range
+    static constexpr int32_t kCodeMax = (1 << 23) - 1;
+    static constexpr int32_t kCodeMin = -(1 << 23);
 
     SPI_HandleTypeDef *hspi;
     GPIO_TypeDef *miso_port;
@@ -36,18 +64,24 @@ private:
     uint32_t powerdown_pin;
 
     LinearFit const *linear_fit_mv;
+    float const *zero_offset;
 
-    bool is_measuring;
-
-    float volts;
+    volatile float volts;
     float vref;
     int32_t value;
     bool is_first = true;
 
     uint32_t rejects = 0;
+
+    CircularBuffer<Sample, QUEUE_SIZE> samples;
+    volatile uint32_t num_overruns = 0;
+    volatile uint32_t num_clock_faults = 0;
+    uint64_t last_sample_us = 0;
+
     bool is_ready();
 
-    void enable_spi(bool spi_on);
+    int32_t read_bits();
+    float read_uncorrected();
     int32_t rejection_filter(int32_t next);
 
     // See datasheet page 12
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "controls/pid.h"
+#include "controls/relay_autotune.h"
+#include "math/range.h"
+#include "servo.h"
+
+/**
+ * Tunes the servo's velocity and position loops with relay feedback experiments, see RelayAutotune. The velocity loop
+ * is tuned on top of the current loop, the cascade is enabled for the whole run starting from cascade_vel_pid_params.
+ *
+ *   - SPIN_UP: run the velocity loop at spin_up_velocity and average the current it needs to hold that speed. The
+ *     velocity estimate is too coarse to relay about standing still, so the loop is tested about this speed instead.
+ *   - VELOCITY_LOOP: relay the current about that average on the velocity error, Tyreus-Luyben PI gains.
+ *   - POSITION_LOOP: with the new velocity gains, relay the velocity on the error to position_target. Kp = Ku / 3.2.
+ *
+ * The new gains are applied to the servo as each stage finishes and it is left holding position_target. If an
+ * experiment fails, the servo faults or it leaves travel, the original gains are put back and it holds where it is.
+ * Call update() at the servo's rate, before Servo::update().
+ */
+class AutotuneController {
+public:
+    enum class State { IDLE = 0, SPIN_UP, VELOCITY_LOOP, POSITION_LOOP, DONE, FAILED };
+
+    struct Parameters {
+        PID::Params cascade_vel_pid_params;  // Conservative gains to spin up on, in amps. The tuned gains keep its limits.
+        float spin_up_velocity;              // rads/s
+        uint32_t spin_up_ms;     // The second half is averaged for the relay's bias
+        RelayAutotune::Parameters velocity_relay;  // Current, A. The bias is measured
+        RelayAutotune::Parameters position_relay;  // Velocity, rads/s
+        float position_target;                     // rads
+        Range<float> travel;                       // rads, the experiments are stopped outside of this
+    };
+
+    AutotuneController(Servo *motor, Parameters params);
+
+    void start();
+    bool is_running();
+    bool is_done();
+    bool is_failed();
+    State update();
+
+    RelayAutotune::Result const &get_velocity_result() const;
+    RelayAutotune::Result const &get_position_result() const;
+
+private:
+    Servo *motor;
+    Parameters params;
+    State state;
+
+    RelayAutotune velocity_relay;
+    RelayAutotune position_relay;
+
+    PID::Params original_vel_params;
+    PID::Params original_pos_params;
+    bool was_cascade_enabled;
+
+    uint32_t stage_start_ms;
+    float bias_sum;
+    uint32_t bias_count;
+
+    void fail();
+};
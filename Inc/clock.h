@@ -19,8 +19,8 @@ uint32_t millis();
  * 
  * IMPORTANT: This function assumes that micros() will count up to the full extent of a uint64_t and
  *            then wrap around from 0.
- * 
- * TODO(cw): Verify that micros() is reentrant
+ *
+ * Safe to call from any interrupt, including with interrupts masked for less than a timer period (65 ms).
  */
 uint64_t micros();
 
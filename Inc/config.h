@@ -23,6 +23,14 @@ extern struct MotorConfig {
     Range<float> motor_pos_limits;  // rads
 } kMotorConfig;
 
+// Kept apart from MotorConfig, which has no room left in its EEPROM record
+extern struct MotorCurrentConfig {
+    PID::Params motor_cur_pid_params;
+    // MotorConfig's velocity gains are for the velocity loop on top of the current loop, in amps. Set once an autotune
+    // has stored them. Until then the velocity loop drives the PWM directly with the gains it always had, in duty.
+    bool is_cascade_enabled;
+} kMotorCurrentConfig;
+
 extern struct VentAppConfig {
     Modes mode;
     uint32_t current_update_period_ms;
@@ -45,20 +53,84 @@ extern struct VentResiprationConfig {
     float plateau_pressure_display_min;
     float plateau_pressure_display_max;
     float peak_pressure_limit_increment;
+    // Assist control: effort by the patient during expiration starts the next breath early, the rate setting is only
+    // the backup. Either condition triggers a breath, 0 turns it off. Both 0 is time cycled only.
+    float trigger_pressure_drop_cmH2O;  // Below the pressure the expiration settled at
+    float trigger_pressure_slope;       // Falling faster than this, cmH2O/s. Keep it above what the sensor's noise
+                                        // makes of the slope between samples, 10 false triggers at +-.2 cmH2O
 } kVentRespirationConfig;
 
+enum class MotionProfile : uint32_t {
+    TRAPEZOIDAL,
+    S_CURVE,
+};
+
 extern struct VentMotionConfig {
     float idle_pos_deg;
-    float open_pos_deg;      // Change this to a value where the servo is just barely compressing the bag
-    float expiration_part;   // I : E with 1 fixed to 1.
-    uint32_t invert_motion;  // Change this if the motor is inverted. This will reflect it 180
+    float open_pos_deg;            // Change this to a value where the servo is just barely compressing the bag
+    float expiration_part;         // I : E with 1 fixed to 1.
+    uint32_t invert_motion;        // Change this if the motor is inverted. This will reflect it 180
+    MotionProfile motion_profile;  // Planner used for the breaths, applied at boot
 } kVentMotionConfig;
 
-extern struct SensorConfig { LinearFit pressure_params; } kSensorConfig;
+extern struct SensorConfig {
+    LinearFit pressure_params;  // mV to cmH2O
+    float pressure_zero_cmH2O;  // Subtracted from the fit, kept up to date by the auto-zero
+} kSensorConfig;
+
+enum class VentMode : uint32_t {
+    VOLUME,    // Inspiration drives the arm to the tidal volume position
+    PRESSURE,  // Inspiration holds a target pressure, the tidal volume position is only the limit
+};
+
+// Kept apart from VentResiprationConfig, which doesn't have room for the pressure loop gains
+extern struct VentPressureConfig {
+    VentMode mode;                    // Takes effect at the next breath
+    float target_pressure_cmH2O;      // Held through inspiration and the hold in VentMode::PRESSURE
+    float rise_time_ms;               // The target ramps up over this long, limits the overshoot
+    PID::Params pressure_pid_params;  // cmH2O of error to arm velocity, degrees/s
+} kVentPressureConfig;
+
+// Fitted by the system identification sweep in Modes::CALIBRATION, all zero until it has run
+extern struct PlantModelConfig {
+    // Arm, driven by the motor current and pushed back by the bag:
+    //   dw/dt = accel_per_amp * i - damping * w - friction * sign(w) - load_per_pressure * pressure
+    float accel_per_amp;      // rads/s^2 / A
+    float damping;            // 1/s
+    float friction;           // rads/s^2
+    float load_per_pressure;  // rads/s^2 / cmH2O
+    // Motor winding, steady state: i = current_per_duty * duty - current_per_velocity * w
+    float current_per_duty;      // A
+    float current_per_velocity;  // A / (rads/s), the back EMF
+    // Bag, past the point it is first touched: pressure = c[0] + c[1] x + c[2] x^2, x = position - bag_contact_pos
+    float bag_contact_pos;         // rads
+    float bag_pressure_coeffs[3];  // cmH2O, cmH2O/rad, cmH2O/rad^2
+} kPlantModelConfig;
 
 extern float kVentTVSettings[6];
 extern float kVentRateSettings[6];
 
+// Schema of each config record in the EEPROM. Bump it when the struct layout changes and register a migration from the
+// old schema in config_add_records() so calibrated settings survive the update.
+constexpr uint16_t kMotorConfigSchema = 2;
+constexpr uint16_t kVentAppConfigSchema = 1;
+constexpr uint16_t kVentRespConfigSchema = 2;
+constexpr uint16_t kVentMotionConfigSchema = 2;
+constexpr uint16_t kSensorConfigSchema = 2;
+constexpr uint16_t kMotorCurrentConfigSchema = 1;
+constexpr uint16_t kPlantModelConfigSchema = 1;
+constexpr uint16_t kVentPressureConfigSchema = 1;
+
+/**
+ * Register the config records and their migrations with the store. Call before RecordStore::first_load().
+ */
+bool config_add_records(RecordStore *store);
+
+/**
+ * write() runs in the USB receive interrupt, so it only takes the command. update() starts it from the main loop, where
+ * the store and the EEPROM queue are only ever touched from. One command at a time, a write while one is still busy
+ * is refused.
+ */
 class ConfigCommandRPC : public CommEndpoint {
 public:
     explicit ConfigCommandRPC(uint8_t id, RecordStore *store);
@@ -66,6 +138,9 @@ public:
     uint8_t write(void *data, size_t size) override;
     uint8_t read(void *data, size_t size) override;
 
+    // From the main loop
+    void update();
+
 private:
     static constexpr uint32_t CONFIG_SAVE_CMD = 0x45564153;   // ASCII "SAVE"
     static constexpr uint32_t CONFIG_ERASE_CMD = 0x53415245;  // ASCII "ERAS"
@@ -75,7 +150,18 @@ private:
     static constexpr uint8_t INVALID_CMD_ERR = 0x10;
     static constexpr uint8_t CONFIG_ERR = 0x11;
 
+    // Reported on read, the commands run in the background so poll this for the result
+    enum class Status : uint32_t {
+        IDLE = 0,
+        BUSY,
+        FAILED,
+    };
+
     RecordStore *store;
+    volatile Status status;     // Only the interrupt moves it to BUSY, only the main loop out of it
+    volatile uint32_t pending;  // Taken but not started yet, 0 if none
+
+    static void on_complete(bool success, void *arg);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef ITERATIVE_LEARNING_H
+#define ITERATIVE_LEARNING_H
+
+#include <stdint.h>
+
+/**
+ * Iterative learning control for a motion that repeats every cycle, such as a breath.
+ *
+ * The cycle is split by phase into NUM_BINS bins. While a cycle runs, the tracking error (reference - measured) is
+ * averaged into each bin. When the next cycle starts, each bin's correction is updated
+ *
+ *   u[i] = forgetting * (u[i] + learning_gain * e[i + lead_bins])
+ *
+ * and get_correction() returns it, to be added to the reference. lead_bins looks ahead to make up for the servo's lag.
+ * forgetting < 1 bleeds off the correction, so noise can't build up in it. The learning gain is clamped to [0, 1] and
+ * the correction to +-max_correction, so one bad cycle can't make it run away.
+ */
+class IterativeLearningControl {
+public:
+    static constexpr uint16_t NUM_BINS = 64;
+
+    struct Parameters {
+        float learning_gain;
+        float forgetting;
+        float max_correction;  // Same units as the error
+        uint8_t lead_bins;
+    };
+
+    IterativeLearningControl(Parameters params);
+
+    /**
+     * Forget everything learned. Call this when the motion changes, because the old corrections no longer apply.
+     */
+    void reset();
+
+    /**
+     * Start a new cycle of period_ms. The cycle just finished is learned from if it ran to completion. A change of
+     * period resets everything.
+     */
+    void start_cycle(uint32_t period_ms);
+
+    /**
+     * Drop the samples of the current cycle, e.g. it was cut short and isn't representative. No correction is applied
+     * until the next cycle starts.
+     */
+    void discard_cycle();
+
+    void record(uint32_t t_ms, float error);  // t_ms since the start of the cycle
+    float get_correction(uint32_t t_ms) const;
+
+    uint16_t get_num_cycles_learned() const;
+
+private:
+    Parameters params;
+    uint32_t period_ms;  // 0 outside of a cycle
+    bool is_cycle_valid;
+    uint16_t num_cycles_learned;
+
+    float correction[NUM_BINS];
+    float error_sum[NUM_BINS];
+    uint16_t error_count[NUM_BINS];
+
+    void learn();
+    void clear_errors();
+};
+
+#endif
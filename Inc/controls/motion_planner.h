@@ -1,19 +1,66 @@
 #pragma once
 
+#include <math.h>
+#include <stdint.h>
+
 struct MotionPlan {
     float p_target;
     float v_target;
     float time_total_ms;
+    uint32_t tag;  // Caller defined, reported by get_tag() while this plan runs
 };
 
+/**
+ * Planners evaluate their profile against the time since the plan started, not by counting calls to run(). Back to back
+ * plans are scheduled from where the previous one ended, so jitter in how often run() is called never stretches the
+ * motion.
+ */
 class IMotionPlanner {
 public:
-    virtual void set_next(MotionPlan const &p) = 0;
+    static constexpr uint8_t QUEUE_SIZE = 4;
+
+    typedef uint64_t (*ClockUs)();
+
+    /**
+     * Queue a plan to run after the ones already queued. Consecutive plans that move the same way are blended, the
+     * motion carries its velocity through the boundary instead of stopping. Returns false if the queue is full.
+     */
+    virtual bool set_next(MotionPlan const &p) = 0;
+
+    // Drop everything running and queued, p starts on the next run()
     virtual void force_next(MotionPlan const &p) = 0;
+
     virtual float run(float pos, float vel = 0) = 0;
     virtual void reset() = 0;
+
+    // Nothing running and nothing queued
     virtual bool is_idle() = 0;
+    virtual uint8_t get_num_queued() = 0;
+    virtual uint32_t get_tag() = 0;
 
+    // References at the end of the last run(). Positions in the units of MotionPlan, velocity and acceleration per
+    // second and per second^2.
     virtual float get_pos() = 0;
+    virtual float get_vel() = 0;
+    virtual float get_acc() = 0;
     virtual ~IMotionPlanner() {}
-};
\ No newline at end of file
+};
+
+/**
+ * Velocity (per ms) to end the current plan with so it blends into next. Zero unless both move the same way, then the
+ * slower of their average velocities so neither has to overshoot to make up for it.
+ */
+inline float blend_velocity(MotionPlan const &current, float p_start, MotionPlan const *next) {
+    if (next == nullptr || current.time_total_ms <= 0 || next->time_total_ms <= 0) {
+        return 0;
+    }
+
+    float v_current = (current.p_target - p_start) / current.time_total_ms;
+    float v_next = (next->p_target - current.p_target) / next->time_total_ms;
+
+    if (v_current * v_next <= 0) {
+        return 0;
+    }
+
+    return fabsf(v_current) < fabsf(v_next) ? v_current : v_next;
+}
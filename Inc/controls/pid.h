@@ -1,12 +1,28 @@
 #ifndef PID_H
 #define PID_H
 
+#include "math/range.h"
+
+/**
+ * PID with
+ *   - Conditional integration anti-windup: the integrator holds while the output is saturated and the error would push
+ *     it further into the limit.
+ *   - Derivative on measurement through a first order low pass, setpoint steps don't kick the output.
+ *   - Velocity and acceleration feed-forward inputs.
+ *   - Output limits.
+ *
+ * Gains are folded into per-update coefficients in set_params(), so update() is a handful of multiply-adds.
+ */
 class PID {
 public:
     struct Params {
         float Kp;
         float Ki;
         float Kd;
+        float Kff_vel;              // Output per unit of target velocity
+        float Kff_acc;              // Output per unit of target acceleration
+        float d_filter_hz;          // Derivative low pass cutoff, 0 for none
+        Range<float> output_limits;
     };
 
     PID(float Kp, float Ki, float Kd, float dt);
@@ -15,15 +31,27 @@ public:
 
     void reset();
 
-    float update(float target, float meas);
+    float update(float target, float meas, float ff_vel = 0, float ff_acc = 0);
 
-    Params params;
+    void set_params(Params const &params);
+    Params const &get_params() const;
+
+    // For loops whose rate is only known once the hardware is set up
+    void set_period(float dt);
 
 private:
-    float err_acc_;
+    Params params_;
     float period_;
-    float err_last_;
+
+    // Precomputed from params_ and period_
+    float ki_dt_;
+    float kd_over_dt_;
+    float d_alpha_;
+
+    float i_term_;  // In output units, so gain changes don't bump the output
+    float meas_last_;
+    float d_filtered_;
     bool is_init_;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,91 @@
+#ifndef RELAY_AUTOTUNE_H
+#define RELAY_AUTOTUNE_H
+
+#include <stdint.h>
+
+#include "controls/pid.h"
+
+/**
+ * Relay feedback experiment (Astrom-Hagglund) to find a loop's ultimate gain and period.
+ *
+ * In place of the controller, the output is switched between bias +- amplitude on the sign of the error. Most plants
+ * settle into a limit cycle at the frequency where their phase lag is 180 degrees, the same point a P controller turned
+ * up to the ultimate gain Ku would oscillate at. From the describing function of the relay
+ *
+ *   Ku = 4 * amplitude / (pi * a)
+ *
+ * where a is the amplitude of the oscillation in the error, and the ultimate period Tu is the period of the limit
+ * cycle. The first SETTLE_CYCLES periods are thrown away as the start-up transient, the next num_cycles are averaged.
+ *
+ * The hysteresis keeps measurement noise from chattering the relay. It adds a little phase lag of its own, so keep it
+ * to a few times the noise and well under the oscillation amplitude.
+ */
+class RelayAutotune {
+public:
+    static constexpr uint32_t SETTLE_CYCLES = 2;
+
+    struct Parameters {
+        float amplitude;   // Output swing either side of the bias
+        float bias;        // Output with no error, e.g. to hold against a constant load
+        float hysteresis;  // The error has to cross +-hysteresis to switch the relay
+        uint32_t num_cycles;
+        uint32_t timeout_ms;
+    };
+
+    enum class State { IDLE, RUNNING, DONE, FAILED };
+
+    struct Result {
+        float ultimate_gain;  // Output units per error unit
+        float ultimate_period_s;
+    };
+
+    // Gains from Ku and Tu
+    enum class Rule {
+        ZIEGLER_NICHOLS_PI,  // Kp = .45 Ku, Ti = Tu / 1.2. Fast, quarter amplitude decay
+        TYREUS_LUYBEN_PI,    // Kp = Ku / 3.2, Ti = 2.2 Tu. Much less overshoot than Ziegler-Nichols
+        CONSERVATIVE_P,      // Kp = Ku / 3.2, about 10dB of gain margin. Ki is kept, for an outer loop that only
+                             // needs the integrator to trim a steady state error
+    };
+
+    RelayAutotune(Parameters params);
+
+    void start(uint32_t now_ms);
+    void stop();
+
+    // When the bias is only known just before start(), e.g. measured by holding the operating point
+    void set_bias(float bias);
+
+    /**
+     * error is target - measured. Returns the output to apply until the next update.
+     */
+    float update(float error, uint32_t now_ms);
+
+    State get_state() const;
+    Result const &get_result() const;
+
+    /**
+     * base with Kp, Ki and Kd replaced by the rule's gains for result. The feed-forward, derivative filter and output
+     * limits are kept.
+     */
+    static PID::Params tune(Rule rule, Result const &result, PID::Params base);
+
+private:
+    Parameters params;
+    State state;
+    Result result;
+
+    uint32_t start_ms;
+    bool is_high;
+    bool is_first_rise;
+    uint32_t last_rise_ms;
+    float error_max;  // Over the cycle in progress
+    float error_min;
+
+    uint32_t num_cycles;  // Completed since start(), including the settling ones
+    float amplitude_sum;
+    uint32_t period_sum_ms;
+
+    void end_cycle(uint32_t now_ms);
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef S_CURVE_PLANNER_H_
+#define S_CURVE_PLANNER_H_
+
+#include <math.h>
+#include <stdint.h>
+
+#include "circular_buffer.h"
+#include "clock.h"
+#include "controls/motion_planner.h"
+#include "math/dsp.h"
+
+/**
+ * Jerk limited (7 segment) version of the TrapezoidalPlanner. The acceleration ramps in and out over the start and end
+ * of the accel and decel phases instead of stepping, so the bag and gear train don't get kicked at the transitions.
+ *
+ *   jerk: + 0 - | 0 | - 0 +
+ *         accel  cruise  decel
+ *
+ * The whole profile is solved in closed form when a plan starts, run() just evaluates one cubic per tick. The ramps
+ * start and end at zero acceleration, so blended plans join without a step in acceleration either.
+ */
+class SCurvePlanner : public IMotionPlanner {
+public:
+    enum class State {
+        IDLE,
+        RUNNING,
+    };
+
+    struct Parameters {
+        float t_a_percent;   // Of the total time spent accelerating
+        float t_d_percent;   // Of the total time spent decelerating
+        float jerk_percent;  // Of the accel/decel phases spent ramping the acceleration, 1 for no constant accel part
+    };
+
+    SCurvePlanner(Parameters params, ClockUs clock_us = micros);
+
+    virtual ~SCurvePlanner();
+    virtual void reset();
+    virtual bool is_idle();
+    virtual uint8_t get_num_queued();
+    virtual uint32_t get_tag();
+    virtual bool set_next(MotionPlan const &p);
+    virtual void force_next(MotionPlan const &p);
+    virtual float get_pos();
+    virtual float get_vel();
+    virtual float get_acc();
+    virtual float run(float pos, float vel = 0);
+    State get_state() const;
+
+private:
+    static constexpr uint8_t NUM_SEGMENTS = 7;
+
+    // Starting state of one constant jerk piece of the profile
+    struct Segment {
+        float t_end;  // s, from the start of the plan
+        float p;
+        float v;
+        float a;
+        float j;
+    };
+
+    State state;
+
+    MotionPlan current;
+    CircularBuffer<MotionPlan, QUEUE_SIZE> queue;
+
+    Segment segments[NUM_SEGMENTS];
+    uint8_t segment_idx;
+    uint64_t start_us;
+    uint64_t duration_us;
+    float t_total;
+
+    float p_last;
+    float v_last;
+    float a_last;
+    float v_end;  // Blended velocity carried into the next plan
+
+    ClockUs clock_us;
+
+    Parameters params;
+
+    bool start_next(float pos, uint64_t now_us);
+    bool solve(float p_start);
+};
+#endif
@@ -4,6 +4,8 @@
 #include <math.h>
 #include <stdint.h>
 
+#include "circular_buffer.h"
+#include "clock.h"
 #include "controls/motion_planner.h"
 #include "math/dsp.h"
 
@@ -21,37 +23,50 @@ public:
         float t_d_percent;
     };
 
-    TrapezoidalPlanner(Parameters params, uint32_t dt_ms = 10);
+    TrapezoidalPlanner(Parameters params, ClockUs clock_us = micros);
 
     virtual ~TrapezoidalPlanner();
     virtual void reset();
     virtual bool is_idle();
-    virtual void set_next(MotionPlan const &p);
+    virtual uint8_t get_num_queued();
+    virtual uint32_t get_tag();
+    virtual bool set_next(MotionPlan const &p);
     virtual void force_next(MotionPlan const &p);
     virtual float get_pos();
+    virtual float get_vel();
+    virtual float get_acc();
     virtual float run(float pos, float vel = 0);
     State get_state() const;
 
     State state;
-    int32_t t_counts_total;
 
     MotionPlan current;
 
-    MotionPlan next;
-    bool is_next_available;
+    CircularBuffer<MotionPlan, QUEUE_SIZE> queue;
 
-    int32_t t_counts_accel;
-    int32_t t_counts_decel;
-    int32_t t_counts_c;
+    // Current plan, times in s and velocities per s
+    uint64_t start_us;
+    uint64_t duration_us;
+    float t_accel;
+    float t_constant;
+    float t_decel;
+    float p_start;
 
     float v_max;
     float accel;
     float decel;
+    float v_0;
+    float v_end;  // Blended velocity carried into the next plan
     float v_last;
+    float a_last;
     float p_last;
 
-    uint32_t dt_ms;
+    ClockUs clock_us;
 
     Parameters params;
+
+private:
+    bool start_next(float pos, uint64_t now_us);
+    void evaluate(float t);
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,45 @@
+#ifndef VELOCITY_ESTIMATOR_H
+#define VELOCITY_ESTIMATOR_H
+
+#include <stdint.h>
+
+/**
+ * M/T velocity estimate from encoder counts plus the time each count arrived.
+ *
+ * Counting edges per control period (M) only resolves whole counts. At slow speeds that is mostly 0 or 1 count per
+ * period and the estimate is quantization noise. Here the count change is divided by the time between the first and
+ * last edge it spans (T) instead. The error is set by how precisely the edges are timestamped, not by the control
+ * period.
+ *
+ * When no edge arrives in a period the speed can be at most one count over the time since the last edge. The estimate
+ * decays along that bound and goes to zero after timeout_us, so stopping doesn't leave a stale velocity behind.
+ */
+class MTVelocityEstimator {
+public:
+    struct Parameters {
+        float rad_per_count;
+        uint32_t min_window_us;  // Edges closer together than this are accumulated, limits timestamp jitter
+        uint32_t timeout_us;     // No edges for this long means stopped
+    };
+
+    MTVelocityEstimator(Parameters params);
+
+    void reset(int32_t count, uint64_t now_us);
+
+    /**
+     * edge_count and edge_us are the encoder count and the time of the most recent edge, now_us is the time of this
+     * update. Returns rad/s.
+     */
+    float update(int32_t edge_count, uint64_t edge_us, uint64_t now_us);
+
+    float get() const;
+
+private:
+    Parameters params;
+
+    int32_t ref_count;  // Edge the current window started at
+    uint64_t ref_us;
+    float velocity;
+};
+
+#endif
@@ -1,7 +1,24 @@
 #pragma once
 
+#include <stdint.h>
+
 class ISensor {
 public:
+    struct Sample {
+        uint64_t time_us;   // When it was measured, always after the sample before it
+        float value;        // Same units as read()
+        bool is_saturated;  // The converter was at the end of its range, value is only a bound
+        bool is_held;       // The converter's reading jumped and was filtered out, value repeats the last one
+    };
+
+    // Latest value, for anything happy to look at it now and then
     virtual float read() = 0;
+
+    /**
+     * Oldest sample that hasn't been taken yet, false once there are none left. Each sample comes out exactly once,
+     * so only one consumer may take them.
+     */
+    virtual bool read_sample(Sample *sample) = 0;
+
     virtual ~ISensor() {}
 };
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "drivers/sensor.h"
+
+/**
+ * Watches a sensor's samples for the ways it can die. Each sample costs a few flops: the readings and their change
+ * from one sample to the next are accumulated with Welford's method over windows of window_samples, then checked once
+ * the window is full.
+ *
+ *   no_data    nothing arrived for max_gap_ms, the converter stopped signalling data ready
+ *   stuck      the exact same reading for stuck_ms, a live converter always has a few codes of noise. A held sample
+ *              repeats the last reading but the converter behind it did move, so it counts as a change.
+ *   saturated  a sample in the window was at the end of the converter's range, e.g. an open bridge
+ *   noisy      the change from sample to sample spread more than max_noise over the window. Unlike the readings
+ *              themselves it stays small through a breath, a floating input jumps all over.
+ *
+ * Pick the times and window so all of them fit well within a breath. The times are counted in update()'s calls, not
+ * by the samples' timestamps or the clock, so a clock that jumps can neither raise nor hide a fault.
+ */
+class SensorHealth {
+public:
+    struct Parameters {
+        uint32_t max_gap_ms;
+        uint32_t stuck_ms;
+        uint16_t window_samples;
+        float max_noise;  // Standard deviation, same units as the sensor
+    };
+
+    struct Faults {
+        bool no_data;
+        bool stuck;
+        bool saturated;
+        bool noisy;
+
+        uint32_t to_int() const;
+    };
+
+    struct __attribute__((__packed__)) Stats {
+        uint32_t faults;  // Faults::to_int()
+        uint32_t num_samples;
+        uint32_t num_saturated;
+        uint32_t num_held;
+        float mean;           // Of the last full window
+        float std_dev;        // Of the last full window
+        float noise;          // Standard deviation of the change from sample to sample, last full window
+        uint32_t max_gap_us;  // Longest between samples' timestamps since boot
+    };
+
+    SensorHealth(Parameters params, uint32_t update_period_ms);
+
+    void on_sample(ISensor::Sample const &sample);
+
+    // Every update_period_ms, whether samples arrive or not
+    void update();
+
+    Faults const &get_faults() const;
+    bool is_healthy() const;
+    Stats const *get_stats() const;
+
+private:
+    // Running mean and sum of squared differences from it
+    struct Welford {
+        uint16_t n;
+        float mean;
+        float m2;
+
+        void add(float x);
+        float std_dev() const;
+    };
+
+    Parameters params;
+    uint32_t update_period_ms;
+    Faults faults;
+    Stats stats;
+
+    bool has_sample;
+    uint64_t last_sample_us;
+    float last_value;
+    uint32_t ms_since_sample;
+    uint32_t ms_since_change;
+
+    Welford values;
+    Welford changes;
+    bool is_window_saturated;
+
+    void finish_window();
+};
@@ -1,6 +1,9 @@
 #ifndef DRV8873_H
 #define DRV8873_H
 
+#include "adc.h"
+#include "circular_buffer.h"
+#include "drivers/sensor.h"
 #include "platform.h"
 
 #define DRV8873_REG_FAULT_STATUS \
@@ -128,18 +131,49 @@
 #define DRV8873_REG_GET_VAL(reg, mask, pos) ((reg) & (mask)) >> (pos)
 #define DRV8873_REG_SET_VAL(reg, mask, pos, val) (reg) |= (((val) << (pos)) & (mask))
 
-class DRV8873 {
+class DRV8873 : public ISensor {
 public:
+    // A sample every PWM period, enough for a few milliseconds of the main loop running late
+    static constexpr size_t QUEUE_SIZE = 64;
+
     DRV8873(GPIO_TypeDef *sleep_port, uint16_t sleep_pin, GPIO_TypeDef *disable_port, uint16_t disable_pin,
             GPIO_TypeDef *fault_port, uint16_t fault_pin, TIM_HandleTypeDef *htim, uint32_t tim_channel_pwm1,
             uint32_t tim_channel_pwm2, SPI_HandleTypeDef *hspi, GPIO_TypeDef *cs_port, uint16_t cs_pin,
             bool is_inverted = false);
 
+    // Called from the DMA interrupt with each new current sample, once per PWM period
+    typedef void (*SampleCallback)(void *arg);
+
+    /**
+     * Also starts the current sampling. The PWM timer triggers a burst of ADC1_CURRENT_OVERSAMPLING conversions in
+     * the middle of each drive pulse, away from the switching edges, and DMA moves them into a buffer.
+     */
     void init();
 
-    void set_current_raw_meas_dma(uint32_t *dma);
+    // Average of the latest burst, cheap enough for the current loop
     float get_current();
 
+    // Latest current, A
+    float read();
+
+    // Every burst's current, stamped when its conversions completed
+    bool read_sample(Sample *sample);
+
+    // Samples dropped because the queue was full
+    uint32_t get_num_overruns() const;
+
+    // Samples dropped because micros() wasn't past the last queued one's timestamp, e.g. it went backwards
+    uint32_t get_num_clock_faults() const;
+
+    void set_sample_callback(SampleCallback cb, void *arg);
+    float get_pwm_frequency_hz() const;
+
+    /**
+     * Called from the HAL ADC callback when the DMA completes a burst. The ADC is triggered by the PWM timer, so this
+     * runs in lock step with the PWM.
+     */
+    void conversion_complete_isr(ADC_HandleTypeDef *hadc);
+
     void set_pwm_enabled(bool enable);
     void set_pwm(float value);
 
@@ -158,6 +192,7 @@ private:
     static constexpr float VREF = 3.3f;
     static constexpr float I_MIRROR_RATIO = 1100.0f;
     static constexpr float R_LOAD = 330.0f;
+    static constexpr uint16_t ADC_MAX_CODE = 4095;
 
     GPIO_TypeDef *sleep_port;
     uint16_t sleep_pin;
@@ -176,7 +211,16 @@ private:
     GPIO_TypeDef *cs_port;
     uint16_t cs_pin;
 
-    uint32_t *current_raw_dma;
+    uint16_t current_dma_buf[ADC1_CURRENT_OVERSAMPLING];
+    volatile uint32_t current_raw_sum;
+
+    CircularBuffer<Sample, QUEUE_SIZE> samples;
+    volatile uint32_t num_overruns = 0;
+    volatile uint32_t num_clock_faults = 0;
+    uint64_t last_sample_us = 0;
+
+    SampleCallback sample_cb;
+    void *sample_cb_arg;
 
     uint8_t status_reg;
 
@@ -4,10 +4,23 @@
 template <typename T_addr, typename T_data>
 class EEPROM {
   public:
+    typedef void (*Callback)(bool success, void *arg);
+
     virtual bool read(T_addr addr, T_data *data, T_addr len) = 0;
     virtual bool write(T_addr addr, T_data *data, T_addr len) = 0;
     virtual bool allocate(T_addr size, T_addr *addr) = 0;
     virtual bool erase() = 0;
+
+    /**
+     * Non-blocking variants. The transaction is queued and run from update(); the callback (if any) is invoked from
+     * update() once it completes. The data buffer must remain valid until then.
+     */
+    virtual bool read_async(T_addr addr, T_data *data, T_addr len, Callback cb = nullptr, void *arg = nullptr) = 0;
+    virtual bool write_async(T_addr addr, T_data *data, T_addr len, Callback cb = nullptr, void *arg = nullptr) = 0;
+    virtual bool erase_async(Callback cb = nullptr, void *arg = nullptr) = 0;
+
+    virtual bool is_busy() = 0;
+    virtual void update() = 0;
 };
 
 #endif  // EEPROM_H
@@ -7,17 +7,41 @@
 
 class Encoder {
 public:
+    struct Edge {
+        int32_t count;
+        uint64_t time_us;
+    };
+
     Encoder(TIM_HandleTypeDef *tim);
 
     void init();
 
-    int16_t get();
+    /**
+     * Position in counts since the last reset(). The 16 bit timer is extended to 32 bits by capture_edge(), so this
+     * doesn't wrap as long as that is called at least once per 32767 counts.
+     */
+    int32_t get();
     void reset();
 
+    /**
+     * Accumulate the timer into the 32 bit position and timestamp count changes. The timer counts edges in hardware
+     * but doesn't record when they happened, so call this from an interrupt running much faster than the edges (the
+     * PWM rate current loop). The timestamp resolution is that interrupt's period.
+     */
+    void capture_edge(uint64_t now_us);
+
+    // Count and time of the most recent edge, consistent even if capture_edge() interrupts the read
+    Edge get_last_edge();
+
     bool is_inverted;
 
 private:
     TIM_HandleTypeDef *htim;
+
+    volatile int32_t edge_count;
+    volatile uint16_t edge_raw;  // Timer count edge_count was accumulated up to
+    volatile uint64_t edge_time_us;
+    volatile uint32_t edge_seq;  // Bumped on every capture so a torn read can be detected
 };
 
 #endif  // ENCODER_H
\ No newline at end of file
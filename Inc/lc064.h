@@ -1,6 +1,7 @@
 #ifndef LC064_H
 #define LC064_H
 
+#include "circular_buffer.h"
 #include "eeprom.h"
 #include "platform.h"
 
@@ -17,6 +18,22 @@ public:
 
     bool erase() override;
 
+    bool read_async(uint16_t addr, uint8_t *data, uint16_t len, Callback cb = nullptr, void *arg = nullptr) override;
+    bool write_async(uint16_t addr, uint8_t *data, uint16_t len, Callback cb = nullptr, void *arg = nullptr) override;
+    bool erase_async(Callback cb = nullptr, void *arg = nullptr) override;
+
+    bool is_busy() override;
+
+    /**
+     * Advance the transaction queue. Call this from the main loop, it never waits on the bus.
+     */
+    void update() override;
+
+    /**
+     * Called from the HAL I2C interrupt callbacks when a transfer finishes.
+     */
+    void transfer_complete_isr(I2C_HandleTypeDef *hi2c, bool success);
+
 private:
     static constexpr uint32_t I2C_TIMEOUT = 1000;
     static constexpr uint8_t NUM_TEST_TRIALS = 100;
@@ -28,6 +45,28 @@ private:
     static constexpr uint16_t TOTAL_SIZE = 8192;  // bytes
     static constexpr uint16_t PAGE_SIZE = 32;     // bytes
 
+    static constexpr uint32_t WRITE_CYCLE_TIME_MS = 5;      // t_WC from the datasheet
+    static constexpr uint32_t WRITE_CYCLE_TIMEOUT_MS = 50;  // Give up ack polling after this long
+    static constexpr uint32_t ACK_POLL_TIMEOUT = 1;         // ms, a single address byte
+    static constexpr size_t QUEUE_SIZE = 16;
+
+    enum class State {
+        IDLE,
+        VERIFY,  // Reading a page back before a fill, pages that already match are skipped
+        TRANSFER,
+        WRITE_CYCLE,
+    };
+
+    struct Transaction {
+        bool is_write;
+        bool is_fill;  // Write the first page of data repeatedly over the whole range
+        uint16_t addr;
+        uint8_t *data;
+        uint16_t len;
+        Callback cb;
+        void *arg;
+    };
+
     I2C_HandleTypeDef *hi2c;
     uint8_t dev_addr;
 
@@ -35,6 +74,22 @@ private:
 
     uint16_t allocator_max_size;
     uint16_t allocator_offset;
+
+    CircularBuffer<Transaction, QUEUE_SIZE> queue;
+    State state;
+    uint16_t bytes_done;
+    uint16_t bytes_in_flight;
+    uint32_t write_cycle_start_ms;
+    volatile bool is_transfer_done;
+    volatile bool is_transfer_ok;
+
+    static uint8_t erase_buf[PAGE_SIZE];
+    uint8_t verify_buf[PAGE_SIZE];
+
+    bool enqueue(Transaction const &t);
+    void start_transfer(bool is_verified = false);
+    void next_page();
+    void finish(bool success);
 };
 
 #endif  // LC064
@@ -0,0 +1,254 @@
+#ifndef FILTERS_H_
+#define FILTERS_H_
+
+#include <stddef.h>
+
+/**
+ * Digital filters for sensor data and state estimates.
+ *
+ * Coefficients are worked out from a cutoff and a sample rate by constexpr functions in single precision, so a filter
+ * declared with constant rates costs nothing at startup and never touches double math. The update() of each filter is
+ * a few float multiply-adds.
+ */
+namespace cx {
+
+constexpr float kPi = 3.14159265358979f;
+
+// exp(x), x <= 0. Halve the argument until the series converges quickly, then square back up.
+constexpr float exp_neg(float x) {
+    int halvings = 0;
+    while (x < -.5f) {
+        x *= .5f;
+        halvings++;
+    }
+
+    float term = 1;
+    float sum = 1;
+    for (int n = 1; n < 10; n++) {
+        term *= x / n;
+        sum += term;
+    }
+
+    for (int i = 0; i < halvings; i++) {
+        sum *= sum;
+    }
+    return sum;
+}
+
+// sin(x) and cos(x) for x in [0, pi], the range of a normalized digital frequency
+constexpr float sin(float x) {
+    // Fold onto [0, pi / 2] where the series is accurate
+    if (x > kPi / 2) {
+        x = kPi - x;
+    }
+
+    float term = x;
+    float sum = x;
+    for (int n = 1; n < 8; n++) {
+        term *= -x * x / ((2 * n) * (2 * n + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+constexpr float cos(float x) {
+    return sin(kPi / 2 - x);
+}
+
+}  // namespace cx
+
+/**
+ * y += alpha * (x - y), alpha from the step invariant 1 - e^(-2 pi fc / fs). The first sample initializes the output
+ * unless reset() gave it a starting value.
+ */
+class OnePoleLowPass {
+public:
+    static constexpr float alpha_for(float cutoff_hz, float sample_hz) {
+        return 1 - cx::exp_neg(-2 * cx::kPi * cutoff_hz / sample_hz);
+    }
+
+    constexpr OnePoleLowPass(float cutoff_hz, float sample_hz)
+        : alpha(alpha_for(cutoff_hz, sample_hz)), y(0), is_init(false) {}
+
+    float update(float x) {
+        if (!is_init) {
+            y = x;
+            is_init = true;
+        }
+        y += alpha * (x - y);
+        return y;
+    }
+
+    float get() const {
+        return y;
+    }
+
+    void reset() {
+        y = 0;
+        is_init = false;
+    }
+
+    void reset(float value) {
+        y = value;
+        is_init = true;
+    }
+
+private:
+    float alpha;
+    float y;
+    bool is_init;
+};
+
+/**
+ * Second order section, transposed direct form II. Coefficients from the RBJ audio EQ cookbook (bilinear transform),
+ * normalized so a0 = 1.
+ */
+class Biquad {
+public:
+    struct Coeffs {
+        float b0, b1, b2;
+        float a1, a2;
+    };
+
+    static constexpr float kButterworthQ = .70710678f;
+
+    static constexpr Coeffs low_pass(float cutoff_hz, float sample_hz, float q = kButterworthQ) {
+        float w0 = 2 * cx::kPi * cutoff_hz / sample_hz;
+        float cos_w0 = cx::cos(w0);
+        float alpha = cx::sin(w0) / (2 * q);
+        float a0 = 1 + alpha;
+        return {(1 - cos_w0) / 2 / a0, (1 - cos_w0) / a0, (1 - cos_w0) / 2 / a0, -2 * cos_w0 / a0, (1 - alpha) / a0};
+    }
+
+    static constexpr Coeffs high_pass(float cutoff_hz, float sample_hz, float q = kButterworthQ) {
+        float w0 = 2 * cx::kPi * cutoff_hz / sample_hz;
+        float cos_w0 = cx::cos(w0);
+        float alpha = cx::sin(w0) / (2 * q);
+        float a0 = 1 + alpha;
+        return {(1 + cos_w0) / 2 / a0, -(1 + cos_w0) / a0, (1 + cos_w0) / 2 / a0, -2 * cos_w0 / a0, (1 - alpha) / a0};
+    }
+
+    static constexpr Coeffs notch(float center_hz, float sample_hz, float q) {
+        float w0 = 2 * cx::kPi * center_hz / sample_hz;
+        float cos_w0 = cx::cos(w0);
+        float alpha = cx::sin(w0) / (2 * q);
+        float a0 = 1 + alpha;
+        return {1 / a0, -2 * cos_w0 / a0, 1 / a0, -2 * cos_w0 / a0, (1 - alpha) / a0};
+    }
+
+    constexpr Biquad(Coeffs c) : c(c), z1(0), z2(0) {}
+
+    float update(float x) {
+        float y = c.b0 * x + z1;
+        z1 = c.b1 * x - c.a1 * y + z2;
+        z2 = c.b2 * x - c.a2 * y;
+        return y;
+    }
+
+    // Start at steady state for a constant input, avoids the step response from zero
+    void reset(float value = 0) {
+        float dc_gain = (c.b0 + c.b1 + c.b2) / (1 + c.a1 + c.a2);
+        float y = value * dc_gain;
+        z1 = y - c.b0 * value;
+        z2 = c.b2 * value - c.a2 * y;
+    }
+
+private:
+    Coeffs c;
+    float z1;
+    float z2;
+};
+
+/**
+ * Mean of the last N samples. Keeps a running sum, so the cost doesn't grow with N.
+ */
+template <size_t N, typename T = float>
+class MovingAverage {
+    static_assert(N > 0, "N must be at least 1");
+
+public:
+    constexpr MovingAverage() : buf{}, sum(0), idx(0), count(0) {}
+
+    T update(T x) {
+        if (count == N) {
+            sum -= buf[idx];
+        } else {
+            count++;
+        }
+        buf[idx] = x;
+        sum += x;
+        idx = (idx + 1) % N;
+        return sum / (T)count;
+    }
+
+    T get() const {
+        return count ? sum / (T)count : 0;
+    }
+
+    void reset() {
+        sum = 0;
+        idx = 0;
+        count = 0;
+    }
+
+private:
+    T buf[N];
+    T sum;
+    size_t idx;
+    size_t count;
+};
+
+/**
+ * Median of the last N samples, throws out single sample spikes that a linear filter would smear. Meant for small
+ * odd N, each update is an insertion into a sorted copy of the window.
+ */
+template <size_t N, typename T = float>
+class MedianFilter {
+    static_assert(N % 2 == 1, "N must be odd");
+
+public:
+    constexpr MedianFilter() : window{}, sorted{}, idx(0), count(0) {}
+
+    T update(T x) {
+        // Drop the oldest sample from the sorted copy
+        size_t n = count;
+        if (count == N) {
+            T oldest = window[idx];
+            size_t i = 0;
+            while (i + 1 < n && sorted[i] != oldest) {
+                i++;
+            }
+            for (; i + 1 < n; i++) {
+                sorted[i] = sorted[i + 1];
+            }
+            n--;
+        } else {
+            count++;
+        }
+        window[idx] = x;
+        idx = (idx + 1) % N;
+
+        // Insert the new one
+        size_t i = n;
+        while (i > 0 && sorted[i - 1] > x) {
+            sorted[i] = sorted[i - 1];
+            i--;
+        }
+        sorted[i] = x;
+
+        return sorted[count / 2];
+    }
+
+    void reset() {
+        idx = 0;
+        count = 0;
+    }
+
+private:
+    T window[N];
+    T sorted[N];
+    size_t idx;
+    size_t count;
+};
+
+#endif  // FILTERS_H_
@@ -0,0 +1,102 @@
+#ifndef LEAST_SQUARES_H_
+#define LEAST_SQUARES_H_
+
+#include <math.h>
+#include <stddef.h>
+
+/**
+ * Batch linear least squares, y = theta . x, for a handful of parameters.
+ *
+ * Samples are folded into the normal equations (X'X) theta = X'y as they are added, so the memory used doesn't depend
+ * on the number of samples. solve() does a Cholesky factorization of X'X, which is symmetric positive definite as long
+ * as the regressors are excited enough to be told apart.
+ */
+template <size_t N>
+class LeastSquares {
+public:
+    LeastSquares() {
+        reset();
+    }
+
+    void reset() {
+        for (size_t i = 0; i < N; i++) {
+            xty[i] = 0;
+            for (size_t j = 0; j < N; j++) {
+                xtx[i][j] = 0;
+            }
+        }
+        count = 0;
+    }
+
+    void add(float const (&x)[N], float y) {
+        for (size_t i = 0; i < N; i++) {
+            xty[i] += x[i] * y;
+            // Only the lower triangle is used
+            for (size_t j = 0; j <= i; j++) {
+                xtx[i][j] += x[i] * x[j];
+            }
+        }
+        count++;
+    }
+
+    size_t get_count() const {
+        return count;
+    }
+
+    /**
+     * Returns false if there are fewer samples than parameters or the regressors are (close to) linearly dependent.
+     */
+    bool solve(float (&theta)[N]) const {
+        if (count < N) {
+            return false;
+        }
+
+        // X'X = L L'
+        float l[N][N] = {};
+        for (size_t i = 0; i < N; i++) {
+            for (size_t j = 0; j <= i; j++) {
+                float sum = xtx[i][j];
+                for (size_t k = 0; k < j; k++) {
+                    sum -= l[i][k] * l[j][k];
+                }
+
+                if (i == j) {
+                    // Relative to the diagonal so the test doesn't depend on the units of the regressor
+                    if (sum <= xtx[i][i] * kMinPivot) {
+                        return false;
+                    }
+                    l[i][i] = sqrtf(sum);
+                } else {
+                    l[i][j] = sum / l[j][j];
+                }
+            }
+        }
+
+        // L z = X'y, then L' theta = z
+        float z[N];
+        for (size_t i = 0; i < N; i++) {
+            float sum = xty[i];
+            for (size_t k = 0; k < i; k++) {
+                sum -= l[i][k] * z[k];
+            }
+            z[i] = sum / l[i][i];
+        }
+        for (size_t i = N; i-- > 0;) {
+            float sum = z[i];
+            for (size_t k = i + 1; k < N; k++) {
+                sum -= l[k][i] * theta[k];
+            }
+            theta[i] = sum / l[i][i];
+        }
+        return true;
+    }
+
+private:
+    static constexpr float kMinPivot = 1e-6f;
+
+    float xtx[N][N];
+    float xty[N];
+    size_t count;
+};
+
+#endif  // LEAST_SQUARES_H_
@@ -6,11 +6,11 @@ struct Range {
     float min;
     float max;
 
-    float saturate(float a) {
+    float saturate(float a) const {
         return ::saturate(a, min, max);
     }
     
-    bool in(float a) {
+    bool in(float a) const {
         return a >= min && a <= max;
     }
 };
\ No newline at end of file
@@ -0,0 +1,102 @@
+#ifndef PRESSURE_AUTO_ZERO_H
+#define PRESSURE_AUTO_ZERO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "drivers/sensor.h"
+
+/**
+ * Keeps the pressure sensor's zero. The bridge offset varies from unit to unit and drifts with temperature, and the
+ * peak and plateau readings drift with it.
+ *
+ * A capture runs while the circuit is known to be open to the atmosphere, i.e. while homing or idle with the bag open.
+ * It skips settle_ms for any flow to die away, collects NUM_CAPTURE_SAMPLES readings and moves the zero by their
+ * median, which a few outliers can't drag along. The settling is timed by the samples' own timestamps. A gap longer
+ * than MAX_SAMPLE_STEP_US or a sample out of order, and the capture can't tell the circuit stayed quiet, so it settles
+ * again from there. The capture is thrown away if the middle half of the readings spreads more than
+ * max_capture_spread, or if the zero would end up more than max_zero from nothing (not actually open to the
+ * atmosphere, or a broken bridge). If the median of its second half moved more than max_capture_trend from the first
+ * the circuit is still emptying, the capture is thrown away and settles again. A decay the trend only just shows is
+ * still several times that above the zero, so keep it close to the sensor's noise.
+ *
+ * While ventilating, the pressure each expiration levels off at is tracked. It only changes slowly through drift, so
+ * drift_gain of its change is taken off the zero each breath, up to max_drift from the last capture. A step bigger
+ * than drift_step is someone turning the PEEP valve and becomes the new reference instead.
+ */
+class PressureAutoZero {
+public:
+    static constexpr size_t NUM_CAPTURE_SAMPLES = 32;
+    static constexpr uint32_t MAX_SAMPLE_STEP_US = 250000;  // A few samples of the ADS1231 at 10 SPS
+
+    struct Parameters {
+        uint32_t settle_ms;
+        float max_capture_spread;  // cmH2O
+        float max_capture_trend;   // cmH2O
+        float max_zero;            // cmH2O
+        float drift_gain;          // Per breath, [0, 1]
+        float drift_step;          // cmH2O
+        float max_drift;           // cmH2O
+        float store_threshold;     // cmH2O, a change of the zero worth saving
+    };
+
+    // zero_cmH2O is what the sensor subtracts from its readings, it is adjusted in place
+    PressureAutoZero(Parameters params, float *zero_cmH2O);
+
+    // Start over from the zero as it is now, e.g. once it has been loaded from the EEPROM
+    void reset();
+
+    /**
+     * Only while the circuit is open to the atmosphere. Cancel it if that stops being true before it's done.
+     */
+    void start_capture();
+    void cancel_capture();
+    bool is_capturing() const;
+
+    // Every sample while capturing, with the current zero already taken off
+    void on_sample(ISensor::Sample const &sample);
+
+    // Once a breath, where the expiration levelled off
+    void on_expiration_plateau(float pressure_cmH2O);
+
+    /**
+     * True once the zero has moved far enough from what was last saved that it should be saved again, then start the
+     * store. The request stays until on_stored() reports the store written, a store that fails or never starts is
+     * asked for again. Not again while one is in progress.
+     */
+    bool take_store_request();
+
+    // The store's callback, arg is the PressureAutoZero. Also call it with false if the store couldn't be started.
+    static void on_stored(bool success, void *arg);
+
+    uint16_t get_num_captures() const;
+    uint16_t get_num_failed_captures() const;
+
+private:
+    Parameters params;
+    float *zero_cmH2O;
+
+    bool is_capture_running;
+    uint64_t capture_start_us;  // Of the settling, moved on when the samples aren't in step
+    bool has_sample;            // Since the capture started
+    uint64_t last_sample_us;
+    float samples[NUM_CAPTURE_SAMPLES];
+    size_t num_samples;
+    uint16_t num_captures;
+    uint16_t num_failed_captures;
+
+    float captured_zero_cmH2O;  // Drift is limited around this
+    float saved_zero_cmH2O;
+    float storing_zero_cmH2O;  // The zero the store in progress took
+    bool is_store_requested;
+    bool is_store_running;
+
+    bool has_reference;
+    float reference_cmH2O;  // Where the expirations level off
+
+    void finish_capture();
+    static void sort(float *x, size_t n);
+    void move_zero(float zero);
+};
+
+#endif
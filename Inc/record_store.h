@@ -5,19 +5,86 @@
 
 #include "eeprom.h"
 
+/**
+ * Each entry owns a ring of NUM_SLOTS slots in the EEPROM. A slot holds one complete version of the entry:
+ *
+ *   | SlotHeader (sequence number, schema, size) | data | CRC16 over header + data |
+ *
+ * A store never overwrites the newest version, it goes into the slot after it with the next sequence number. If power
+ * is lost part way through, that slot fails its CRC and the previous version is still intact. On load the valid slot
+ * with the highest sequence number wins. Rotating through the ring spreads the wear over NUM_SLOTS times the space.
+ */
 class RecordStore {
 public:
-    static constexpr uint32_t VERSION_NUM = 1;
+    // Layout of the store itself. Changes to a single record's layout are handled by its schema, see add_migration()
+    static constexpr uint32_t VERSION_NUM = 3;
+    static constexpr uint16_t MAX_BUFFER_SIZE_BYTES = 256;
+
+    /**
+     * Upgrades a record in place from schema N to N + 1. buf holds size bytes of the old layout and has room for
+     * MAX_BUFFER_SIZE_BYTES. Returns the size of the new layout, 0 if the record can't be upgraded.
+     */
+    typedef uint16_t (*Migration)(uint8_t *buf, uint16_t size);
+
+    // Blocks touched by the last store. Entries that haven't changed since they were last loaded or stored are skipped.
+    struct __attribute__((__packed__)) Stats {
+        uint16_t pages_written;
+        uint16_t pages_skipped;
+    };
 
     RecordStore(EEPROM<uint16_t, uint8_t> *eeprom);
 
     bool init();
 
-    bool add_entry(const char *name, void *data, uint16_t size_bytes, uint16_t max_size_bytes);
+    /**
+     * max_size_bytes is the space reserved in the EEPROM, leave headroom so the struct can grow in later schemas
+     * without moving the entries after it.
+     */
+    bool add_entry(const char *name, void *data, uint16_t size_bytes, uint16_t max_size_bytes, uint16_t schema = 0);
+
+    /**
+     * Register fn to upgrade entry name from from_schema to from_schema + 1. Records stored with an older schema are
+     * run through the chain of migrations when loaded, then written back in the current layout.
+     */
+    bool add_migration(const char *name, uint16_t from_schema, Migration fn);
+
+    /**
+     * The first store layout (VERSION_NUM 1) kept a single copy of each entry, its data then a CRC16, allocated back
+     * to back after the header. Register the entries it had in the order they were added then, with the size they had
+     * then. When first_load() finds that layout it imports them as schema 1, through the migrations, instead of
+     * starting over with the defaults.
+     */
+    bool add_legacy_entry(const char *name, uint16_t size_bytes);
 
     bool store_all();
     bool load_all();
 
+    /**
+     * Write every entry in the background. Each entry is snapshotted (data + CRC) just before it is queued, so the
+     * live structs may keep changing while the save is in progress. cb is called once when all entries are written.
+     */
+    bool store_all_async(EEPROM<uint16_t, uint8_t>::Callback cb = nullptr, void *arg = nullptr);
+
+    /**
+     * Write entry name in the background, the same way. The others are left as they are, whatever has changed in
+     * them.
+     */
+    bool store_async(const char *name, EEPROM<uint16_t, uint8_t>::Callback cb = nullptr, void *arg = nullptr);
+
+    /**
+     * Erase the EEPROM, in the background.
+     */
+    bool erase_async(EEPROM<uint16_t, uint8_t>::Callback cb = nullptr, void *arg = nullptr);
+
+    /**
+     * Erase the EEPROM then write out the current values of every entry, in the background.
+     */
+    bool reset_async(EEPROM<uint16_t, uint8_t>::Callback cb = nullptr, void *arg = nullptr);
+
+    bool is_busy();
+
+    Stats const *get_stats() const;
+
     bool first_load();
 
     bool load(const char *name, bool force_load);
@@ -26,10 +93,15 @@ public:
     EEPROM<uint16_t, uint8_t> *get_eeprom();
 
 private:
-    static constexpr uint16_t MAX_BUFFER_SIZE_BYTES = 256;
     static constexpr uint16_t MAX_NUM_ENTRIES = 8;
+    static constexpr uint16_t MAX_NUM_MIGRATIONS = 16;
+    static constexpr uint32_t LEGACY_VERSION_NUM = 1;
+    static constexpr uint16_t LEGACY_SCHEMA = 1;
     static constexpr uint16_t NUM_HEADER_ENTRIES = 1;
     static constexpr uint16_t CRC_SIZE_BYTES = 2;
+    static constexpr uint16_t BLOCK_SIZE_BYTES = 32;  // Matches the LC064 page size, slots are page aligned
+    static constexpr uint16_t NUM_SLOTS = 8;
+    static constexpr uint16_t SHADOW_BUFFER_SIZE_BYTES = 384;
     static constexpr uint32_t MAGIC_HEADER = 0x4142564D;  // "ABVM"
 
     EEPROM<uint16_t, uint8_t> *eeprom;
@@ -41,22 +113,92 @@ private:
 
     Header header;
 
+    // Sequence 0 is never written, an erased (all zero) slot has a valid CRC and must not look like a version
+    struct __attribute__((__packed__)) SlotHeader {
+        uint32_t sequence;
+        uint16_t schema;
+        uint16_t size;  // Of the data, so records from an older schema can be read back
+    };
+
+    static constexpr uint16_t SLOT_OVERHEAD_BYTES = sizeof(SlotHeader) + CRC_SIZE_BYTES;
+
     struct Entry {
         const char *name;
         void *data;
         uint16_t size;
+        uint16_t schema;
         bool is_valid;
-        uint16_t address;
+        bool is_scanned;       // The slots have been searched for the newest version since boot/erase
+        uint16_t address;      // Start of slot 0
+        uint16_t slot_stride;  // Bytes between slots, a whole number of blocks
+        uint8_t slot;          // Slot holding the newest version
+        uint32_t sequence;     // Sequence number of the newest version, 0 if there is none
+        uint8_t *shadow;       // Data of the newest version, nullptr if out of shadow space
+        bool is_shadow_valid;
     };
 
     Entry entries[MAX_NUM_ENTRIES + NUM_HEADER_ENTRIES];
     uint16_t num_entries;
-    uint8_t write_buf[MAX_BUFFER_SIZE_BYTES];
+
+    struct MigrationEntry {
+        Entry const *entry;
+        uint16_t from_schema;
+        Migration fn;
+    };
+
+    MigrationEntry migrations[MAX_NUM_MIGRATIONS];
+    uint16_t num_migrations;
+    uint16_t num_migrated;  // Entries upgraded by the last load
+
+    struct LegacyEntry {
+        Entry *entry;
+        uint16_t size;
+    };
+
+    LegacyEntry legacy_entries[MAX_NUM_ENTRIES];
+    uint16_t num_legacy_entries;
+    uint8_t write_buf[sizeof(SlotHeader) + MAX_BUFFER_SIZE_BYTES + CRC_SIZE_BYTES];
+
+    uint8_t shadow_buf[SHADOW_BUFFER_SIZE_BYTES];
+    uint16_t shadow_used;
+
+    Stats stats;
+
+    bool is_storing;
+    bool is_store_after_erase;
+    uint16_t store_idx;
+    uint16_t store_end;  // One past the last entry of the store in progress
+    uint16_t store_len;
+    EEPROM<uint16_t, uint8_t>::Callback store_cb;
+    void *store_cb_arg;
 
     Entry *find_entry_by_name(const char *name);
 
     bool load_entry(Entry *entry, bool force_load);
+    bool scan_entry(Entry *entry);
     bool store_entry(Entry *entry);
+    uint16_t pack_entry(Entry *entry);
+
+    uint16_t slot_address(Entry const *entry, uint8_t slot) const;
+    uint8_t next_slot(Entry const *entry) const;
+    bool read_slot(Entry *entry, uint8_t slot, uint16_t size, bool *is_valid);
+    bool migrate_entry(Entry *entry, SlotHeader const *slot_header);
+    Migration find_migration(Entry const *entry, uint16_t from_schema);
+    bool is_entry_dirty(Entry *entry);
+    bool import_legacy();
+    bool read_legacy(uint16_t *addr, uint16_t size, bool *is_valid);
+    void commit_entry(Entry *entry, uint16_t len);
+    void invalidate_slots();
+
+    bool start_store_async(uint16_t first, uint16_t end);
+    bool next_dirty_entry();
+    void finish_async(bool success);
+
+    static void on_entry_stored(bool success, void *arg);
+    static void on_erased(bool success, void *arg);
+
+    static uint16_t num_blocks(uint16_t len);
+    static bool is_newer(uint32_t a, uint32_t b);
 
     void reset_header();
 };
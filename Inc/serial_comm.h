@@ -77,12 +77,12 @@ private:
         MSG_STREAM_RESP,
     };
 
-    struct __packed __aligned(1) MsgHeader {
+    struct __attribute__((__packed__)) MsgHeader {
         uint8_t type : 4;
         uint8_t flags : 4;
     };
 
-    struct __packed __aligned(1) MsgFrame {
+    struct __attribute__((__packed__)) MsgFrame {
         MsgHeader header;
         uint8_t id;
         uint8_t size;
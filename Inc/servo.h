@@ -7,16 +7,18 @@
 #include <math.h>
 
 #include "controls/pid.h"
+#include "controls/velocity_estimator.h"
 #include "drivers/pin.h"
 #include "drv8873.h"
 #include "encoder.h"
 #include "math/conversions.h"
 #include "math/dsp.h"
+#include "math/filters.h"
 #include "math/range.h"
 
 class Servo {
 public:
-    enum class Mode { OFF, VELOCITY, POSITION };
+    enum class Mode { OFF, VELOCITY, POSITION, CURRENT };
 
     struct Config {
         float gear_reduction;  // X : 1
@@ -32,15 +34,54 @@ public:
         uint32_t to_int();
     };
 
+    /**
+     * The cascade is position -> velocity -> current -> PWM. The position and velocity loops run from update(), the
+     * current loop runs from the ADC interrupt on every PWM period. cur_pid_params' period is taken from the PWM
+     * timer in init().
+     *
+     * The current loop starts out of the cascade, the velocity loop drives the PWM directly and its gains are in duty.
+     * See set_cascade_enabled().
+     */
     Servo(uint32_t update_period_ms, DRV8873 *driver, Encoder *encoder, Pin *limit_switch, Config cfg,
           PID::Params vel_pid_params, Range<float> vel_limits, PID::Params pos_pid_params, Range<float> pos_limits,
-          bool is_inverted = false);
+          PID::Params cur_pid_params, bool is_inverted = false);
 
     void set_pos(float pos);
     void set_pos_deg(float pos);
 
+    /**
+     * Follow a planned trajectory. vel and acc are fed forward into the cascade, and the position target is
+     * extrapolated along vel between calls, so the planner can run slower than the servo.
+     */
+    void set_trajectory(float pos, float vel, float acc);  // rads, rads/s, rads/s^2
+    void set_trajectory_deg(float pos, float vel, float acc);
+
     void set_velocity(float vel);
 
+    // Current straight to the inner loop, bypassing the velocity loop. Limited to the velocity loop's output limits.
+    // Needs the cascade, without it the motor is left unpowered.
+    void set_current(float amps);
+
+    /**
+     * Put the current loop under the velocity loop, whose output becomes amps instead of PWM duty. Only enable it with
+     * velocity gains tuned for it. The velocity integrator restarts, its units changed.
+     */
+    void set_cascade_enabled(bool enable);
+    bool is_cascade_enabled() const;
+
+    // Gains can be changed on the fly, the integrators carry over without a bump
+    void set_vel_pid_params(PID::Params const &params);
+    void set_pos_pid_params(PID::Params const &params);
+    PID::Params const &get_vel_pid_params() const;
+    PID::Params const &get_pos_pid_params() const;
+
+    // The current loop is paused while they change under it, its integrator restarts
+    void set_cur_pid_params(PID::Params const &params);
+
+    // Measurements before the filters, as of the last update()
+    float get_unfiltered_position();
+    float get_unfiltered_velocity() const;
+
     void init();
     void zero();
     void reset();
@@ -48,20 +89,43 @@ public:
     void update();
     void set_mode(Mode m);
 
+    // Inner current loop, runs in the ADC interrupt
+    void update_current();
+
     bool limit_switch_pressed();
     float velocity = 0;
     float position = 0;
-    float command = 0;
+    float command = 0;  // Current commanded by the velocity loop, A
     float target_pos = 0;
     float commanded_pos = 0;
 
     float target_velocity = 0;
     float commanded_velocity = 0;
+    float target_command = 0;  // Mode::CURRENT, A
+
+    bool is_following_trajectory = false;
+    float trajectory_pos = 0;  // The planner's last point and when it was set
+    uint64_t trajectory_us = 0;
+    float ff_velocity = 0;
+    float ff_accel = 0;
     Faults faults = {.no_encoder = false, .wrong_dir = false};
 
-    float i_measured;
+    float i_measured = 0;
+    volatile float i_sample = 0;  // Latest current sample, A
+    volatile float target_current = 0;
 
 private:
+    // Cutoffs of the measurement and command filters
+    static constexpr float POSITION_FILTER_HZ = 16.8f;
+    static constexpr float VELOCITY_FILTER_HZ = 40.f;  // Only takes the edge timing jitter off the M/T estimate
+    static constexpr float CURRENT_FILTER_HZ = 1.6f;
+    static constexpr float COMMAND_FILTER_HZ = 366.f;
+
+    static constexpr uint32_t VELOCITY_MIN_WINDOW_US = 500;
+    static constexpr uint32_t VELOCITY_TIMEOUT_US = 100000;
+    // Without a new point from the planner for this long it has stopped, hold there rather than run on
+    static constexpr uint32_t TRAJECTORY_HOLD_US = 50000;
+
     uint32_t period_ms;
     Mode mode;
     DRV8873 *driver;
@@ -75,6 +139,18 @@ private:
     PID pos_pid;
     Range<float> pos_limits;
 
+    PID cur_pid;
+    bool is_cascade = false;
+    volatile bool is_current_loop_enabled = false;
+
+    MTVelocityEstimator velocity_estimator;
+
+    OnePoleLowPass position_filter;
+    OnePoleLowPass velocity_filter;
+    OnePoleLowPass current_filter;
+    OnePoleLowPass commanded_pos_filter;
+    OnePoleLowPass commanded_vel_filter;
+
     int32_t last_pos = 0;
     uint32_t pwm_freq;
     int32_t no_encoder_counts = 0;
@@ -86,6 +162,10 @@ private:
     bool test_no_encoder_fault(int32_t counts);
     bool test_wrong_direction();
     bool test_excessive_pos_error();
+
+    void set_current_loop_enabled(bool enable);
+
+    static void on_current_sample(void *arg);
 };
 
 #endif  // MOTOR_H_
\ No newline at end of file
@@ -9,6 +9,7 @@ public:
         UNDER_PRESSURE,
         OVER_CURRENT,
         MOTION_FAULT,
+        SENSOR_FAULT,
         NUM_ALARMS
     };
 
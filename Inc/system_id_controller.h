@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "drivers/sensor.h"
+#include "drv8873.h"
+#include "math/range.h"
+#include "serial_comm.h"
+#include "servo.h"
+
+/**
+ * System identification of the arm, motor and bag.
+ *
+ * The servo loops are switched off and the PWM duty is driven directly. The duty is an excitation (a PRBS or a linear
+ * chirp) on top of a weak position hold whose target goes across sweep and back, so the capture covers the travel
+ * into the bag. Duty, position, velocity, current and pressure are captured every sample_period_ms into a RAM buffer,
+ * which can be read out with SystemIdCaptureRPC and fitted on the host. Once the buffer is full it is fitted here by
+ * least squares:
+ *
+ *   - Arm: dw/dt = K i - damping w - friction sign(w) - load pressure, the velocity and acceleration taken from the
+ *     first and second differences of position. If the damping or the friction comes out negative it is left out and
+ *     the other one fitted alone.
+ *   - Motor: i = g_u duty + g_w w
+ *   - Bag: pressure = c0 + c1 x + c2 x^2, over the samples with x = position - bag_contact_pos >= 0
+ *
+ * The duty only changes on sample boundaries. Call update() at the servo's rate, before Servo::update(). The servo is
+ * left holding position when the capture ends.
+ */
+class SystemIdController {
+public:
+    static constexpr size_t NUM_SAMPLES = 1024;
+    // A sweep that only grazes the bag leaves a few samples just past contact, too few to fit its curve to
+    static constexpr size_t MIN_BAG_SAMPLES = NUM_SAMPLES / 8;
+
+    enum class State { IDLE = 0, CAPTURE, DONE, FAILED };
+
+    enum class Excitation : uint8_t { PRBS, CHIRP };
+
+    struct Parameters {
+        Excitation excitation;
+        float amplitude;       // PWM duty
+        uint32_t prbs_bit_ms;  // Each bit of the PRBS is held this long
+        float chirp_start_hz;
+        float chirp_end_hz;
+        float hold_gain;       // PWM duty / rad
+        Range<float> sweep;    // rads, the hold target goes min -> max -> min over the capture
+        Range<float> travel;   // rads, the capture is stopped outside of this
+        uint32_t sample_period_ms;
+    };
+
+    // Scaled to 16 bits to fit the buffer in RAM
+    struct __attribute__((__packed__)) Sample {
+        int16_t duty;      // 1 / 32767
+        int16_t position;  // rad / 10000
+        int16_t velocity;  // mrad / s
+        int16_t current;   // mA
+        int16_t pressure;  // cmH2O / 100
+    };
+
+    SystemIdController(Servo *motor, DRV8873 *driver, ISensor *pressure_sensor, Parameters params);
+
+    // bag_contact_pos is where the bag starts to be squeezed, rads
+    void start(float bag_contact_pos);
+    bool is_running();
+    bool is_done();
+    bool is_failed();
+    State update();
+
+    /**
+     * Fit the model to n samples taken sample_period_s apart. Returns false if any part of it couldn't be fitted, e.g.
+     * the arm never got far enough into the bag, or the arm's fit isn't physical: accel_per_amp > 0, damping and
+     * friction >= 0.
+     */
+    static bool fit(Sample const *samples, size_t n, float sample_period_s, float bag_contact_pos,
+                    PlantModelConfig *model);
+
+    State get_state() const;
+    PlantModelConfig const &get_model() const;
+    Sample const *get_samples() const;
+    size_t get_num_samples() const;  // Captured so far
+
+private:
+    static constexpr uint16_t PRBS_SEED = 0xACE1;
+
+    Servo *motor;
+    DRV8873 *driver;
+    ISensor *pressure_sensor;
+    Parameters params;
+    State state;
+
+    Sample samples[NUM_SAMPLES];
+    size_t num_samples;
+    uint32_t last_sample_ms;
+    float bag_contact_pos;
+
+    uint16_t prbs;
+    float chirp_phase;  // cycles
+
+    PlantModelConfig model;
+
+    float excitation(size_t k);
+    void finish(State s);
+};
+
+/**
+ * Reads out the system identification capture. Write the index of the first sample wanted as a uint16_t, then read
+ * back a Chunk starting there.
+ */
+class SystemIdCaptureRPC : public CommEndpoint {
+public:
+    static constexpr size_t SAMPLES_PER_CHUNK = 4;
+
+    struct __attribute__((__packed__)) Chunk {
+        uint16_t index;
+        uint16_t num_samples;  // In the capture, not this chunk
+        uint8_t state;         // SystemIdController::State
+        SystemIdController::Sample samples[SAMPLES_PER_CHUNK];
+    };
+
+    SystemIdCaptureRPC(uint8_t id, SystemIdController *sysid);
+
+    uint8_t write(void *data, size_t size) override;
+    uint8_t read(void *data, size_t size) override;
+
+private:
+    SystemIdController *sysid;
+    uint16_t index;
+};
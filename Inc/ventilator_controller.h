@@ -1,10 +1,13 @@
 #pragma once
 
 #include "config.h"
+#include "controls/iterative_learning.h"
 #include "controls/motion_planner.h"
 #include "drivers/sensor.h"
 #include "math/conversions.h"
 #include "math/dsp.h"
+#include "math/filters.h"
+#include "pressure_auto_zero.h"
 #include "servo.h"
 
 class VentilatorController {
@@ -20,13 +23,24 @@ public:
     };
 
     VentilatorController(IMotionPlanner *motion, Servo *motor, ISensor *pressure, float tv_settings[],
-                         uint32_t num_tv_settings, float bpm_settings[], uint32_t num_bpm_settings);
+                         uint32_t num_tv_settings, float bpm_settings[], uint32_t num_bpm_settings,
+                         IterativeLearningControl *ilc = nullptr, PressureAutoZero *auto_zero = nullptr);
     void start();
     void stop();
     float update();
 
+    /**
+     * Call with every pressure sample as soon as it has been read. update() only sees the pressure every 10 ms, too
+     * late to catch the start of a patient's effort. Starts a breath right away if it detects one. The slopes are taken
+     * between the samples' timestamps, not when they happened to be handed over.
+     */
+    void on_pressure_sample(ISensor::Sample const &sample);
+
     void reset();
 
+    // Only while stopped, swapping planners mid breath would jump the motor
+    bool set_motion_planner(IMotionPlanner *planner);
+
     bool is_running() {
         return is_operational;
     }
@@ -50,6 +64,16 @@ public:
         return kVentMotionConfig.open_pos_deg;
     }
 
+    // Of the breath in progress
+    inline VentMode get_mode() const {
+        return breath.mode;
+    }
+
+    // Breaths started by the patient rather than the backup rate
+    inline uint32_t get_num_triggered_breaths() const {
+        return num_triggered_breaths;
+    }
+
     inline uint8_t get_rate_idx() {
         return next_rate_idx;
     }
@@ -82,7 +106,8 @@ private:
     Servo *motor;
     ISensor *pressure_sensor;
 
-    State state;
+    State state;       // Segment the planner is running
+    State next_state;  // Next segment to plan
 
     bool is_measure_plateau_cycle;
 
@@ -92,12 +117,56 @@ private:
     uint8_t num_rate_settings = 6;
     float *rate_settings;
 
-    uint8_t current_tv_idx;
     uint8_t next_tv_idx;
-
-    uint8_t current_rate_idx;
     uint8_t next_rate_idx;
 
+    // Everything a breath's timing and positions depend on, the breath plan is rebuilt when any of these change
+    struct BreathSettings {
+        float tidal_volume_pos_deg;
+        float rate_bpm;
+        float expiration_part;
+        float open_pos_deg;
+        uint32_t plateau_time_ms;
+        uint32_t fast_open_time_ms;
+        bool is_measure_plateau_cycle;
+        VentMode mode;
+        float target_pressure_cmH2O;
+        float rise_time_ms;
+
+        bool operator==(BreathSettings const &other) const {
+            return tidal_volume_pos_deg == other.tidal_volume_pos_deg && rate_bpm == other.rate_bpm &&
+                   expiration_part == other.expiration_part && open_pos_deg == other.open_pos_deg &&
+                   plateau_time_ms == other.plateau_time_ms && fast_open_time_ms == other.fast_open_time_ms &&
+                   is_measure_plateau_cycle == other.is_measure_plateau_cycle && mode == other.mode &&
+                   target_pressure_cmH2O == other.target_pressure_cmH2O && rise_time_ms == other.rise_time_ms;
+        }
+    };
+
+    struct BreathPlan {
+        MotionPlan inspiration;
+        MotionPlan hold;
+        MotionPlan expiration;
+        MotionPlan expiration_after_fast_open;  // The fast open already used up part of the expiration
+        uint32_t period_ms;
+        VentMode mode;
+        float target_pressure_cmH2O;
+        float rise_time_ms;
+    };
+
+    BreathSettings breath_settings;
+    BreathPlan breath;          // Plan for the breath in progress
+    BreathPlan pending_breath;  // Swapped in at the next breath boundary
+    bool is_breath_pending;
+
+    // Learns the tracking error of each breath and corrects the next one, nullptr to run without
+    IterativeLearningControl *ilc;
+    uint32_t breath_start_ms;
+
+    // Told where each expiration levelled off to track the sensor's drift, nullptr to run without
+    PressureAutoZero *auto_zero;
+    bool is_expiration_settled = false;
+    float end_expiration_cmH2O = 0;
+
     bool is_operational;
 
     bool is_fast_open = false;
@@ -108,12 +177,66 @@ private:
     float last_plateau_pressure;
     float current_plateau_pressure;
 
-    float pressure_cmH2O = 0;
-    float peak_pressure_limit_cmH2O;
+    // update() runs every 10 ms or so, late as often as not. The pressure filter and loop go by the time it actually
+    // took, within these limits.
+    static constexpr float UPDATE_HZ = 100;
+    static constexpr float MIN_UPDATE_S = .001f;
+    static constexpr float MAX_UPDATE_S = .05f;
+    static constexpr float PRESSURE_FILTER_TAU_S = 1 / (2 * cx::kPi * 11);
 
-    uint32_t plateau_time;
+    bool is_update_timed = false;  // The first update has nothing to time
+    uint64_t last_update_us = 0;
+    float update_dt = 1 / UPDATE_HZ;  // s, since the last update
 
-    float inspiration_time() const;
+    float pressure_cmH2O = 0;
+    float peak_pressure_limit_cmH2O;
 
-    float expiration_time() const;
+    // VentMode::PRESSURE. Through inspiration and the hold the planner only keeps time, the arm goes wherever the
+    // pressure loop puts it.
+    bool is_pressure_controlled = false;
+    PID pressure_pid{kVentPressureConfig.pressure_pid_params, 1 / UPDATE_HZ};  // Its period set each update
+    float pressure_start_cmH2O;        // Where the pressure target ramps up from
+    Range<float> pressure_pos_limits;  // From the open to the tidal volume position
+    float pressure_pos_deg;            // Last position the pressure loop commanded
+
+    // Assist control, the expiration's pressure is watched for the patient's effort
+    static constexpr uint32_t TRIGGER_LOCKOUT_MS = 300;  // Into the expiration before anything can trigger
+    static constexpr float TRIGGER_SETTLED_SLOPE = 2;    // cmH2O/s, the exhalation is over once it falls slower
+    static constexpr float TRIGGER_BASELINE_TAU_S = .5f;
+    static constexpr float TRIGGER_SLOPE_TAU_S = .02f;
+    static constexpr float SETTLE_SLOPE_TAU_S = .1f;
+    // The ADS1231 runs at 10 or 80 SPS. Samples closer together or further apart than that mean the clock jumped or
+    // samples were lost, and the slopes start over.
+    static constexpr uint64_t SAMPLE_MIN_STEP_US = 5000;
+    static constexpr uint64_t SAMPLE_MAX_STEP_US = 250000;
+    static constexpr uint64_t SLOPE_SETTLE_US = 300000;  // Of samples in step before the slopes are relied on
+
+    uint32_t expiration_start_ms;
+    bool is_trigger_armed = false;
+    float trigger_baseline_cmH2O;  // Where the expiration settled
+    float trigger_slope = 0;       // cmH2O/s
+    float settle_slope = 0;        // cmH2O/s, smoothed more to tell when the exhalation is over
+    float last_sample_cmH2O = 0;
+    uint64_t last_sample_us = 0;
+    uint64_t slope_start_us = 0;
+    bool is_slope_valid = false;
+    uint32_t num_triggered_breaths = 0;
+
+    // Advance the planner and hand its references to the servo
+    void run_motion(float pos);
+
+    bool is_triggered(float pressure, float dt);
+    void trigger_breath();
+
+    void start_pressure_control();
+    float run_pressure_control();
+
+    void fast_open();
+    void plan_ahead();
+    void on_segment_start(State s);
+
+    void update_breath_plan();
+
+    static float inspiration_time(BreathSettings const &settings);
+    static float expiration_time(BreathSettings const &settings, uint32_t plateau_time);
 };
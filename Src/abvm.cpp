@@ -3,13 +3,17 @@
 #include <string.h>
 
 #include "ads1231.h"
+#include "autotune_controller.h"
 #include "bootloader.h"
 #include "clock.h"
 #include "config.h"
 #include "control_panel.h"
+#include "controls/iterative_learning.h"
+#include "controls/s_curve_planner.h"
 #include "controls/trapezoidal_planner.h"
 #include "data_logger.h"
 #include "drivers/pin.h"
+#include "drivers/sensor_health.h"
 #include "drv8873.h"
 #include "encoder.h"
 #include "factory/tests.h"
@@ -18,10 +22,12 @@
 #include "iwdg.h"
 #include "lc064.h"
 #include "main.h"
+#include "pressure_auto_zero.h"
 #include "record_store.h"
 #include "serial_comm.h"
 #include "servo.h"
 #include "spi.h"
+#include "system_id_controller.h"
 #include "sys/alarms.h"
 #include "sys/array_helpers.h"
 #include "tim.h"
@@ -51,8 +57,11 @@ Pin rate_char_2_pin{RATE_CHAR_2_GPIO_Port, RATE_CHAR_2_Pin};
 Pin rate_char_3_pin{RATE_CHAR_3_GPIO_Port, RATE_CHAR_3_Pin};
 Pin homing_switch{LIMIT2_GPIO_Port, LIMIT2_Pin};
 
+static_assert((ADC_SPI_MISO_Pin & ADS1231::DATA_READY_PINS) == ADC_SPI_MISO_Pin,
+              "The ADS1231's data ready interrupt is only handled on EXTI lines 5-9");
 ADS1231 pressure_sensor(ADC1_PWRDN_GPIO_Port, ADC1_PWRDN_Pin, &hspi1, ADC_SPI_MISO_GPIO_Port, ADC_SPI_MISO_Pin,
-                        ADC_SPI_SCK_GPIO_Port, ADC_SPI_SCK_Pin, &kSensorConfig.pressure_params);
+                        ADC_SPI_SCK_GPIO_Port, ADC_SPI_SCK_Pin, &kSensorConfig.pressure_params,
+                        &kSensorConfig.pressure_zero_cmH2O);
 
 DRV8873 motor_driver(MC_SLEEP_GPIO_Port, MC_SLEEP_Pin, MC_DISABLE_GPIO_Port, MC_DISABLE_Pin, MC_FAULT_GPIO_Port,
                      MC_FAULT_Pin, &htim2, TIM_CHANNEL_1, TIM_CHANNEL_3, &hspi2, MC_SPI_CS_GPIO_Port, MC_SPI_CS_Pin,
@@ -62,10 +71,13 @@ Encoder encoder(&htim4);
 
 USBComm usb_comm;
 
-TrapezoidalPlanner motion({.4, .4}, 10);
+TrapezoidalPlanner motion({.4, .4});
+SCurvePlanner s_curve_motion({.4, .4, .5});
+IterativeLearningControl breath_learning({.learning_gain = .5, .forgetting = .98, .max_correction = 5, .lead_bins = 2});
 
 Servo motor(1, &motor_driver, &encoder, &homing_switch, kMotorConfig.motor_params, kMotorConfig.motor_vel_pid_params,
-            kMotorConfig.motor_vel_limits, kMotorConfig.motor_pos_pid_params, kMotorConfig.motor_pos_limits);
+            kMotorConfig.motor_vel_limits, kMotorConfig.motor_pos_pid_params, kMotorConfig.motor_pos_limits,
+            kMotorCurrentConfig.motor_cur_pid_params);
 
 ControlPanel controls(&sw_start_pin, &sw_stop_pin, &sw_vol_up_pin, &sw_vol_dn_pin, &sw_rate_up_pin, &sw_rate_dn_pin,
                       &led_power_pin, &led_fault_pin, &led_in_pin, &led_out_pin, &vol_char_1_pin, &vol_char_2_pin,
@@ -73,10 +85,60 @@ ControlPanel controls(&sw_start_pin, &sw_stop_pin, &sw_vol_up_pin, &sw_vol_dn_pi
 
 UI_V1 ui(&controls);
 
+// A window is 0.4 s at 80 SPS. Even a fast open at 10 SPS keeps the noise below 5 cmH2O, a floating input is
+// tens of cmH2O. Updated in the 10 ms block, which only ever runs late, so the times only ever stretch.
+SensorHealth pressure_health({.max_gap_ms = 500, .stuck_ms = 1000, .window_samples = 32, .max_noise = 15}, 10);
+
+// Zeroed while homing and whenever the ventilator is stopped, the drift is followed through the expirations
+PressureAutoZero pressure_zero({.settle_ms = 1000,
+                                .max_capture_spread = .5,
+                                .max_capture_trend = .1,
+                                .max_zero = 10,
+                                .drift_gain = .02,
+                                .drift_step = 1,
+                                .max_drift = 2,
+                                .store_threshold = .25},
+                               &kSensorConfig.pressure_zero_cmH2O);
+
 VentilatorController vent(&motion, &motor, &pressure_sensor, kVentTVSettings, countof(kVentTVSettings),
-                          kVentRateSettings, countof(kVentRateSettings));
+                          kVentRateSettings, countof(kVentRateSettings), &breath_learning, &pressure_zero);
 HomingController home(&motor);
 
+// Modes::CALIBRATION, run after homing. The arm sweeps out to about 35 degrees and settles at 20 degrees.
+AutotuneController autotune(&motor, {.cascade_vel_pid_params = {.Kp = 8,
+                                                                .Ki = 40,
+                                                                .Kd = 0,
+                                                                .Kff_vel = 0,
+                                                                .Kff_acc = 0,
+                                                                .d_filter_hz = 0,
+                                                                .output_limits = {-4, 4}},  // The motor's current limit
+                                     .spin_up_velocity = .8,
+                                     .spin_up_ms = 200,
+                                     .velocity_relay = {.amplitude = 2,
+                                                        .bias = 0,
+                                                        .hysteresis = .02,
+                                                        .num_cycles = 6,
+                                                        .timeout_ms = 2000},
+                                     .position_relay = {.amplitude = .5,
+                                                        .bias = 0,
+                                                        .hysteresis = .005,
+                                                        .num_cycles = 6,
+                                                        .timeout_ms = 5000},
+                                     .position_target = deg_to_rad(20),
+                                     .travel = {deg_to_rad(-5), deg_to_rad(60)}});
+
+// Modes::CALIBRATION, run after the autotune. About 10s of PRBS while the arm is swept from 10 to 45 degrees and back.
+SystemIdController sysid(&motor, &motor_driver, &pressure_sensor,
+                         {.excitation = SystemIdController::Excitation::PRBS,
+                          .amplitude = .25,
+                          .prbs_bit_ms = 20,
+                          .chirp_start_hz = .5,
+                          .chirp_end_hz = 8,
+                          .hold_gain = 2,
+                          .sweep = {deg_to_rad(10), deg_to_rad(45)},
+                          .travel = {deg_to_rad(-5), deg_to_rad(60)},
+                          .sample_period_ms = 10});
+
 LC064 eeprom(&hi2c1, 0);
 RecordStore record_store(&eeprom);
 
@@ -85,6 +147,10 @@ CommEndpoint version_ep(0x1, &APP_VERSION, sizeof(APP_VERSION));
 
 DataLogger logger_ep(0x0A, &pressure_sensor, &motor, &motor_driver, &vent);
 
+SystemIdCaptureRPC sysid_capture_ep(0x0B, &sysid);
+
+CommEndpoint pressure_health_ep(0x0C, pressure_health.get_stats(), sizeof(SensorHealth::Stats));
+
 ConfigCommandRPC config_cmd_ep(0x64, &record_store);
 
 // config endpoints
@@ -95,11 +161,15 @@ CommEndpoint vent_motion_config_ep(0x68, &kVentMotionConfig, sizeof(kVentMotionC
 CommEndpoint sensor_config_ep(0x69, &kSensorConfig, sizeof(kSensorConfig));
 CommEndpoint tv_config_ep(0x6A, &kVentTVSettings, sizeof(kVentTVSettings));
 CommEndpoint rr_config_ep(0x6B, &kVentRateSettings, sizeof(kVentRateSettings));
+CommEndpoint config_store_stats_ep(0x6C, record_store.get_stats(), sizeof(RecordStore::Stats));
+CommEndpoint plant_model_config_ep(0x6D, &kPlantModelConfig, sizeof(kPlantModelConfig));
+CommEndpoint vent_pressure_config_ep(0x6E, &kVentPressureConfig, sizeof(kVentPressureConfig));
 
 CommEndpoint *comm_endpoints[] = {
-      &hw_revision_ep,   &version_ep,         &logger_ep,           &config_cmd_ep,
-      &motor_config_ep,  &vent_app_config_ep, &vent_resp_config_ep, &vent_motion_config_ep,
-      &sensor_config_ep, &tv_config_ep,       &rr_config_ep,
+      &hw_revision_ep,        &version_ep,       &logger_ep,          &sysid_capture_ep,
+      &config_cmd_ep,         &motor_config_ep,  &vent_app_config_ep, &vent_resp_config_ep,
+      &vent_motion_config_ep, &sensor_config_ep, &tv_config_ep,       &rr_config_ep,
+      &config_store_stats_ep, &plant_model_config_ep, &vent_pressure_config_ep, &pressure_health_ep,
 };
 
 SerialComm ser_comm(comm_endpoints, sizeof(comm_endpoints) / sizeof(comm_endpoints[0]), &usb_comm);
@@ -151,19 +221,27 @@ extern "C" void abvm_init() {
 
     eeprom.init();
     record_store.init();
-    record_store.add_entry("MotorConfig", &kMotorConfig, sizeof(kMotorConfig), sizeof(kMotorConfig));
-    record_store.add_entry("VentAppConfig", &kVentAppConfig, sizeof(kVentAppConfig), sizeof(kVentAppConfig));
-    record_store.add_entry("VentRespConfig", &kVentRespirationConfig, sizeof(kVentRespirationConfig),
-                           sizeof(kVentRespirationConfig));
-    record_store.add_entry("VentMotionConfig", &kVentMotionConfig, sizeof(kVentMotionConfig),
-                           sizeof(kVentMotionConfig));
-    record_store.add_entry("SensorConfig", &kSensorConfig, sizeof(kSensorConfig), sizeof(kSensorConfig));
+    config_add_records(&record_store);
     HAL_IWDG_Refresh(&hiwdg);
 
     if (!record_store.first_load()) {
         // TODO: handle load failure
     }
 
+    // Homing opens the bag, the circuit is at the atmosphere
+    pressure_zero.reset();
+    pressure_zero.start_capture();
+
+    // The servo was built with the defaults, pick up the gains loaded from the EEPROM (e.g. from an autotune)
+    motor.set_cascade_enabled(kMotorCurrentConfig.is_cascade_enabled);
+    motor.set_vel_pid_params(kMotorConfig.motor_vel_pid_params);
+    motor.set_pos_pid_params(kMotorConfig.motor_pos_pid_params);
+    motor.set_cur_pid_params(kMotorCurrentConfig.motor_cur_pid_params);
+
+    if (kVentMotionConfig.motion_profile == MotionProfile::S_CURVE) {
+        vent.set_motion_planner(&s_curve_motion);
+    }
+
     // Power on self test here
 }
 
@@ -171,38 +249,90 @@ uint32_t last_motor = 0;
 uint32_t last_motion = 0;
 uint32_t last_ui = 0;
 
+// The servo's loops are tuned for this period, run it every millisecond tick rather than every other one
 uint32_t motor_interval = 1;
 
+// The calibration's gains and model, kept until the store takes them. A failed store leaves the calibration to redo.
+bool is_tuning_store_pending = false;
+bool is_tuning_store_failed = false;
+
+static void on_tuning_stored(bool success, void *arg) {
+    is_tuning_store_failed = !success;
+}
+
 extern "C" void abvm_update() {
     controls.update();
     ser_comm.update();
+    config_cmd_ep.update();
+    eeprom.update();
+
+    // Every conversion the interrupt queued since the last pass, the patient trigger can't wait for the 10 ms block
+    ISensor::Sample pressure_sample;
+    while (pressure_sensor.read_sample(&pressure_sample)) {
+        vent.on_pressure_sample(pressure_sample);
+        pressure_zero.on_sample(pressure_sample);
+        pressure_health.on_sample(pressure_sample);
+    }
 
-    if (millis() > last_motor + motor_interval) {
+    // Only the zero, any config edited over USB and not saved stays that way
+    if (!record_store.is_busy() && pressure_zero.take_store_request() &&
+        !record_store.store_async("SensorConfig", PressureAutoZero::on_stored, &pressure_zero)) {
+        PressureAutoZero::on_stored(false, &pressure_zero);
+    }
+
+    // Another store may have the EEPROM, try again on the next pass
+    if (is_tuning_store_pending && !record_store.is_busy() && record_store.store_all_async(on_tuning_stored)) {
+        is_tuning_store_pending = false;
+    }
+
+    if (time_since_ms(last_motor) >= motor_interval) {
+        if (autotune.is_running() && autotune.update() == AutotuneController::State::DONE) {
+            // Keep the tuned gains, they are applied to the servo at boot once the config is loaded. They were tuned on
+            // the current loop, which stays in from now on.
+            kMotorConfig.motor_vel_pid_params = motor.get_vel_pid_params();
+            kMotorConfig.motor_pos_pid_params = motor.get_pos_pid_params();
+            kMotorCurrentConfig.is_cascade_enabled = true;
+            sysid.start(deg_to_rad(kVentMotionConfig.open_pos_deg));
+        }
+        if (sysid.is_running() && sysid.update() != SystemIdController::State::CAPTURE) {
+            if (sysid.is_done()) {
+                kPlantModelConfig = sysid.get_model();
+            }
+            // Saves the tuned gains along with the model
+            is_tuning_store_pending = true;
+            is_tuning_store_failed = false;
+        }
         motor.update();
         last_motor = millis();
     }
 
     if (millis() > last_motion + 10) {
         HAL_IWDG_Refresh(&hiwdg);
-        pressure_sensor.update();
         if (!home.is_done()) {
             home.update();
             if (home.is_done()) {
                 ui.set_audio_alert(UI_V1::AudioAlert::DONE_HOMING);
                 motor.set_pos_deg(0);
                 motor_driver.set_pwm(0);
-                vent.reset();
-                vent.stop();
-                vent.update();
+                if (kVentAppConfig.mode == Modes::CALIBRATION) {
+                    autotune.start();
+                } else {
+                    vent.reset();
+                    vent.stop();
+                    vent.update();
+                }
             }
-        } else {
+        } else if (kVentAppConfig.mode != Modes::CALIBRATION) {
             vent.update();
         }
 
         alarms.set(Alarms::OVER_PRESSURE, vent.get_peak_pressure_cmH2O() >= vent.get_peak_pressure_limit_cmH2O());
         alarms.set(Alarms::LOSS_OF_POWER, !power_detect.read());
-        alarms.set(Alarms::MOTION_FAULT, motor.faults.to_int());
+        alarms.set(Alarms::MOTION_FAULT,
+                   motor.faults.to_int() || autotune.is_failed() || sysid.is_failed() || is_tuning_store_failed);
         alarms.set(Alarms::OVER_CURRENT, motor_driver.get_fault());
+        pressure_health.update();
+        alarms.set(Alarms::SENSOR_FAULT, !pressure_health.is_healthy());
         last_motion = millis();
     }
 
@@ -211,8 +341,13 @@ extern "C" void abvm_update() {
             case IUI::Event::START:
                 if (alarms.is_any_alarmed()) {
                     ui.silence();
+                } else if (kVentAppConfig.mode == Modes::CALIBRATION) {
+                    if (home.is_done() && !autotune.is_running() && !sysid.is_running()) {
+                        autotune.start();
+                    }
                 } else if (home.is_done() && !vent.is_running()) {
                     ui.set_audio_alert(UI_V1::AudioAlert::STARTING);
+                    pressure_zero.cancel_capture();
                     vent.start();
                     logger_ep.set_streaming(kRunningLoggingInterval);
                     controls.set_status_led(ControlPanel::STATUS_LED_2, true);
@@ -226,6 +361,8 @@ extern "C" void abvm_update() {
                 } else {
                     vent.stop();
                 }
+                // The bag is left open, settle_ms lets the last exhalation out first
+                pressure_zero.start_capture();
                 logger_ep.set_streaming(kIdleLoggingInterval);
 
                 ui.set_audio_alert(UI_V1::AudioAlert::STOPPING);
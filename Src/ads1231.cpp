@@ -3,24 +3,64 @@
 #include <math.h>
 
 #include "clock.h"
-#include "spi.h"
 
-#define SPI_TIMEOUT 10
+// The HAL only gives us a global EXTI callback, route it to the converter that owns the data ready line
+static ADS1231 *active_sensor = nullptr;
+
+// The converter needs 100 ns either side of an SCLK edge, a handful of cycles at 72 MHz
+static inline void sclk_delay() {
+    __NOP();
+    __NOP();
+    __NOP();
+    __NOP();
+    __NOP();
+    __NOP();
+    __NOP();
+    __NOP();
+}
 
 ADS1231::ADS1231(GPIO_TypeDef *powerdown_port, uint32_t powerdown_pin, SPI_HandleTypeDef *hspi, GPIO_TypeDef *miso_port,
-                 uint32_t miso_pin, GPIO_TypeDef *sclk_port, uint32_t sclk_pin, LinearFit const *linear_fit_mv)
-    : powerdown_port(powerdown_port),
-      powerdown_pin(powerdown_pin),
+                 uint32_t miso_pin, GPIO_TypeDef *sclk_port, uint32_t sclk_pin, LinearFit const *linear_fit_mv,
+                 float const *zero_offset)
+    : hspi(hspi),
       miso_port(miso_port),
       miso_pin(miso_pin),
       sclk_port(sclk_port),
       sclk_pin(sclk_pin),
-      hspi(hspi),
+      powerdown_port(powerdown_port),
+      powerdown_pin(powerdown_pin),
+      linear_fit_mv(linear_fit_mv),
+      zero_offset(zero_offset),
+      volts(0),
       vref(3.06),
-      linear_fit_mv(linear_fit_mv) {}
+      value(0) {}
 
 void ADS1231::init() {
-    enable_spi(false);
+    // The pins are shared with SPI1 but the converter is read by hand, take them back for good
+    HAL_SPI_DeInit(hspi);
+
+    GPIO_InitTypeDef gpio_init;
+
+    // DOUT going low is data ready
+    gpio_init.Pin = miso_pin;
+    gpio_init.Mode = GPIO_MODE_IT_FALLING;
+    gpio_init.Pull = GPIO_PULLDOWN;
+    gpio_init.Speed = GPIO_SPEED_FREQ_LOW;
+    HAL_GPIO_Init(miso_port, &gpio_init);
+
+    gpio_init.Pin = sclk_pin;
+    gpio_init.Mode = GPIO_MODE_OUTPUT_PP;
+    gpio_init.Pull = GPIO_PULLDOWN;
+    gpio_init.Speed = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(sclk_port, &gpio_init);
+
+    HAL_GPIO_WritePin(sclk_port, sclk_pin, GPIO_PIN_RESET);
+
+    active_sensor = this;
+
+    // Below the current loop, a late sample only costs a few microseconds of timestamp
+    HAL_NVIC_SetPriority(EXTI9_5_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
 }
 
 float ADS1231::read_volts() {
@@ -28,74 +68,94 @@ float ADS1231::read_volts() {
 }
 
 float ADS1231::read() {
-    return linear_fit_mv->calculate(volts * 1e3); // Convert to mV first
+    return read_uncorrected() - *zero_offset;
 }
 
-/**
- * Check if a measurement is ready, if it is get the value.
- */
-bool ADS1231::update() {
-    if (is_ready()) {
-        uint8_t data[3];
-        enable_spi(true);
-        HAL_SPI_Receive(hspi, data, sizeof(data), SPI_TIMEOUT);
-        enable_spi(false);
-
-        delay_us(1);
-        HAL_GPIO_WritePin(sclk_port, sclk_pin, GPIO_PIN_SET);
-        delay_us(1);
-        HAL_GPIO_WritePin(sclk_port, sclk_pin, GPIO_PIN_RESET);
-
-        // Two's complement of 24 bit value. Make sure the sign gets
-        // extended into the upper byte.
-        int32_t next_value = ((data[0] << 24) | (data[1] << 16) | (data[2] << 8)) >> 8;
-        value = rejection_filter(next_value);
-        volts = convert_to_volts(value, 128, vref);
-        return true;
-    } else {
+bool ADS1231::read_sample(Sample *sample) {
+    if (!samples.pop(sample)) {
         return false;
     }
+    sample->value -= *zero_offset;
+    return true;
 }
 
-bool ADS1231::is_ready() {
-    return HAL_GPIO_ReadPin(miso_port, miso_pin) == GPIO_PIN_RESET;
+uint32_t ADS1231::get_num_overruns() const {
+    return num_overruns;
 }
 
-// See datasheet page 12
-constexpr float ADS1231::convert_to_volts(int32_t x, float gain, float vref) {
-    return (static_cast<float>(x) / (1 << 24)) * vref / gain;
+uint32_t ADS1231::get_num_clock_faults() const {
+    return num_clock_faults;
 }
 
-void ADS1231::set_powerdown(bool pwrdn) {
-    if (pwrdn) {
-        HAL_GPIO_WritePin(powerdown_port, powerdown_pin, GPIO_PIN_RESET);
+void ADS1231::data_ready_isr(uint16_t pin) {
+    uint64_t now = micros();
+
+    // The edge could be noise or the tail of the last read
+    if (pin != miso_pin || !is_ready()) {
+        return;
+    }
+
+    int32_t code = read_bits();
+    bool is_saturated = code == kCodeMax || code == kCodeMin;
+    value = rejection_filter(code);
+    bool is_held = value != code;
+    volts = convert_to_volts(value, 128, vref);
+
+    // A timestamp out of order would hand the consumers a backwards time step to take a slope over
+    if (now <= last_sample_us) {
+        num_clock_faults++;
     } else {
-        HAL_GPIO_WritePin(powerdown_port, powerdown_pin, GPIO_PIN_SET);
+        last_sample_us = now;
+        if (!samples.push(
+                  {.time_us = now, .value = read_uncorrected(), .is_saturated = is_saturated, .is_held = is_held})) {
+            num_overruns++;
+        }
     }
+
+    // Clocking the bits out toggled DOUT and set the pending flag again
+    __HAL_GPIO_EXTI_CLEAR_IT(miso_pin);
 }
 
-void ADS1231::enable_spi(bool spi_on) {
-    if (spi_on) {
-        MX_SPI1_Init();
-    } else {
-        HAL_SPI_DeInit(hspi);
+float ADS1231::read_uncorrected() {
+    return linear_fit_mv->calculate(volts * 1e3f);  // Convert to mV first
+}
 
-        GPIO_InitTypeDef gpio_init;
+bool ADS1231::is_ready() {
+    return (miso_port->IDR & miso_pin) == 0;
+}
 
-        gpio_init.Pin = miso_pin;
-        gpio_init.Mode = GPIO_MODE_INPUT;
-        gpio_init.Pull = GPIO_PULLDOWN;
-        gpio_init.Speed = GPIO_SPEED_FREQ_LOW;
-        HAL_GPIO_Init(miso_port, &gpio_init);
+/**
+ * Clock the 24 bit conversion out MSB first, DOUT is valid after each rising edge. The 25th clock pulls DOUT high
+ * until the next conversion is ready.
+ */
+int32_t ADS1231::read_bits() {
+    uint32_t bits = 0;
+    for (int i = 0; i < 24; i++) {
+        sclk_port->BSRR = sclk_pin;
+        sclk_delay();
+        bits = (bits << 1) | ((miso_port->IDR & miso_pin) ? 1 : 0);
+        sclk_port->BRR = sclk_pin;
+        sclk_delay();
+    }
 
-        gpio_init.Pin = sclk_pin;
-        gpio_init.Mode = GPIO_MODE_OUTPUT_PP;
-        gpio_init.Pull = GPIO_PULLDOWN;
-        gpio_init.Speed = GPIO_SPEED_FREQ_LOW;
+    sclk_port->BSRR = sclk_pin;
+    sclk_delay();
+    sclk_port->BRR = sclk_pin;
 
-        HAL_GPIO_Init(sclk_port, &gpio_init);
+    // Two's complement of 24 bit value. Make sure the sign gets extended into the upper byte.
+    return (int32_t)(bits << 8) >> 8;
+}
 
-        HAL_GPIO_WritePin(sclk_port, sclk_pin, GPIO_PIN_RESET);
+// See datasheet page 12
+constexpr float ADS1231::convert_to_volts(int32_t x, float gain, float vref) {
+    return (static_cast<float>(x) / (1 << 24)) * vref / gain;
+}
+
+void ADS1231::set_powerdown(bool pwrdn) {
+    if (pwrdn) {
+        HAL_GPIO_WritePin(powerdown_port, powerdown_pin, GPIO_PIN_RESET);
+    } else {
+        HAL_GPIO_WritePin(powerdown_port, powerdown_pin, GPIO_PIN_SET);
     }
 }
 
@@ -116,3 +176,7 @@ int32_t ADS1231::rejection_filter(int32_t next) {
     }
     return next;
 }
+
+extern "C" void HAL_GPIO_EXTI_Callback(uint16_t pin) {
+    if (active_sensor != nullptr) active_sensor->data_ready_isr(pin);
+}
@@ -0,0 +1,122 @@
+#include "autotune_controller.h"
+
+#include "clock.h"
+
+AutotuneController::AutotuneController(Servo *motor, Parameters params)
+    : motor(motor),
+      params(params),
+      state(State::IDLE),
+      velocity_relay(params.velocity_relay),
+      position_relay(params.position_relay) {}
+
+void AutotuneController::start() {
+    original_vel_params = motor->get_vel_pid_params();
+    original_pos_params = motor->get_pos_pid_params();
+    was_cascade_enabled = motor->is_cascade_enabled();
+
+    motor->set_cascade_enabled(true);
+    motor->set_vel_pid_params(params.cascade_vel_pid_params);
+
+    bias_sum = 0;
+    bias_count = 0;
+    stage_start_ms = millis();
+    state = State::SPIN_UP;
+    motor->set_mode(Servo::Mode::VELOCITY);
+    motor->set_velocity(params.spin_up_velocity);
+}
+
+bool AutotuneController::is_running() {
+    return state != State::IDLE && state != State::DONE && state != State::FAILED;
+}
+
+bool AutotuneController::is_done() {
+    return state == State::DONE;
+}
+
+bool AutotuneController::is_failed() {
+    return state == State::FAILED;
+}
+
+AutotuneController::State AutotuneController::update() {
+    if (!is_running()) {
+        return state;
+    }
+
+    if (motor->faults.to_int() || !params.travel.in(motor->position)) {
+        fail();
+        return state;
+    }
+
+    uint32_t now = millis();
+    switch (state) {
+        case State::SPIN_UP: {
+            uint32_t elapsed = now - stage_start_ms;
+            if (elapsed >= params.spin_up_ms / 2) {
+                bias_sum += motor->command;
+                bias_count++;
+            }
+
+            if (elapsed >= params.spin_up_ms) {
+                velocity_relay.set_bias(bias_sum / bias_count);
+                velocity_relay.start(now);
+                state = State::VELOCITY_LOOP;
+                motor->set_mode(Servo::Mode::CURRENT);
+            }
+            break;
+        }
+        case State::VELOCITY_LOOP: {
+            motor->set_current(velocity_relay.update(params.spin_up_velocity - motor->velocity, now));
+
+            if (velocity_relay.get_state() == RelayAutotune::State::DONE) {
+                motor->set_vel_pid_params(RelayAutotune::tune(RelayAutotune::Rule::TYREUS_LUYBEN_PI,
+                                                              velocity_relay.get_result(),
+                                                              params.cascade_vel_pid_params));
+                position_relay.start(now);
+                state = State::POSITION_LOOP;
+                motor->set_mode(Servo::Mode::VELOCITY);
+                motor->set_velocity(0);
+            } else if (velocity_relay.get_state() == RelayAutotune::State::FAILED) {
+                fail();
+            }
+            break;
+        }
+        case State::POSITION_LOOP: {
+            motor->set_velocity(position_relay.update(params.position_target - motor->position, now));
+
+            if (position_relay.get_state() == RelayAutotune::State::DONE) {
+                motor->set_pos_pid_params(RelayAutotune::tune(RelayAutotune::Rule::CONSERVATIVE_P,
+                                                              position_relay.get_result(), original_pos_params));
+                state = State::DONE;
+                motor->set_mode(Servo::Mode::POSITION);
+                motor->set_pos(params.position_target);
+            } else if (position_relay.get_state() == RelayAutotune::State::FAILED) {
+                fail();
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    return state;
+}
+
+RelayAutotune::Result const &AutotuneController::get_velocity_result() const {
+    return velocity_relay.get_result();
+}
+
+RelayAutotune::Result const &AutotuneController::get_position_result() const {
+    return position_relay.get_result();
+}
+
+void AutotuneController::fail() {
+    velocity_relay.stop();
+    position_relay.stop();
+    motor->set_cascade_enabled(was_cascade_enabled);
+    motor->set_vel_pid_params(original_vel_params);
+    motor->set_pos_pid_params(original_pos_params);
+    state = State::FAILED;
+
+    motor->set_mode(Servo::Mode::POSITION);
+    motor->set_pos(motor->position);
+}
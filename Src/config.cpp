@@ -1,15 +1,41 @@
 #include "config.h"
 
+#include <stddef.h>
+#include <string.h>
+
 uint8_t kHardwareRev = 1;
 
 MotorConfig kMotorConfig = {
     .motor_params = {188, 28},
-    .motor_vel_pid_params = {2.8, .0, .0},
-    .motor_pos_pid_params = {14.5, .1, .0},                         //.02},
+    .motor_vel_pid_params = {.Kp = 2.8,
+                             .Ki = .0,
+                             .Kd = .0,
+                             .Kff_vel = 0,
+                             .Kff_acc = 0,
+                             .d_filter_hz = 0,
+                             .output_limits = {-1, 1}},  // PWM duty, until an autotune enables the current loop
+    .motor_pos_pid_params = {.Kp = 14.5,
+                             .Ki = .1,
+                             .Kd = .0,  //.02
+                             .Kff_vel = 1,  // The planner's velocity passes straight through to the velocity loop
+                             .Kff_acc = 0,
+                             .d_filter_hz = 0,
+                             .output_limits = {-25 * 0.104719755, 25 * 0.104719755}},  // Velocity, rads/sec
     .motor_vel_limits = {-25 * 0.104719755, 25 * 0.104719755},  // RPM to rads/sec
     .motor_pos_limits = {0, deg_to_rad(90)},
 };
 
+MotorCurrentConfig kMotorCurrentConfig = {
+    .motor_cur_pid_params = {.Kp = .15,
+                             .Ki = 300,
+                             .Kd = .0,
+                             .Kff_vel = 0,
+                             .Kff_acc = 0,
+                             .d_filter_hz = 0,
+                             .output_limits = {-1, 1}},  // PWM duty
+    .is_cascade_enabled = false,
+};
+
 VentAppConfig kVentAppConfig = {
     .mode = Modes::VENTILATOR,
     .current_update_period_ms = 2,   // Match the 50 freq of the servo motors
@@ -30,6 +56,8 @@ VentResiprationConfig kVentRespirationConfig = {
     .plateau_pressure_display_min = 15,
     .plateau_pressure_display_max = 40,
     .peak_pressure_limit_increment = 5,
+    .trigger_pressure_drop_cmH2O = 0,
+    .trigger_pressure_slope = 0,
 };
 
 VentMotionConfig kVentMotionConfig = {
@@ -37,7 +65,23 @@ VentMotionConfig kVentMotionConfig = {
     .open_pos_deg = 16,
     .expiration_part = 2,
     .invert_motion = true,
+    .motion_profile = MotionProfile::TRAPEZOIDAL,
+
+};
+
+PlantModelConfig kPlantModelConfig = {};
 
+VentPressureConfig kVentPressureConfig = {
+    .mode = VentMode::VOLUME,
+    .target_pressure_cmH2O = 15,
+    .rise_time_ms = 200,
+    .pressure_pid_params = {.Kp = 7,
+                            .Ki = 40,
+                            .Kd = 0,
+                            .Kff_vel = 0,
+                            .Kff_acc = 0,
+                            .d_filter_hz = 0,
+                            .output_limits = {-150, 150}},  // Arm velocity, degrees/s. 25 RPM like the motor.
 };
 
 float kVentTVSettings[6] ={55, 62, 69, 76, 83, 90};
@@ -47,48 +91,185 @@ float kVentRateSettings[6] = {8, 10, 12, 14, 16, 18};
 constexpr float kPressureSensorOffsetGain_cmH2O_per_mV = (10.1972 /  0.54);
 SensorConfig kSensorConfig = {
     .pressure_params = {kPressureSensorOffsetGain_cmH2O_per_mV, kPressureSensorOffsetGain_cmH2O_per_mV * -3.25f},
+    .pressure_zero_cmH2O = 0,
+};
+
+// EEPROM space reserved for each record. Sized with headroom so a struct can grow without moving the records after it.
+constexpr uint16_t kMotorConfigMaxSize = 118;  // 4 blocks per slot with the slot header and CRC
+constexpr uint16_t kConfigMaxSize = 54;        // 2 blocks per slot
+
+static_assert(sizeof(MotorConfig) <= kMotorConfigMaxSize, "MotorConfig outgrew its EEPROM record");
+static_assert(sizeof(VentAppConfig) <= kConfigMaxSize, "VentAppConfig outgrew its EEPROM record");
+static_assert(sizeof(VentResiprationConfig) <= kConfigMaxSize, "VentResiprationConfig outgrew its EEPROM record");
+static_assert(sizeof(VentMotionConfig) <= kConfigMaxSize, "VentMotionConfig outgrew its EEPROM record");
+static_assert(sizeof(SensorConfig) <= kConfigMaxSize, "SensorConfig outgrew its EEPROM record");
+static_assert(sizeof(MotorCurrentConfig) <= kConfigMaxSize, "MotorCurrentConfig outgrew its EEPROM record");
+static_assert(sizeof(PlantModelConfig) <= kConfigMaxSize, "PlantModelConfig outgrew its EEPROM record");
+static_assert(sizeof(VentPressureConfig) <= kConfigMaxSize, "VentPressureConfig outgrew its EEPROM record");
+
+// Schema 1 PID params were just the gains
+struct PIDParamsV1 {
+    float Kp;
+    float Ki;
+    float Kd;
+};
+
+struct MotorConfigV1 {
+    Servo::Config motor_params;
+    PIDParamsV1 motor_vel_pid_params;
+    PIDParamsV1 motor_pos_pid_params;
+    Range<float> motor_vel_limits;
+    Range<float> motor_pos_limits;
 };
 
+static uint16_t migrate_motor_config_v1(uint8_t *buf, uint16_t size) {
+    MotorConfigV1 old;
+    if (size != sizeof(old)) return 0;
+    memcpy(&old, buf, sizeof(old));
+
+    auto upgrade = [](PIDParamsV1 const &p, Range<float> limits, float Kff_vel) -> PID::Params {
+        return {.Kp = p.Kp,
+                .Ki = p.Ki,
+                .Kd = p.Kd,
+                .Kff_vel = Kff_vel,
+                .Kff_acc = 0,
+                .d_filter_hz = 0,
+                .output_limits = limits};
+    };
+
+    MotorConfig next = {
+          .motor_params = old.motor_params,
+          .motor_vel_pid_params = upgrade(old.motor_vel_pid_params, {-1, 1}, 0),
+          .motor_pos_pid_params = upgrade(old.motor_pos_pid_params, old.motor_vel_limits, 1),
+          .motor_vel_limits = old.motor_vel_limits,
+          .motor_pos_limits = old.motor_pos_limits,
+    };
+
+    memcpy(buf, &next, sizeof(next));
+    return sizeof(next);
+}
+
+// Schema 2 added the motion profile selection
+static uint16_t migrate_vent_motion_config_v1(uint8_t *buf, uint16_t size) {
+    constexpr uint16_t kV1Size = offsetof(VentMotionConfig, motion_profile);
+    if (size != kV1Size) return 0;
+
+    MotionProfile profile = MotionProfile::TRAPEZOIDAL;
+    memcpy(&buf[kV1Size], &profile, sizeof(profile));
+    return kV1Size + sizeof(profile);
+}
+
+// Schema 2 added patient triggering, off for anyone updating
+static uint16_t migrate_vent_resp_config_v1(uint8_t *buf, uint16_t size) {
+    constexpr uint16_t kV1Size = offsetof(VentResiprationConfig, trigger_pressure_drop_cmH2O);
+    if (size != kV1Size) return 0;
+
+    memset(&buf[kV1Size], 0, sizeof(VentResiprationConfig) - kV1Size);
+    return sizeof(VentResiprationConfig);
+}
+
+// Schema 2 added the auto-zero, starting from the fit alone
+static uint16_t migrate_sensor_config_v1(uint8_t *buf, uint16_t size) {
+    constexpr uint16_t kV1Size = offsetof(SensorConfig, pressure_zero_cmH2O);
+    if (size != kV1Size) return 0;
+
+    memset(&buf[kV1Size], 0, sizeof(SensorConfig) - kV1Size);
+    return sizeof(SensorConfig);
+}
+
+bool config_add_records(RecordStore *store) {
+    bool success = true;
+    success &= store->add_entry("MotorConfig", &kMotorConfig, sizeof(kMotorConfig), kMotorConfigMaxSize,
+                                kMotorConfigSchema);
+    success &= store->add_entry("VentAppConfig", &kVentAppConfig, sizeof(kVentAppConfig), kConfigMaxSize,
+                                kVentAppConfigSchema);
+    success &= store->add_entry("VentRespConfig", &kVentRespirationConfig, sizeof(kVentRespirationConfig),
+                                kConfigMaxSize, kVentRespConfigSchema);
+    success &= store->add_entry("VentMotionConfig", &kVentMotionConfig, sizeof(kVentMotionConfig), kConfigMaxSize,
+                                kVentMotionConfigSchema);
+    success &= store->add_entry("SensorConfig", &kSensorConfig, sizeof(kSensorConfig), kConfigMaxSize,
+                                kSensorConfigSchema);
+    success &= store->add_entry("MotorCurrentConfig", &kMotorCurrentConfig, sizeof(kMotorCurrentConfig),
+                                kConfigMaxSize, kMotorCurrentConfigSchema);
+    success &= store->add_entry("PlantModelConfig", &kPlantModelConfig, sizeof(kPlantModelConfig), kConfigMaxSize,
+                                kPlantModelConfigSchema);
+    success &= store->add_entry("VentPressureConfig", &kVentPressureConfig, sizeof(kVentPressureConfig),
+                                kConfigMaxSize, kVentPressureConfigSchema);
+
+    // One per schema bump
+    success &= store->add_migration("MotorConfig", 1, migrate_motor_config_v1);
+    success &= store->add_migration("VentMotionConfig", 1, migrate_vent_motion_config_v1);
+    success &= store->add_migration("VentRespConfig", 1, migrate_vent_resp_config_v1);
+    success &= store->add_migration("SensorConfig", 1, migrate_sensor_config_v1);
+
+    // What the store's first layout held, in the order the records were added then
+    success &= store->add_legacy_entry("MotorConfig", sizeof(MotorConfigV1));
+    success &= store->add_legacy_entry("VentAppConfig", sizeof(VentAppConfig));
+    success &= store->add_legacy_entry("VentRespConfig", offsetof(VentResiprationConfig, trigger_pressure_drop_cmH2O));
+    success &= store->add_legacy_entry("VentMotionConfig", offsetof(VentMotionConfig, motion_profile));
+    success &= store->add_legacy_entry("SensorConfig", offsetof(SensorConfig, pressure_zero_cmH2O));
+    return success;
+}
+
 ConfigCommandRPC::ConfigCommandRPC(uint8_t id, RecordStore *store) :
-    CommEndpoint(id, (void *const)NULL, sizeof(uint32_t), false), store(store) {}
+    CommEndpoint(id, (void *const)NULL, sizeof(uint32_t), false), store(store), status(Status::IDLE), pending(0) {}
 
 uint8_t ConfigCommandRPC::write(void *data, size_t size) {
-    uint32_t *cmd_in = (uint32_t*)data;
-    uint8_t ret = 0;
-    switch (*cmd_in) {
-        case CONFIG_SAVE_CMD: {
-            if (!store->store_all()) {
-                ret = CONFIG_ERR;
-            }
-            break;
-        }
-        case CONFIG_ERASE_CMD: {
-            if (!store->get_eeprom()->erase()) {
-                ret = CONFIG_ERR;
-            }
+    uint32_t cmd = *(uint32_t *)data;
+
+    if (cmd != CONFIG_SAVE_CMD && cmd != CONFIG_ERASE_CMD && cmd != CONFIG_LOAD_CMD && cmd != CONFIG_RESET_CMD) {
+        return INVALID_CMD_ERR;
+    }
+    if (status == Status::BUSY) {
+        return CONFIG_ERR;
+    }
+
+    // Busy first, the main loop only looks at the command once it is set
+    status = Status::BUSY;
+    pending = cmd;
+    return 0;
+}
+
+void ConfigCommandRPC::update() {
+    uint32_t cmd = pending;
+    if (cmd == 0) {
+        return;
+    }
+    pending = 0;
+
+    // If nothing needs writing the operation completes before these return
+    bool is_started = true;
+    switch (cmd) {
+        case CONFIG_SAVE_CMD:
+            is_started = store->store_all_async(on_complete, this);
             break;
-        }
-        case CONFIG_LOAD_CMD: {
-            if (!store->load_all()) {
-                ret = CONFIG_ERR;
-            }
+        case CONFIG_ERASE_CMD:
+            is_started = store->erase_async(on_complete, this);
             break;
-        }
-        case CONFIG_RESET_CMD: {
-            if (!store->get_eeprom()->erase() || !store->first_load()) {
-                ret = CONFIG_ERR;
-            }
+        case CONFIG_RESET_CMD:
+            is_started = store->reset_async(on_complete, this);
             break;
-        }
-        default: {
-            return INVALID_CMD_ERR;
+        case CONFIG_LOAD_CMD:
+            // Blocking, but out here it only holds up the main loop
+            on_complete(store->load_all(), this);
             break;
-        }
     }
-    return ret;
+
+    if (!is_started) {
+        status = Status::FAILED;
+    }
 }
 
 uint8_t ConfigCommandRPC::read(void *data, size_t size) {
-    // this is a write-only endpoint, so error on read
-    return (uint8_t)CommError::ERROR_READ;
+    if (size != sizeof(uint32_t)) {
+        return (uint8_t)CommError::ERROR_SIZE;
+    }
+
+    *(uint32_t *)data = (uint32_t)status;
+    return (uint8_t)CommError::ERROR_NONE;
+}
+
+void ConfigCommandRPC::on_complete(bool success, void *arg) {
+    ConfigCommandRPC *rpc = (ConfigCommandRPC *)arg;
+    rpc->status = success ? Status::IDLE : Status::FAILED;
 }
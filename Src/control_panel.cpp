@@ -92,7 +92,7 @@ void ControlPanel::set_buzzer_volume(float volume) {
     if (volume > 1) volume = 1;
     if (volume < 0) volume = 0;
     uint16_t arr = __HAL_TIM_GET_AUTORELOAD(buzzer_timer);
-    uint16_t compare = (uint16_t)(volume * 0.5 * (float)arr);
+    uint16_t compare = (uint16_t)(volume * 0.5f * (float)arr);
     __HAL_TIM_SET_COMPARE(buzzer_timer, buzzer_timer_channel, compare);
 }
 
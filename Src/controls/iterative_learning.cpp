@@ -0,0 +1,84 @@
+#include "controls/iterative_learning.h"
+
+#include <string.h>
+
+#include "math/dsp.h"
+
+IterativeLearningControl::IterativeLearningControl(Parameters p) : params(p) {
+    params.learning_gain = saturate(params.learning_gain, 0, 1);
+    params.forgetting = saturate(params.forgetting, 0, 1);
+    params.lead_bins %= NUM_BINS;
+    reset();
+}
+
+void IterativeLearningControl::reset() {
+    memset(correction, 0, sizeof(correction));
+    clear_errors();
+    period_ms = 0;
+    is_cycle_valid = false;
+    num_cycles_learned = 0;
+}
+
+void IterativeLearningControl::start_cycle(uint32_t period) {
+    if (period != period_ms && period_ms != 0) {
+        reset();
+    }
+
+    if (is_cycle_valid) {
+        learn();
+    }
+
+    clear_errors();
+    period_ms = period;
+    is_cycle_valid = period != 0;
+}
+
+void IterativeLearningControl::discard_cycle() {
+    clear_errors();
+    is_cycle_valid = false;
+}
+
+void IterativeLearningControl::record(uint32_t t_ms, float error) {
+    if (!is_cycle_valid || t_ms >= period_ms) {
+        return;
+    }
+
+    uint16_t i = (uint64_t)t_ms * NUM_BINS / period_ms;
+    error_sum[i] += error;
+    error_count[i]++;
+}
+
+float IterativeLearningControl::get_correction(uint32_t t_ms) const {
+    if (!is_cycle_valid || t_ms >= period_ms) {
+        return 0;
+    }
+
+    // Interpolate between bin centers, the cycle repeats so the last bin leads into the first
+    float x = (float)t_ms * NUM_BINS / period_ms - .5f;
+    if (x < 0) {
+        x += NUM_BINS;
+    }
+    uint16_t i = (uint16_t)x % NUM_BINS;
+    float frac = x - (uint16_t)x;
+    return correction[i] + frac * (correction[(i + 1) % NUM_BINS] - correction[i]);
+}
+
+uint16_t IterativeLearningControl::get_num_cycles_learned() const {
+    return num_cycles_learned;
+}
+
+void IterativeLearningControl::learn() {
+    for (uint16_t i = 0; i < NUM_BINS; i++) {
+        uint16_t j = (i + params.lead_bins) % NUM_BINS;
+        // No samples landed in the bin, nothing to learn but still forget
+        float error = error_count[j] ? error_sum[j] / error_count[j] : 0;
+        correction[i] = saturate(params.forgetting * (correction[i] + params.learning_gain * error),
+                                 -params.max_correction, params.max_correction);
+    }
+    num_cycles_learned++;
+}
+
+void IterativeLearningControl::clear_errors() {
+    memset(error_sum, 0, sizeof(error_sum));
+    memset(error_count, 0, sizeof(error_count));
+}
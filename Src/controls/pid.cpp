@@ -1,35 +1,73 @@
 #include "controls/pid.h"
 
 PID::PID(float Kp, float Ki, float Kd, float dt)
-    : params{Kp, Ki, Kd}, err_acc_(0), period_(dt), err_last_(0), is_init_(false) {}
+    : PID({.Kp = Kp,
+           .Ki = Ki,
+           .Kd = Kd,
+           .Kff_vel = 0,
+           .Kff_acc = 0,
+           .d_filter_hz = 0,
+           .output_limits = {-INFINITY, INFINITY}},
+          dt) {}
 
-PID::PID(Params params, float dt) : params(params), err_acc_(0), period_(dt), err_last_(0), is_init_(false) {}
+PID::PID(Params params, float dt) : period_(dt), i_term_(0), meas_last_(0), d_filtered_(0), is_init_(false) {
+    set_params(params);
+}
 
 void PID::reset() {
-    err_acc_ = 0;
-    err_last_ = 0;
+    i_term_ = 0;
+    d_filtered_ = 0;
     is_init_ = false;
 }
 
-float PID::update(float target, float meas) {
+void PID::set_params(Params const &params) {
+    params_ = params;
+
+    ki_dt_ = params.Ki * period_;
+    kd_over_dt_ = params.Kd / period_;
+
+    // Backward Euler first order low pass
+    if (params.d_filter_hz > 0) {
+        float tau = 1 / (2 * (float)M_PI * params.d_filter_hz);
+        d_alpha_ = period_ / (tau + period_);
+    } else {
+        d_alpha_ = 1;
+    }
+}
+
+PID::Params const &PID::get_params() const {
+    return params_;
+}
+
+void PID::set_period(float dt) {
+    period_ = dt;
+    set_params(params_);
+}
+
+float PID::update(float target, float meas, float ff_vel, float ff_acc) {
     // Calculate the error
     float err = target - meas;
 
-    // If we are not initialized yet:
-    //   - Set the last error to the current error to prevent the D term from
-    //   going nuts
-    //   - Set the accumulated error to 0
-    //   - Assert that we are initialized.
+    // If we are not initialized yet, start the derivative from the current measurement so the first update doesn't
+    // see a step
     if (!is_init_) {
-        err_last_ = err;
-        err_acc_ = 0;
+        meas_last_ = meas;
+        d_filtered_ = 0;
+        i_term_ = 0;
         is_init_ = true;
     }
 
-    err_acc_ += err;
+    d_filtered_ += d_alpha_ * ((meas - meas_last_) - d_filtered_);
+    meas_last_ = meas;
+
+    float out_no_i = params_.Kp * err - kd_over_dt_ * d_filtered_ + params_.Kff_vel * ff_vel + params_.Kff_acc * ff_acc;
 
-    float derr = err - err_last_;
-    err_last_ = err;
+    // Only integrate when it doesn't drive the output further into a limit
+    float out = out_no_i + i_term_;
+    if (!((out >= params_.output_limits.max && err > 0) || (out <= params_.output_limits.min && err < 0))) {
+        i_term_ += ki_dt_ * err;
+        out = out_no_i + i_term_;
+    }
 
-    return params.Kp * err + params.Ki * err_acc_ * period_ + (params.Kd * (derr) / period_);
+    return params_.output_limits.saturate(out);
 }
@@ -0,0 +1,118 @@
+#include "controls/relay_autotune.h"
+
+#include <math.h>
+
+RelayAutotune::RelayAutotune(Parameters params) : params(params), state(State::IDLE), result({0, 0}) {}
+
+void RelayAutotune::start(uint32_t now_ms) {
+    state = State::RUNNING;
+    result = {0, 0};
+    start_ms = now_ms;
+    is_high = false;
+    is_first_rise = true;
+    last_rise_ms = now_ms;
+    error_max = -INFINITY;
+    error_min = INFINITY;
+    num_cycles = 0;
+    amplitude_sum = 0;
+    period_sum_ms = 0;
+}
+
+void RelayAutotune::stop() {
+    if (state == State::RUNNING) {
+        state = State::IDLE;
+    }
+}
+
+void RelayAutotune::set_bias(float bias) {
+    params.bias = bias;
+}
+
+float RelayAutotune::update(float error, uint32_t now_ms) {
+    if (state != State::RUNNING) {
+        return params.bias;
+    }
+
+    if (now_ms - start_ms >= params.timeout_ms) {
+        state = State::FAILED;
+        return params.bias;
+    }
+
+    error_max = fmaxf(error_max, error);
+    error_min = fminf(error_min, error);
+
+    if (!is_high && error > params.hysteresis) {
+        is_high = true;
+
+        // A cycle is rise to rise, the first rise only starts one
+        if (is_first_rise) {
+            is_first_rise = false;
+        } else {
+            end_cycle(now_ms);
+        }
+        last_rise_ms = now_ms;
+        error_max = error;
+        error_min = error;
+    } else if (is_high && error < -params.hysteresis) {
+        is_high = false;
+    }
+
+    if (state != State::RUNNING) {
+        return params.bias;
+    }
+    return is_high ? params.bias + params.amplitude : params.bias - params.amplitude;
+}
+
+void RelayAutotune::end_cycle(uint32_t now_ms) {
+    num_cycles++;
+    if (num_cycles <= SETTLE_CYCLES) {
+        return;
+    }
+
+    amplitude_sum += (error_max - error_min) / 2;
+    period_sum_ms += now_ms - last_rise_ms;
+
+    if (num_cycles < SETTLE_CYCLES + params.num_cycles) {
+        return;
+    }
+
+    float a = amplitude_sum / params.num_cycles;
+    if (a <= params.hysteresis) {
+        // The relay never got a real oscillation going, only noise across the hysteresis band
+        state = State::FAILED;
+        return;
+    }
+
+    result.ultimate_gain = 4 * params.amplitude / ((float)M_PI * a);
+    result.ultimate_period_s = period_sum_ms / (1000.f * params.num_cycles);
+    state = State::DONE;
+}
+
+RelayAutotune::State RelayAutotune::get_state() const {
+    return state;
+}
+
+RelayAutotune::Result const &RelayAutotune::get_result() const {
+    return result;
+}
+
+PID::Params RelayAutotune::tune(Rule rule, Result const &r, PID::Params base) {
+    float ku = r.ultimate_gain;
+    float tu = r.ultimate_period_s;
+
+    base.Kd = 0;
+    switch (rule) {
+        case Rule::ZIEGLER_NICHOLS_PI:
+            base.Kp = .45f * ku;
+            base.Ki = base.Kp / (tu / 1.2f);
+            break;
+        case Rule::TYREUS_LUYBEN_PI:
+            base.Kp = ku / 3.2f;
+            base.Ki = base.Kp / (2.2f * tu);
+            break;
+        case Rule::CONSERVATIVE_P:
+            base.Kp = ku / 3.2f;
+            break;
+    }
+    return base;
+}
@@ -0,0 +1,172 @@
+#include "controls/s_curve_planner.h"
+
+SCurvePlanner::SCurvePlanner(Parameters params, ClockUs clock_us)
+    : state(State::IDLE),
+      current{},
+      p_last(0),
+      v_last(0),
+      a_last(0),
+      v_end(0),
+      clock_us(clock_us),
+      params(params) {}
+
+SCurvePlanner::~SCurvePlanner() {}
+
+void SCurvePlanner::reset() {
+    state = State::IDLE;
+    while (queue.free()) {
+    }
+    v_last = 0;
+    a_last = 0;
+    v_end = 0;
+}
+
+bool SCurvePlanner::is_idle() {
+    return state == State::IDLE && queue.empty();
+}
+
+uint8_t SCurvePlanner::get_num_queued() {
+    return queue.count();
+}
+
+uint32_t SCurvePlanner::get_tag() {
+    return current.tag;
+}
+
+bool SCurvePlanner::set_next(MotionPlan const &p) {
+    return queue.push(p);
+}
+
+void SCurvePlanner::force_next(MotionPlan const &p) {
+    reset();
+    set_next(p);
+}
+
+float SCurvePlanner::get_pos() {
+    return p_last;
+}
+
+float SCurvePlanner::get_vel() {
+    return v_last;
+}
+
+float SCurvePlanner::get_acc() {
+    return a_last;
+}
+
+SCurvePlanner::State SCurvePlanner::get_state() const {
+    return state;
+}
+
+bool SCurvePlanner::solve(float p_start) {
+    float t_a = saturate(params.t_a_percent, 0, 1) * t_total;
+    float t_d = saturate(params.t_d_percent, 0, 1) * t_total;
+    float t_c = saturate(1 - params.t_a_percent - params.t_d_percent, 0, 1) * t_total;
+    float jerk_percent = saturate(params.jerk_percent, 0, 1);
+
+    // Protect from divide by zero
+    if (t_total <= 0 || t_a <= 0 || t_d <= 0) {
+        return false;
+    }
+
+    float t_ja = jerk_percent * t_a / 2;
+    float t_jd = jerk_percent * t_d / 2;
+
+    // Starts at v_last (0 unless blending from the last plan) and ends at v_end. Each ramp is symmetric, so the
+    // average velocity over it is the mean of its end velocities. Same area as the trapezoid.
+    float v_start = v_last;
+    float v_max =
+          (current.p_target - p_start - .5f * v_start * t_a - .5f * v_end * t_d) / (.5f * t_a + t_c + .5f * t_d);
+    float a_acc = (v_max - v_start) / (t_a - t_ja);
+    float a_dec = (v_end - v_max) / (t_d - t_jd);
+    float j_acc = t_ja > 0 ? a_acc / t_ja : 0;
+    float j_dec = t_jd > 0 ? a_dec / t_jd : 0;
+
+    // clang-format off
+    const float durations[NUM_SEGMENTS] = {t_ja, t_a - 2 * t_ja, t_ja, t_c, t_jd, t_d - 2 * t_jd, t_jd};
+    const float jerks[NUM_SEGMENTS] =     {j_acc, 0,             -j_acc, 0, j_dec, 0,              -j_dec};
+    // clang-format on
+
+    float t = 0, p = p_start, v = v_start, a = 0;
+    for (uint8_t i = 0; i < NUM_SEGMENTS; i++) {
+        float dt = durations[i];
+        float j = jerks[i];
+
+        segments[i] = {.t_end = t + dt, .p = p, .v = v, .a = a, .j = j};
+
+        t += dt;
+        p += v * dt + a * dt * dt / 2 + j * dt * dt * dt / 6;
+        v += a * dt + j * dt * dt / 2;
+        a += j * dt;
+    }
+
+    return true;
+}
+
+bool SCurvePlanner::start_next(float pos, uint64_t now_us) {
+    if (!queue.pop(&current)) {
+        return false;
+    }
+
+    v_end = blend_velocity(current, pos, queue.peek()) * 1000.0f;
+
+    t_total = current.time_total_ms / 1000.0f;
+    if (!solve(pos)) {
+        state = State::IDLE;
+        v_last = 0;
+        v_end = 0;
+        return false;
+    }
+
+    segment_idx = 0;
+    start_us = now_us;
+    duration_us = (uint64_t)(t_total * 1e6f);
+    state = State::RUNNING;
+    return true;
+}
+
+float SCurvePlanner::run(float pos, float /* vel */) {
+    uint64_t now_us = clock_us();
+
+    if (state == State::IDLE) {
+        if (queue.empty()) {
+            return pos;
+        }
+
+        // Nothing was running, start from now
+        if (!start_next(pos, now_us)) {
+            return p_last;
+        }
+    }
+
+    // Plans that are already over hand off to the next one at their scheduled end, not at the time of this call, so
+    // loop jitter doesn't stretch the motion. They land exactly on the target, no accumulated rounding.
+    while (now_us - start_us >= duration_us) {
+        uint64_t end_us = start_us + duration_us;
+
+        p_last = current.p_target;
+        v_last = v_end;
+        a_last = 0;
+        state = State::IDLE;
+
+        if (!start_next(p_last, end_us)) {
+            return p_last;
+        }
+    }
+
+    float t = (now_us - start_us) / 1e6f;
+
+    // Segments can be shorter than a call so this may skip a few, usually it runs once or not at all
+    while (segment_idx < NUM_SEGMENTS - 1 && t >= segments[segment_idx].t_end) {
+        segment_idx++;
+    }
+
+    Segment const &s = segments[segment_idx];
+    float tau = t - (segment_idx == 0 ? 0 : segments[segment_idx - 1].t_end);
+
+    a_last = s.a + s.j * tau;
+    v_last = s.v + (s.a + s.j * tau / 2) * tau;
+    p_last = s.p + (s.v + (s.a / 2 + s.j * tau / 6) * tau) * tau;
+
+    return p_last;
+}
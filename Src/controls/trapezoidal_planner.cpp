@@ -1,115 +1,157 @@
 #include "controls/trapezoidal_planner.h"
 
-TrapezoidalPlanner::TrapezoidalPlanner(Parameters params, uint32_t dt_ms)
-    : state(State::IDLE), is_next_available(false), current{}, next{}, dt_ms(dt_ms), params(params) {}
+TrapezoidalPlanner::TrapezoidalPlanner(Parameters params, ClockUs clock_us)
+    : state(State::IDLE),
+      current{},
+      v_0(0),
+      v_end(0),
+      v_last(0),
+      a_last(0),
+      p_last(0),
+      clock_us(clock_us),
+      params(params) {}
 
 TrapezoidalPlanner::~TrapezoidalPlanner() {}
 
 void TrapezoidalPlanner::reset() {
     state = State::IDLE;
-    is_next_available = false;
+    while (queue.free()) {
+    }
+    v_last = 0;
+    a_last = 0;
+    v_end = 0;
 }
 
 bool TrapezoidalPlanner::is_idle() {
-    return state == State::IDLE;
+    return state == State::IDLE && queue.empty();
+}
+
+uint8_t TrapezoidalPlanner::get_num_queued() {
+    return queue.count();
+}
+
+uint32_t TrapezoidalPlanner::get_tag() {
+    return current.tag;
 }
 
-void TrapezoidalPlanner::set_next(MotionPlan const &p) {
-    next = p;
-    is_next_available = true;
+bool TrapezoidalPlanner::set_next(MotionPlan const &p) {
+    return queue.push(p);
 }
 
 void TrapezoidalPlanner::force_next(MotionPlan const &p) {
+    reset();
     set_next(p);
-    state = State::IDLE;
 }
 
 float TrapezoidalPlanner::get_pos() {
     return p_last;
 }
 
-float TrapezoidalPlanner::run(float pos, float vel) {
+float TrapezoidalPlanner::get_vel() {
+    // Between blended plans this is still moving
+    return v_last;
+}
+
+float TrapezoidalPlanner::get_acc() {
+    return state == State::IDLE ? 0 : a_last;
+}
+
+float TrapezoidalPlanner::run(float pos, float /* vel */) {
+    uint64_t now_us = clock_us();
+
     if (state == State::IDLE) {
-        if (is_next_available) {
-            current = next;
-            is_next_available = false;
+        if (queue.empty()) {
+            return pos;
+        }
 
-            if (dt_ms == 0 || current.time_total_ms <= dt_ms) {
-                state = State::IDLE;
-                return p_last;
-            }
+        // Nothing was running, start from now
+        if (!start_next(pos, now_us)) {
+            return p_last;
+        }
+    }
 
-            // Discretize t he time part of the spline.
-            t_counts_accel = (int)((params.t_a_percent * current.time_total_ms) / dt_ms);
-            t_counts_decel = (int)((params.t_d_percent * current.time_total_ms) / dt_ms);
-            t_counts_c = (int)((current.time_total_ms * (saturate(1 - params.t_a_percent - params.t_d_percent, 0, 1))) /
-                               dt_ms);
+    // Plans that are already over hand off to the next one at their scheduled end, not at the time of this call, so
+    // loop jitter doesn't stretch the motion.
+    while (now_us - start_us >= duration_us) {
+        uint64_t end_us = start_us + duration_us;
 
-            current.time_total_ms = dt_ms * (t_counts_accel + t_counts_decel + t_counts_c);
-            // Find the area under the curve and the median
-            float dp = current.p_target - pos;
+        p_last = current.p_target;
+        v_last = v_end;
+        a_last = 0;
+        state = State::IDLE;
 
-            // NOTE ON UNITS: v_max, accel, decel are all discrete and do NOT have a
-            // time component.
-            v_max = (dp) / (.5 * t_counts_decel + .5 * t_counts_accel + t_counts_c);
+        if (!start_next(p_last, end_us)) {
+            return p_last;
+        }
+    }
 
-            // Protect from divide by zero
-            if (t_counts_accel == 0 || t_counts_decel == 0) {
-                state = State::IDLE;
-                return p_last;
-            }
+    evaluate((now_us - start_us) / 1e6f);
+    return p_last;
+}
 
-            accel = v_max / t_counts_accel;
-            decel = -v_max / t_counts_decel;
+bool TrapezoidalPlanner::start_next(float pos, uint64_t now_us) {
+    if (!queue.pop(&current)) {
+        return false;
+    }
 
-            v_last = 0;
-            p_last = p_last;
+    // Starts at the end velocity of the last plan (0 unless it blended into this one)
+    v_0 = v_end;
+    v_end = blend_velocity(current, pos, queue.peek()) * 1000.0f;
+
+    float t_total = current.time_total_ms / 1000.0f;
+    t_accel = params.t_a_percent * t_total;
+    t_decel = params.t_d_percent * t_total;
+    t_constant = t_total * saturate(1 - params.t_a_percent - params.t_d_percent, 0, 1);
+
+    // Protect from divide by zero
+    if (t_accel <= 0 || t_decel <= 0) {
+        state = State::IDLE;
+        v_last = 0;
+        v_end = 0;
+        return false;
+    }
 
-            t_counts_total = 0;
+    // Find the area under the curve
+    float dp = current.p_target - pos;
+    v_max = (dp - .5f * v_0 * t_accel - .5f * v_end * t_decel) / (.5f * t_accel + t_constant + .5f * t_decel);
 
-            state = State::ACCELERATING;
-        } else {
-            return pos;
-        }
+    accel = (v_max - v_0) / t_accel;
+    decel = (v_end - v_max) / t_decel;
+
+    p_start = pos;
+    start_us = now_us;
+    duration_us = (uint64_t)((t_accel + t_constant + t_decel) * 1e6f);
+
+    state = State::ACCELERATING;
+    return true;
+}
+
+void TrapezoidalPlanner::evaluate(float t) {
+    if (t < t_accel) {
+        state = State::ACCELERATING;
+        a_last = accel;
+        v_last = v_0 + accel * t;
+        p_last = p_start + (v_0 + .5f * accel * t) * t;
+        return;
     }
 
-    float v = 0;
-    switch (state) {
-        case State::ACCELERATING:
-            v = v_last + accel;
-            if (++t_counts_total >= (t_counts_accel)) {
-                state = State::CONSTANT;
-                t_counts_total = 0;
-            }
-
-            break;
-
-        case State::CONSTANT:
-            v = v_max;
-            if (++t_counts_total >= (t_counts_c)) {
-                state = State::DECELERATION;
-                t_counts_total = 0;
-            }
-
-            break;
-
-        case State::DECELERATION:
-            v = v_last + decel;
-            if (++t_counts_total >= t_counts_decel) {
-                state = State::IDLE;
-                t_counts_total = 0;
-            }
-            break;
-
-        case State::IDLE:
-        default:
-            break;
+    float p_accel_end = p_start + .5f * (v_0 + v_max) * t_accel;
+    t -= t_accel;
+
+    if (t < t_constant) {
+        state = State::CONSTANT;
+        a_last = 0;
+        v_last = v_max;
+        p_last = p_accel_end + v_max * t;
+        return;
     }
 
-    p_last = v + p_last;
-    v_last = v;
+    t -= t_constant;
 
-    return p_last;
+    state = State::DECELERATION;
+    a_last = decel;
+    v_last = v_max + decel * t;
+    p_last = p_accel_end + v_max * t_constant + (v_max + .5f * decel * t) * t;
 }
 
 TrapezoidalPlanner::State TrapezoidalPlanner::get_state() const {
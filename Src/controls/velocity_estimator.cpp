@@ -0,0 +1,42 @@
+#include "controls/velocity_estimator.h"
+
+#include "math/dsp.h"
+
+MTVelocityEstimator::MTVelocityEstimator(Parameters params)
+    : params(params), ref_count(0), ref_us(0), velocity(0) {}
+
+void MTVelocityEstimator::reset(int32_t count, uint64_t now_us) {
+    ref_count = count;
+    ref_us = now_us;
+    velocity = 0;
+}
+
+float MTVelocityEstimator::update(int32_t edge_count, uint64_t edge_us, uint64_t now_us) {
+    int32_t m = edge_count - ref_count;
+    uint32_t t_edges = edge_us - ref_us;
+
+    if (m != 0 && t_edges >= params.min_window_us) {
+        velocity = m * params.rad_per_count / (t_edges * 1e-6f);
+        ref_count = edge_count;
+        ref_us = edge_us;
+        return velocity;
+    }
+
+    uint32_t t_since_edge = now_us - edge_us;
+    if (t_since_edge >= params.timeout_us) {
+        // Don't let the window grow without bound while stopped
+        ref_count = edge_count;
+        ref_us = edge_us;
+        velocity = 0;
+    } else if (m == 0 && t_since_edge > 0) {
+        // Still waiting for the next edge, it is at least this far away
+        float bound = params.rad_per_count / (t_since_edge * 1e-6f);
+        velocity = saturate(velocity, -bound, bound);
+    }
+
+    return velocity;
+}
+
+float MTVelocityEstimator::get() const {
+    return velocity;
+}
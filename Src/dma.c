@@ -39,12 +39,12 @@ void MX_DMA_Init(void)
 {
 
   /* DMA controller clock enable */
-  // __HAL_RCC_DMA1_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
 
   /* DMA interrupt init */
   /* DMA1_Channel1_IRQn interrupt configuration */
-  // HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 0, 0);
-  // HAL_NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+  HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel1_IRQn);
 
 }
 
@@ -0,0 +1,113 @@
+#include "drivers/sensor_health.h"
+
+#include <math.h>
+
+uint32_t SensorHealth::Faults::to_int() const {
+    return ((no_data ? 1 : 0) << 0) | ((stuck ? 1 : 0) << 1) | ((saturated ? 1 : 0) << 2) | ((noisy ? 1 : 0) << 3);
+}
+
+void SensorHealth::Welford::add(float x) {
+    n++;
+    float delta = x - mean;
+    mean += delta / n;
+    m2 += delta * (x - mean);
+}
+
+float SensorHealth::Welford::std_dev() const {
+    return n > 1 ? sqrtf(m2 / (n - 1)) : 0;
+}
+
+SensorHealth::SensorHealth(Parameters params, uint32_t update_period_ms)
+    : params(params),
+      update_period_ms(update_period_ms),
+      faults{},
+      stats{},
+      has_sample(false),
+      last_sample_us(0),
+      last_value(0),
+      ms_since_sample(0),
+      ms_since_change(0),
+      values{},
+      changes{},
+      is_window_saturated(false) {}
+
+void SensorHealth::on_sample(ISensor::Sample const &sample) {
+    stats.num_samples++;
+
+    // Only a statistic, a timestamp out of order is left out of it
+    if (has_sample && sample.time_us > last_sample_us && sample.time_us - last_sample_us > stats.max_gap_us) {
+        stats.max_gap_us = sample.time_us - last_sample_us;
+    }
+
+    // The converter behind a held sample did move, only its reading was filtered out. No change to take the noise of.
+    if (sample.is_held) {
+        stats.num_held++;
+        ms_since_change = 0;
+    } else {
+        if (has_sample) {
+            changes.add(sample.value - last_value);
+        }
+        if (!has_sample || sample.value != last_value) {
+            ms_since_change = 0;
+        }
+        last_value = sample.value;
+    }
+
+    has_sample = true;
+    last_sample_us = sample.time_us;
+    ms_since_sample = 0;
+    faults.no_data = false;
+    faults.stuck = ms_since_change >= params.stuck_ms;
+
+    if (sample.is_saturated) {
+        stats.num_saturated++;
+        is_window_saturated = true;
+        faults.saturated = true;
+    }
+
+    values.add(sample.value);
+    if (values.n >= params.window_samples) {
+        finish_window();
+    }
+
+    stats.faults = faults.to_int();
+}
+
+void SensorHealth::finish_window() {
+    stats.mean = values.mean;
+    stats.std_dev = values.std_dev();
+    stats.noise = changes.std_dev();
+
+    faults.noisy = stats.noise > params.max_noise;
+    faults.saturated = is_window_saturated;
+
+    values = {};
+    changes = {};
+    is_window_saturated = false;
+}
+
+void SensorHealth::update() {
+    // Stop counting once past the limit, a sensor gone for weeks mustn't wrap around to healthy
+    if (ms_since_sample < params.max_gap_ms) {
+        ms_since_sample += update_period_ms;
+    }
+    if (ms_since_change < params.stuck_ms) {
+        ms_since_change += update_period_ms;
+    }
+
+    faults.no_data = ms_since_sample >= params.max_gap_ms;
+
+    stats.faults = faults.to_int();
+}
+
+SensorHealth::Faults const &SensorHealth::get_faults() const {
+    return faults;
+}
+
+bool SensorHealth::is_healthy() const {
+    return faults.to_int() == 0;
+}
+
+SensorHealth::Stats const *SensorHealth::get_stats() const {
+    return &stats;
+}
@@ -3,9 +3,12 @@
 #include <assert.h>
 #include <math.h>
 
-#include "adc.h"
+#include "clock.h"
 #include "math/dsp.h"
 
+// The HAL only gives us a global conversion callback, route it to the driver that owns the current sense
+static DRV8873 *active_driver = nullptr;
+
 DRV8873::DRV8873(GPIO_TypeDef *sleep_port, uint16_t sleep_pin, GPIO_TypeDef *disable_port, uint16_t disable_pin,
                  GPIO_TypeDef *fault_port, uint16_t fault_pin, TIM_HandleTypeDef *htim, uint32_t tim_channel_pwm1,
                  uint32_t tim_channel_pwm2, SPI_HandleTypeDef *hspi, GPIO_TypeDef *cs_port, uint16_t cs_pin,
@@ -22,6 +25,9 @@ DRV8873::DRV8873(GPIO_TypeDef *sleep_port, uint16_t sleep_pin, GPIO_TypeDef *dis
       hspi(hspi),
       cs_port(cs_port),
       cs_pin(cs_pin),
+      current_raw_sum(0),
+      sample_cb(nullptr),
+      sample_cb_arg(nullptr),
       is_inverted(is_inverted) {}
 
 void DRV8873::init() {
@@ -40,19 +46,84 @@ void DRV8873::init() {
     HAL_GPIO_Init(sleep_port, &init);
 
     HAL_GPIO_WritePin(cs_port, cs_pin, GPIO_PIN_SET);
+
+    active_driver = this;
+
+    // Calibrate while the ADC is still disabled
+    HAL_ADCEx_Calibration_Start(&hadc1, ADC_SINGLE_ENDED);
+    HAL_ADC_Start_DMA(&hadc1, (uint32_t *)current_dma_buf, ADC1_CURRENT_OVERSAMPLING);
+    // Only whole bursts are of any use
+    __HAL_DMA_DISABLE_IT(hadc1.DMA_Handle, DMA_IT_HT);
 }
 
-void DRV8873::set_current_raw_meas_dma(uint32_t *dma) {
-    current_raw_dma = dma;
+void DRV8873::set_sample_callback(SampleCallback cb, void *arg) {
+    sample_cb_arg = arg;
+    sample_cb = cb;
+}
+
+float DRV8873::get_pwm_frequency_hz() const {
+    // Timers on APB1 run at twice PCLK1 whenever the bus is divided down
+    RCC_ClkInitTypeDef clk;
+    uint32_t latency;
+    HAL_RCC_GetClockConfig(&clk, &latency);
+    uint32_t tim_clk = HAL_RCC_GetPCLK1Freq() * (clk.APB1CLKDivider == RCC_HCLK_DIV1 ? 1 : 2);
+
+    // Center aligned counts up then back down each period
+    bool is_center_aligned = htim->Init.CounterMode != TIM_COUNTERMODE_UP &&
+                             htim->Init.CounterMode != TIM_COUNTERMODE_DOWN;
+    uint32_t ticks = is_center_aligned ? 2 * htim->Init.Period : htim->Init.Period + 1;
+
+    return (float)tim_clk / ((htim->Init.Prescaler + 1) * ticks);
+}
+
+void DRV8873::conversion_complete_isr(ADC_HandleTypeDef *hadc) {
+    uint32_t sum = 0;
+    bool is_saturated = false;
+    for (uint8_t i = 0; i < ADC1_CURRENT_OVERSAMPLING; i++) {
+        sum += current_dma_buf[i];
+        is_saturated |= current_dma_buf[i] >= ADC_MAX_CODE;
+    }
+    current_raw_sum = sum;
+
+    // Signed by the direction driven during the burst, before the callback gets to change it. Kept in time order like
+    // the pressure samples, a stamp that isn't past the last one drops the sample.
+    uint64_t now = micros();
+    if (now <= last_sample_us) {
+        num_clock_faults++;
+    } else {
+        last_sample_us = now;
+        if (!samples.push({.time_us = now, .value = get_current(), .is_saturated = is_saturated, .is_held = false})) {
+            num_overruns++;
+        }
+    }
+
+    if (sample_cb) {
+        sample_cb(sample_cb_arg);
+    }
 }
 
 float DRV8873::get_current() {
-    uint32_t val = HAL_ADC_GetValue(&hadc1);
-    volatile float adc_voltage = (val * VREF) / 4096.0f;
+    float adc_voltage = (current_raw_sum * VREF) / (4096.0f * ADC1_CURRENT_OVERSAMPLING);
     float load_current = adc_voltage / R_LOAD;
     return get_sign_of_current() * load_current * I_MIRROR_RATIO;
 }
 
+float DRV8873::read() {
+    return get_current();
+}
+
+bool DRV8873::read_sample(Sample *sample) {
+    return samples.pop(sample);
+}
+
+uint32_t DRV8873::get_num_overruns() const {
+    return num_overruns;
+}
+
+uint32_t DRV8873::get_num_clock_faults() const {
+    return num_clock_faults;
+}
+
 void DRV8873::set_pwm_enabled(bool enable) {
     if (enable) {
         HAL_TIM_PWM_Start(htim, tim_channel_pwm1);
@@ -120,3 +191,7 @@ uint8_t DRV8873::run_spi_transaction(bool read, uint8_t reg_addr, uint8_t data)
     status_reg = rx_data[0];
     return rx_data[1];
 }
+
+extern "C" void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc) {
+    if (active_driver != nullptr && hadc->Instance == ADC1) active_driver->conversion_complete_isr(hadc);
+}
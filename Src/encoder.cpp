@@ -2,23 +2,57 @@
 
 #define HALFWAY 32768
 
-Encoder::Encoder(TIM_HandleTypeDef *tim) : htim(tim) {}
+Encoder::Encoder(TIM_HandleTypeDef *tim)
+    : htim(tim), edge_count(0), edge_raw(HALFWAY), edge_time_us(0), edge_seq(0) {}
 
 void Encoder::init() {
     reset();
     HAL_TIM_Encoder_Start(htim, TIM_CHANNEL_ALL);
 }
 
-int16_t Encoder::get() {
-    if (is_inverted) {
-        return HALFWAY - htim->Instance->CNT;
-    } else {
-        // return the counter offset from the halfway point
-        return htim->Instance->CNT - HALFWAY;
-    }
+int32_t Encoder::get() {
+    int32_t count;
+    uint16_t raw;
+    uint16_t cnt;
+    uint32_t seq;
+    do {
+        seq = edge_seq;
+        count = edge_count;
+        raw = edge_raw;
+        cnt = htim->Instance->CNT;
+    } while (seq != edge_seq);
+
+    // Counts since the last capture, the 16 bit difference is right across a timer wrap
+    int16_t delta = cnt - raw;
+    return count + (is_inverted ? -delta : delta);
 }
 
 void Encoder::reset() {
-    // reset the counter to the halfway point
+    // reset the counter to the halfway point. Written in this order a capture_edge() interrupting part way through
+    // can only accumulate a change that is zeroed right after.
     htim->Instance->CNT = HALFWAY;
+    edge_raw = HALFWAY;
+    edge_count = 0;
+    edge_seq++;
+}
+
+void Encoder::capture_edge(uint64_t now_us) {
+    uint16_t raw = htim->Instance->CNT;
+    int16_t delta = raw - edge_raw;
+    if (delta != 0) {
+        edge_count += is_inverted ? -delta : delta;
+        edge_raw = raw;
+        edge_time_us = now_us;
+        edge_seq++;
+    }
+}
+
+Encoder::Edge Encoder::get_last_edge() {
+    Edge edge;
+    uint32_t seq;
+    do {
+        seq = edge_seq;
+        edge = {edge_count, edge_time_us};
+    } while (seq != edge_seq);
+    return edge;
 }
@@ -1,17 +1,27 @@
 #include "lc064.h"
 
 #include <assert.h>
+#include <string.h>
 
-LC064::LC064(I2C_HandleTypeDef *hi2c, uint8_t dev_addr) : hi2c(hi2c) {}
+#include "clock.h"
+
+uint8_t LC064::erase_buf[PAGE_SIZE] = {0};
+
+// The HAL only gives us global completion callbacks, route them to the device that owns the bus.
+static LC064 *active_device = nullptr;
+
+LC064::LC064(I2C_HandleTypeDef *hi2c, uint8_t dev_addr) : hi2c(hi2c), state(State::IDLE) {}
 
 void LC064::init() {
     dev_addr = DEV_ADDR_BASE | ((dev_addr & DEV_ADDR_MASK) << DEV_ADDR_SHIFT);
+    active_device = this;
 }
 
 bool LC064::read(uint16_t addr, uint8_t *data, uint16_t len) {
     assert(addr <= TOTAL_SIZE);
     assert(len <= TOTAL_SIZE);
 
+    if (is_busy()) return false;
     if (!ready()) return false;
 
     HAL_StatusTypeDef status = HAL_I2C_Mem_Read(hi2c, dev_addr, addr, I2C_MEMADD_SIZE_16BIT, data, len, I2C_TIMEOUT);
@@ -22,6 +32,8 @@ bool LC064::write(uint16_t addr, uint8_t *data, uint16_t len) {
     assert(addr <= TOTAL_SIZE);
     assert(len <= TOTAL_SIZE);
 
+    if (is_busy()) return false;
+
     uint32_t bytes_written = 0;
     do {
         uint32_t max_bytes = PAGE_SIZE - ((addr + bytes_written) % PAGE_SIZE);
@@ -60,16 +72,181 @@ bool LC064::allocate(uint16_t size, uint16_t *addr) {
 }
 
 bool LC064::erase() {
-    uint8_t erase_buf[PAGE_SIZE] = {0};
     bool success;
     for (uint16_t addr = 0; addr < TOTAL_SIZE; addr += PAGE_SIZE) {
+        // Reading a page back is cheaper than a write cycle and doesn't wear the cell
+        success = read(addr, verify_buf, PAGE_SIZE);
+        if (success && memcmp(verify_buf, erase_buf, PAGE_SIZE) == 0) continue;
+
         success = write(addr, erase_buf, PAGE_SIZE);
         if (!success) return false;
     }
     return true;
 }
 
+bool LC064::read_async(uint16_t addr, uint8_t *data, uint16_t len, Callback cb, void *arg) {
+    return enqueue({.is_write = false, .is_fill = false, .addr = addr, .data = data, .len = len, .cb = cb, .arg = arg});
+}
+
+bool LC064::write_async(uint16_t addr, uint8_t *data, uint16_t len, Callback cb, void *arg) {
+    return enqueue({.is_write = true, .is_fill = false, .addr = addr, .data = data, .len = len, .cb = cb, .arg = arg});
+}
+
+bool LC064::erase_async(Callback cb, void *arg) {
+    return enqueue(
+          {.is_write = true, .is_fill = true, .addr = 0, .data = erase_buf, .len = TOTAL_SIZE, .cb = cb, .arg = arg});
+}
+
+bool LC064::is_busy() {
+    return state != State::IDLE || !queue.empty();
+}
+
+void LC064::update() {
+    switch (state) {
+        case State::IDLE:
+            if (!queue.empty()) {
+                bytes_done = 0;
+                start_transfer();
+            }
+            break;
+
+        case State::VERIFY:
+            if (!is_transfer_done) {
+                break;
+            }
+
+            if (!is_transfer_ok) {
+                finish(false);
+            } else if (memcmp(verify_buf, queue.peek()->data, bytes_in_flight) == 0) {
+                bytes_done += bytes_in_flight;
+                next_page();
+            } else {
+                start_transfer(true);
+            }
+            break;
+
+        case State::TRANSFER:
+            if (!is_transfer_done) {
+                break;
+            }
+
+            if (!is_transfer_ok) {
+                finish(false);
+            } else if (queue.peek()->is_write) {
+                bytes_done += bytes_in_flight;
+                write_cycle_start_ms = millis();
+                state = State::WRITE_CYCLE;
+            } else {
+                finish(true);
+            }
+            break;
+
+        case State::WRITE_CYCLE:
+            // Don't bother ack polling until the nominal write time is up, a NACKed poll still costs a bus
+            // transaction.
+            if (time_since_ms(write_cycle_start_ms) < WRITE_CYCLE_TIME_MS) {
+                break;
+            }
+
+            if (HAL_I2C_IsDeviceReady(hi2c, dev_addr, 1, ACK_POLL_TIMEOUT) == HAL_OK) {
+                next_page();
+            } else if (time_since_ms(write_cycle_start_ms) > WRITE_CYCLE_TIMEOUT_MS) {
+                finish(false);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+void LC064::transfer_complete_isr(I2C_HandleTypeDef *hi2c, bool success) {
+    if (hi2c != this->hi2c || (state != State::TRANSFER && state != State::VERIFY)) {
+        return;
+    }
+
+    is_transfer_ok = success;
+    is_transfer_done = true;
+}
+
+bool LC064::enqueue(Transaction const &t) {
+    assert(t.addr <= TOTAL_SIZE);
+    assert(t.len <= TOTAL_SIZE);
+
+    if (t.len == 0) {
+        return false;
+    }
+
+    return queue.push(t);
+}
+
+void LC064::start_transfer(bool is_verified) {
+    Transaction *t = queue.peek();
+    uint16_t addr = t->addr + bytes_done;
+
+    is_transfer_done = false;
+    is_transfer_ok = false;
+    state = State::TRANSFER;
+
+    HAL_StatusTypeDef status;
+    if (t->is_write) {
+        // Page writes wrap around within the page, so never cross a page boundary
+        bytes_in_flight = PAGE_SIZE - (addr % PAGE_SIZE);
+        if (bytes_in_flight > t->len - bytes_done) bytes_in_flight = t->len - bytes_done;
+
+        if (t->is_fill && !is_verified) {
+            state = State::VERIFY;
+            status = HAL_I2C_Mem_Read_IT(hi2c, dev_addr, addr, I2C_MEMADD_SIZE_16BIT, verify_buf, bytes_in_flight);
+            if (status != HAL_OK) {
+                finish(false);
+            }
+            return;
+        }
+
+        uint8_t *src = t->is_fill ? t->data : &t->data[bytes_done];
+        status = HAL_I2C_Mem_Write_IT(hi2c, dev_addr, addr, I2C_MEMADD_SIZE_16BIT, src, bytes_in_flight);
+    } else {
+        bytes_in_flight = t->len;
+        status = HAL_I2C_Mem_Read_IT(hi2c, dev_addr, addr, I2C_MEMADD_SIZE_16BIT, t->data, bytes_in_flight);
+    }
+
+    if (status != HAL_OK) {
+        finish(false);
+    }
+}
+
+void LC064::next_page() {
+    if (bytes_done < queue.peek()->len) {
+        start_transfer();
+    } else {
+        finish(true);
+    }
+}
+
+void LC064::finish(bool success) {
+    Transaction t;
+    queue.pop(&t);
+    state = State::IDLE;
+
+    // Pop first so the callback is free to queue up the next transaction
+    if (t.cb != nullptr) {
+        t.cb(success, t.arg);
+    }
+}
+
 bool LC064::ready() {
     volatile HAL_StatusTypeDef status = HAL_I2C_IsDeviceReady(hi2c, dev_addr, NUM_TEST_TRIALS, I2C_TIMEOUT);
     return status == HAL_OK;
 }
+
+extern "C" void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c) {
+    if (active_device != nullptr) active_device->transfer_complete_isr(hi2c, true);
+}
+
+extern "C" void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c) {
+    if (active_device != nullptr) active_device->transfer_complete_isr(hi2c, true);
+}
+
+extern "C" void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c) {
+    if (active_device != nullptr) active_device->transfer_complete_isr(hi2c, false);
+}
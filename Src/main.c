@@ -21,6 +21,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
 #include "adc.h"
+#include "dma.h"
 #include "i2c.h"
 #include "iwdg.h"
 #include "spi.h"
@@ -95,6 +96,7 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_ADC1_Init();
   MX_I2C1_Init();
   MX_SPI1_Init();
@@ -106,7 +108,9 @@ int main(void)
   MX_TIM4_Init();
   MX_IWDG_Init();
   /* USER CODE BEGIN 2 */
-  HAL_ADC_Start(&hadc1);
+  // Compare 2 sits at the top of the center aligned count, in the middle of the drive pulse. It triggers the ADC,
+  // the motor driver starts the sampling.
+  HAL_TIM_OC_Start(&htim2, TIM_CHANNEL_2);
 
   abvm_init();
 
@@ -0,0 +1,171 @@
+#include "pressure_auto_zero.h"
+
+#include <math.h>
+
+#include "clock.h"
+#include "math/dsp.h"
+
+PressureAutoZero::PressureAutoZero(Parameters params, float *zero_cmH2O)
+    : params(params),
+      zero_cmH2O(zero_cmH2O),
+      is_capture_running(false),
+      capture_start_us(0),
+      has_sample(false),
+      last_sample_us(0),
+      num_samples(0),
+      num_captures(0),
+      num_failed_captures(0),
+      captured_zero_cmH2O(*zero_cmH2O),
+      saved_zero_cmH2O(*zero_cmH2O),
+      storing_zero_cmH2O(*zero_cmH2O),
+      is_store_requested(false),
+      is_store_running(false),
+      has_reference(false),
+      reference_cmH2O(0) {}
+
+void PressureAutoZero::reset() {
+    is_capture_running = false;
+    captured_zero_cmH2O = *zero_cmH2O;
+    saved_zero_cmH2O = *zero_cmH2O;
+    is_store_requested = false;
+    has_reference = false;
+}
+
+void PressureAutoZero::start_capture() {
+    is_capture_running = true;
+    capture_start_us = micros();
+    has_sample = false;
+    num_samples = 0;
+}
+
+void PressureAutoZero::cancel_capture() {
+    is_capture_running = false;
+}
+
+bool PressureAutoZero::is_capturing() const {
+    return is_capture_running;
+}
+
+void PressureAutoZero::on_sample(ISensor::Sample const &sample) {
+    if (!is_capture_running) {
+        return;
+    }
+
+    // Queued before the capture started
+    if (!has_sample && sample.time_us < capture_start_us) {
+        return;
+    }
+
+    // Lost samples or a clock that jumped, neither the settling nor the readings so far can be trusted. Settle again
+    // from this one.
+    bool is_in_step = !has_sample || (sample.time_us > last_sample_us &&
+                                      sample.time_us - last_sample_us <= MAX_SAMPLE_STEP_US);
+    has_sample = true;
+    last_sample_us = sample.time_us;
+    if (!is_in_step) {
+        capture_start_us = sample.time_us;
+        num_samples = 0;
+        return;
+    }
+
+    if (sample.time_us - capture_start_us < (uint64_t)params.settle_ms * 1000) {
+        return;
+    }
+
+    samples[num_samples++] = sample.value;
+    if (num_samples == NUM_CAPTURE_SAMPLES) {
+        finish_capture();
+    }
+}
+
+void PressureAutoZero::finish_capture() {
+    // Still settling if the second half of the capture moved away from the first, wait it out
+    constexpr size_t n = NUM_CAPTURE_SAMPLES;
+    sort(samples, n / 2);
+    sort(&samples[n / 2], n / 2);
+    float trend = samples[n / 2 + n / 4] - samples[n / 4];
+    if (fabsf(trend) > params.max_capture_trend) {
+        num_failed_captures++;
+        capture_start_us = last_sample_us;
+        num_samples = 0;
+        return;
+    }
+    is_capture_running = false;
+
+    sort(samples, n);
+    float median = (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    float spread = samples[3 * n / 4] - samples[n / 4];
+    float zero = *zero_cmH2O + median;
+
+    if (spread > params.max_capture_spread || fabsf(zero) > params.max_zero) {
+        num_failed_captures++;
+        return;
+    }
+
+    captured_zero_cmH2O = zero;
+    has_reference = false;  // The expirations level off somewhere else now
+    num_captures++;
+    move_zero(zero);
+}
+
+// Insertion sort, once a capture
+void PressureAutoZero::sort(float *x, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        float v = x[i];
+        size_t j = i;
+        for (; j > 0 && x[j - 1] > v; j--) {
+            x[j] = x[j - 1];
+        }
+        x[j] = v;
+    }
+}
+
+void PressureAutoZero::on_expiration_plateau(float pressure_cmH2O) {
+    if (!has_reference || fabsf(pressure_cmH2O - reference_cmH2O) > params.drift_step) {
+        reference_cmH2O = pressure_cmH2O;
+        has_reference = true;
+        return;
+    }
+
+    // Readings fall by as much as the zero rises, so this closes in on the reference
+    float zero = *zero_cmH2O + params.drift_gain * (pressure_cmH2O - reference_cmH2O);
+    move_zero(saturate(zero, captured_zero_cmH2O - params.max_drift, captured_zero_cmH2O + params.max_drift));
+}
+
+void PressureAutoZero::move_zero(float zero) {
+    *zero_cmH2O = zero;
+    if (fabsf(zero - saved_zero_cmH2O) >= params.store_threshold) {
+        is_store_requested = true;
+    }
+}
+
+bool PressureAutoZero::take_store_request() {
+    if (!is_store_requested || is_store_running) {
+        return false;
+    }
+
+    is_store_running = true;
+    storing_zero_cmH2O = *zero_cmH2O;
+    return true;
+}
+
+void PressureAutoZero::on_stored(bool success, void *arg) {
+    PressureAutoZero *az = (PressureAutoZero *)arg;
+
+    az->is_store_running = false;
+    if (!success) {
+        return;
+    }
+
+    // The zero may have moved on while it was being written
+    az->saved_zero_cmH2O = az->storing_zero_cmH2O;
+    az->is_store_requested = fabsf(*az->zero_cmH2O - az->saved_zero_cmH2O) >= az->params.store_threshold;
+}
+
+uint16_t PressureAutoZero::get_num_captures() const {
+    return num_captures;
+}
+
+uint16_t PressureAutoZero::get_num_failed_captures() const {
+    return num_failed_captures;
+}
@@ -5,26 +5,48 @@
 
 #include "crc16.h"
 
-RecordStore::RecordStore(EEPROM<uint16_t, uint8_t> *eeprom) : eeprom(eeprom), num_entries(0) {}
+RecordStore::RecordStore(EEPROM<uint16_t, uint8_t> *eeprom)
+    : eeprom(eeprom),
+      num_entries(0),
+      num_migrations(0),
+      num_migrated(0),
+      num_legacy_entries(0),
+      shadow_used(0),
+      stats{},
+      is_storing(false) {}
 
 bool RecordStore::init() {
     return add_entry("header", &header, sizeof(header), sizeof(header));
 }
 
-bool RecordStore::add_entry(const char *name, void *data, uint16_t size_bytes, uint16_t max_size_bytes) {
+bool RecordStore::add_entry(const char *name, void *data, uint16_t size_bytes, uint16_t max_size_bytes,
+                            uint16_t schema) {
     assert(name != nullptr);
     assert(data != nullptr);
-    assert(max_size_bytes <= MAX_BUFFER_SIZE_BYTES + 2);
+    assert(max_size_bytes <= MAX_BUFFER_SIZE_BYTES);
     assert(0 < size_bytes && size_bytes <= max_size_bytes);
-    assert(num_entries < MAX_NUM_ENTRIES);
+    assert(num_entries < MAX_NUM_ENTRIES + NUM_HEADER_ENTRIES);
 
     Entry *entry = &entries[num_entries];
     entry->name = name;
     entry->data = data;
     entry->size = size_bytes;
+    entry->schema = schema;
     entry->is_valid = false;
+    entry->is_scanned = false;
+    entry->slot = NUM_SLOTS - 1;
+    entry->sequence = 0;
+    entry->is_shadow_valid = false;
+    entry->shadow = nullptr;
 
-    bool success = eeprom->allocate(max_size_bytes + CRC_SIZE_BYTES, &entry->address);
+    // Without a shadow copy the entry still works, it just gets rewritten on every store
+    if (shadow_used + size_bytes <= SHADOW_BUFFER_SIZE_BYTES) {
+        entry->shadow = &shadow_buf[shadow_used];
+        shadow_used += size_bytes;
+    }
+
+    entry->slot_stride = num_blocks(max_size_bytes + SLOT_OVERHEAD_BYTES) * BLOCK_SIZE_BYTES;
+    bool success = eeprom->allocate(entry->slot_stride * NUM_SLOTS, &entry->address);
 
     if (!success) {
         return false;
@@ -34,7 +56,36 @@ bool RecordStore::add_entry(const char *name, void *data, uint16_t size_bytes, u
     return true;
 }
 
+bool RecordStore::add_migration(const char *name, uint16_t from_schema, Migration fn) {
+    assert(fn != nullptr);
+
+    Entry *entry = find_entry_by_name(name);
+
+    if (entry == nullptr || num_migrations >= MAX_NUM_MIGRATIONS) {
+        return false;
+    }
+
+    migrations[num_migrations++] = {.entry = entry, .from_schema = from_schema, .fn = fn};
+    return true;
+}
+
+bool RecordStore::add_legacy_entry(const char *name, uint16_t size_bytes) {
+    Entry *entry = find_entry_by_name(name);
+
+    if (entry == nullptr || num_legacy_entries >= MAX_NUM_ENTRIES || size_bytes > MAX_BUFFER_SIZE_BYTES) {
+        return false;
+    }
+
+    legacy_entries[num_legacy_entries++] = {.entry = entry, .size = size_bytes};
+    return true;
+}
+
 bool RecordStore::store_all() {
+    if (is_storing) {
+        return false;
+    }
+
+    stats = {};
     for (uint16_t i = 0; i < num_entries; i++) {
         if (!store_entry(&entries[i])) {
             return false;
@@ -44,28 +95,126 @@ bool RecordStore::store_all() {
 }
 
 bool RecordStore::load_all() {
+    if (is_storing) {
+        return false;
+    }
+
+    // Keep going on a failure, one record that can't be loaded shouldn't take the others with it
+    bool success = true;
+    num_migrated = 0;
     for (uint16_t i = 0; i < num_entries; i++) {
-        if (!load_entry(&entries[i], false)) {
+        success &= load_entry(&entries[i], false);
+    }
+    return success;
+}
+
+bool RecordStore::store_all_async(EEPROM<uint16_t, uint8_t>::Callback cb, void *arg) {
+    if (is_storing) {
+        return false;
+    }
+
+    // Finding the newest slot needs blocking reads, that has to have happened at boot
+    for (uint16_t i = 0; i < num_entries; i++) {
+        if (!entries[i].is_scanned) {
             return false;
         }
     }
+
+    is_storing = true;
+    store_cb = cb;
+    store_cb_arg = arg;
+
+    if (!start_store_async(0, num_entries)) {
+        is_storing = false;
+        return false;
+    }
     return true;
 }
 
+bool RecordStore::store_async(const char *name, EEPROM<uint16_t, uint8_t>::Callback cb, void *arg) {
+    Entry *entry = find_entry_by_name(name);
+
+    if (entry == nullptr || is_storing || !entry->is_scanned) {
+        return false;
+    }
+
+    is_storing = true;
+    store_cb = cb;
+    store_cb_arg = arg;
+
+    uint16_t idx = entry - entries;
+    if (!start_store_async(idx, idx + 1)) {
+        is_storing = false;
+        return false;
+    }
+    return true;
+}
+
+bool RecordStore::erase_async(EEPROM<uint16_t, uint8_t>::Callback cb, void *arg) {
+    if (is_storing) {
+        return false;
+    }
+
+    is_storing = true;
+    is_store_after_erase = false;
+    store_cb = cb;
+    store_cb_arg = arg;
+
+    if (!eeprom->erase_async(on_erased, this)) {
+        is_storing = false;
+        return false;
+    }
+    return true;
+}
+
+bool RecordStore::reset_async(EEPROM<uint16_t, uint8_t>::Callback cb, void *arg) {
+    if (!erase_async(cb, arg)) {
+        return false;
+    }
+
+    is_store_after_erase = true;
+    return true;
+}
+
+bool RecordStore::is_busy() {
+    return is_storing;
+}
+
+RecordStore::Stats const *RecordStore::get_stats() const {
+    return &stats;
+}
+
 bool RecordStore::first_load() {
-    bool success = load("header", true);
+    bool success = load("header", false);
+
+    // No valid header. The memory has been erased or never programmed, holds a different store layout, or a first boot
+    // lost power before the header went out. Records that are already in their slots are kept, then whatever is left
+    // of the first layout is brought over, and the rest get their defaults.
+    if (!success || header.magic_num != MAGIC_HEADER || header.version != VERSION_NUM) {
+        load_all();
+        if (!import_legacy()) {
+            return false;
+        }
+
+        // The header goes last, so a power loss before then comes back through here on the next boot
+        stats = {};
+        for (uint16_t i = NUM_HEADER_ENTRIES; i < num_entries; i++) {
+            if (!store_entry(&entries[i])) {
+                return false;
+            }
+        }
 
-    // The CRC is not valid AND the magic header has been corrupted. Assume this means
-    // the memory has been erased or never programmed. Program defaults
-    if (header.magic_num != MAGIC_HEADER) {
         reset_header();
-        success = store_all();
-        return success;
-    } else if (!success) {
-        return false;
-    } else {
-        return load_all();
+        return store_entry(&entries[0]);
+    }
+
+    success = load_all();
+
+    // Write upgraded records back so the migrations only run once
+    if (num_migrated > 0) {
+        success &= store_all();
     }
+    return success;
 }
 
 bool RecordStore::load(const char *name, bool force_load) {
@@ -81,10 +230,11 @@ bool RecordStore::load(const char *name, bool force_load) {
 bool RecordStore::store(const char *name) {
     Entry *entry = find_entry_by_name(name);
 
-    if (entry == nullptr) {
+    if (entry == nullptr || is_storing) {
         return false;
     }
 
+    stats = {};
     return store_entry(entry);
 }
 
@@ -102,37 +252,349 @@ RecordStore::Entry *RecordStore::find_entry_by_name(const char *name) {
 }
 
 bool RecordStore::load_entry(Entry *entry, bool force_load) {
-    bool success = eeprom->read(entry->address, write_buf, entry->size);
-    if (!success) {
+    if (!scan_entry(entry)) {
         return false;
     }
 
-    uint16_t read_crc;
-    success = eeprom->read(entry->address + entry->size, (uint8_t *)&read_crc, CRC_SIZE_BYTES);
-    if (!success) {
+    if (!entry->is_valid) {
+        if (force_load) {
+            bool is_slot_valid;
+            if (!read_slot(entry, 0, entry->size, &is_slot_valid)) {
+                return false;
+            }
+            memcpy(entry->data, &write_buf[sizeof(SlotHeader)], entry->size);
+        }
         return false;
     }
 
-    uint16_t crc = CRC16::calc(write_buf, entry->size);
-    entry->is_valid = (crc == read_crc);
+    // scan_entry leaves the newest valid version in the write buffer
+    SlotHeader slot_header;
+    memcpy(&slot_header, write_buf, sizeof(slot_header));
 
-    if (entry->is_valid || force_load) {
-        memcpy(entry->data, write_buf, entry->size);
+    if (slot_header.schema != entry->schema || slot_header.size != entry->size) {
+        if (!migrate_entry(entry, &slot_header)) {
+            // Keep the defaults, the next store replaces the old record. The ring position stays valid.
+            entry->is_valid = false;
+            return false;
+        }
+        num_migrated++;
+    }
+
+    memcpy(entry->data, &write_buf[sizeof(SlotHeader)], entry->size);
+    return true;
+}
+
+bool RecordStore::migrate_entry(Entry *entry, SlotHeader const *slot_header) {
+    uint16_t schema = slot_header->schema;
+    uint16_t size = slot_header->size;
+
+    // Only upgrades, a record written by newer firmware has no migration back and falls back to defaults
+    while (schema != entry->schema) {
+        Migration fn = find_migration(entry, schema);
+        if (fn == nullptr) {
+            return false;
+        }
+
+        size = fn(&write_buf[sizeof(SlotHeader)], size);
+        if (size == 0 || size > MAX_BUFFER_SIZE_BYTES) {
+            return false;
+        }
+        schema++;
     }
 
-    return entry->is_valid;
+    return size == entry->size;
+}
+
+bool RecordStore::import_legacy() {
+    uint16_t addr = 0;
+    bool is_valid;
+    if (!read_legacy(&addr, sizeof(Header), &is_valid)) {
+        return false;
+    }
+
+    Header legacy_header;
+    memcpy(&legacy_header, &write_buf[sizeof(SlotHeader)], sizeof(legacy_header));
+    if (!is_valid || legacy_header.magic_num != MAGIC_HEADER || legacy_header.version != LEGACY_VERSION_NUM) {
+        // Not that layout, nothing to import
+        return true;
+    }
+
+    for (uint16_t i = 0; i < num_legacy_entries; i++) {
+        LegacyEntry const *legacy = &legacy_entries[i];
+        if (!read_legacy(&addr, legacy->size, &is_valid)) {
+            return false;
+        }
+
+        // A record that is corrupt or can't be upgraded keeps its defaults, the others still come over
+        SlotHeader slot_header = {.sequence = 0, .schema = LEGACY_SCHEMA, .size = legacy->size};
+        if (is_valid && migrate_entry(legacy->entry, &slot_header)) {
+            memcpy(legacy->entry->data, &write_buf[sizeof(SlotHeader)], legacy->entry->size);
+        }
+    }
+    return true;
+}
+
+bool RecordStore::read_legacy(uint16_t *addr, uint16_t size, bool *is_valid) {
+    // Read into the data part of the write buffer so the migrations can run on it in place
+    uint8_t *buf = &write_buf[sizeof(SlotHeader)];
+    uint16_t len = size + CRC_SIZE_BYTES;
+
+    if (!eeprom->read(*addr, buf, len)) {
+        return false;
+    }
+
+    uint16_t read_crc;
+    memcpy(&read_crc, &buf[size], CRC_SIZE_BYTES);
+    *is_valid = CRC16::calc(buf, size) == read_crc;
+
+    // The old allocator always moved on to the start of the next block, even from the end of one
+    *addr += len + (BLOCK_SIZE_BYTES - (len % BLOCK_SIZE_BYTES));
+    return true;
+}
+
+RecordStore::Migration RecordStore::find_migration(Entry const *entry, uint16_t from_schema) {
+    for (uint16_t i = 0; i < num_migrations; i++) {
+        if (migrations[i].entry == entry && migrations[i].from_schema == from_schema) {
+            return migrations[i].fn;
+        }
+    }
+    return nullptr;
+}
+
+bool RecordStore::scan_entry(Entry *entry) {
+    // Only the slot headers are read up front. Candidates are then checked in full newest first, so normally just
+    // one slot is read completely.
+    SlotHeader slot_headers[NUM_SLOTS];
+    uint32_t sequences[NUM_SLOTS];
+    for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+        if (!eeprom->read(slot_address(entry, i), (uint8_t *)&slot_headers[i], sizeof(SlotHeader))) {
+            return false;
+        }
+        sequences[i] = slot_headers[i].sequence;
+    }
+
+    entry->is_valid = false;
+    entry->is_shadow_valid = false;
+    entry->slot = NUM_SLOTS - 1;
+    entry->sequence = 0;
+
+    while (true) {
+        int16_t newest = -1;
+        for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+            if (sequences[i] != 0 && (newest < 0 || is_newer(sequences[i], sequences[newest]))) {
+                newest = i;
+            }
+        }
+
+        if (newest < 0) {
+            break;
+        }
+
+        bool is_slot_valid;
+        if (!read_slot(entry, newest, slot_headers[newest].size, &is_slot_valid)) {
+            return false;
+        }
+
+        if (is_slot_valid) {
+            entry->is_valid = true;
+            entry->slot = newest;
+            entry->sequence = sequences[newest];
+            break;
+        }
+
+        // Torn or corrupt, fall back to the next newest
+        sequences[newest] = 0;
+    }
+
+    // Records in an old schema don't match the live layout, they always get rewritten
+    bool is_current = entry->is_valid && slot_headers[entry->slot].schema == entry->schema &&
+                      slot_headers[entry->slot].size == entry->size;
+
+    if (is_current && entry->shadow != nullptr) {
+        memcpy(entry->shadow, &write_buf[sizeof(SlotHeader)], entry->size);
+        entry->is_shadow_valid = true;
+    }
+
+    entry->is_scanned = true;
+    return true;
+}
+
+bool RecordStore::read_slot(Entry *entry, uint8_t slot, uint16_t size, bool *is_valid) {
+    uint16_t len = sizeof(SlotHeader) + size + CRC_SIZE_BYTES;
+
+    // A corrupt size would run past the slot, don't bother reading it
+    if (size > MAX_BUFFER_SIZE_BYTES || len > entry->slot_stride) {
+        *is_valid = false;
+        return true;
+    }
+
+    if (!eeprom->read(slot_address(entry, slot), write_buf, len)) {
+        return false;
+    }
+
+    SlotHeader slot_header;
+    uint16_t read_crc;
+    memcpy(&slot_header, write_buf, sizeof(slot_header));
+    memcpy(&read_crc, &write_buf[len - CRC_SIZE_BYTES], CRC_SIZE_BYTES);
+
+    *is_valid = slot_header.sequence != 0 && CRC16::calc(write_buf, len - CRC_SIZE_BYTES) == read_crc;
+    return true;
 }
 
 bool RecordStore::store_entry(Entry *entry) {
-    bool success = eeprom->write(entry->address, (uint8_t *)entry->data, entry->size);
-    if (!success) {
+    if (!entry->is_scanned && !scan_entry(entry)) {
         return false;
     }
 
-    uint16_t crc = CRC16::calc((uint8_t *)entry->data, entry->size);
-    success = eeprom->write(entry->address + entry->size, (uint8_t *)&crc, CRC_SIZE_BYTES);
+    uint16_t len = pack_entry(entry);
+    if (!is_entry_dirty(entry)) {
+        stats.pages_skipped += num_blocks(len);
+        return true;
+    }
 
-    return success;
+    // The newest version is never touched, if this write fails it is still there
+    if (!eeprom->write(slot_address(entry, next_slot(entry)), write_buf, len)) {
+        return false;
+    }
+
+    commit_entry(entry, len);
+    return true;
+}
+
+uint16_t RecordStore::pack_entry(Entry *entry) {
+    // Snapshot the data first, the CRC has to match what actually goes out
+    SlotHeader slot_header = {.sequence = entry->sequence + 1, .schema = entry->schema, .size = entry->size};
+    if (slot_header.sequence == 0) slot_header.sequence = 1;
+
+    memcpy(write_buf, &slot_header, sizeof(slot_header));
+    memcpy(&write_buf[sizeof(slot_header)], entry->data, entry->size);
+
+    uint16_t len = sizeof(slot_header) + entry->size;
+    uint16_t crc = CRC16::calc(write_buf, len);
+    memcpy(&write_buf[len], &crc, CRC_SIZE_BYTES);
+    return len + CRC_SIZE_BYTES;
+}
+
+uint16_t RecordStore::slot_address(Entry const *entry, uint8_t slot) const {
+    return entry->address + slot * entry->slot_stride;
+}
+
+uint8_t RecordStore::next_slot(Entry const *entry) const {
+    return (entry->slot + 1) % NUM_SLOTS;
+}
+
+bool RecordStore::is_entry_dirty(Entry *entry) {
+    return !entry->is_shadow_valid || memcmp(entry->shadow, &write_buf[sizeof(SlotHeader)], entry->size) != 0;
+}
+
+void RecordStore::commit_entry(Entry *entry, uint16_t len) {
+    SlotHeader slot_header;
+    memcpy(&slot_header, write_buf, sizeof(slot_header));
+
+    entry->slot = next_slot(entry);
+    entry->sequence = slot_header.sequence;
+    entry->is_valid = true;
+
+    if (entry->shadow != nullptr) {
+        memcpy(entry->shadow, &write_buf[sizeof(SlotHeader)], entry->size);
+        entry->is_shadow_valid = true;
+    }
+
+    stats.pages_written += num_blocks(len);
+}
+
+void RecordStore::invalidate_slots() {
+    for (uint16_t i = 0; i < num_entries; i++) {
+        Entry *entry = &entries[i];
+        entry->is_valid = false;
+        entry->is_shadow_valid = false;
+        entry->slot = NUM_SLOTS - 1;
+        entry->sequence = 0;
+    }
+}
+
+bool RecordStore::start_store_async(uint16_t first, uint16_t end) {
+    stats = {};
+    store_idx = first;
+    store_end = end;
+
+    if (!next_dirty_entry()) {
+        // Nothing changed, we are already done
+        finish_async(true);
+        return true;
+    }
+
+    Entry *entry = &entries[store_idx];
+    return eeprom->write_async(slot_address(entry, next_slot(entry)), write_buf, store_len, on_entry_stored, this);
+}
+
+bool RecordStore::next_dirty_entry() {
+    for (; store_idx < store_end; store_idx++) {
+        // Entries share the write buffer, snapshot each one as we get to it
+        store_len = pack_entry(&entries[store_idx]);
+        if (is_entry_dirty(&entries[store_idx])) {
+            return true;
+        }
+        stats.pages_skipped += num_blocks(store_len);
+    }
+
+    return false;
+}
+
+void RecordStore::finish_async(bool success) {
+    is_storing = false;
+    if (store_cb != nullptr) {
+        store_cb(success, store_cb_arg);
+    }
+}
+
+void RecordStore::on_entry_stored(bool success, void *arg) {
+    RecordStore *store = (RecordStore *)arg;
+
+    if (!success) {
+        store->finish_async(false);
+        return;
+    }
+
+    store->commit_entry(&store->entries[store->store_idx], store->store_len);
+    store->store_idx++;
+
+    if (!store->next_dirty_entry()) {
+        store->finish_async(true);
+        return;
+    }
+
+    Entry *entry = &store->entries[store->store_idx];
+    if (!store->eeprom->write_async(store->slot_address(entry, store->next_slot(entry)), store->write_buf,
+                                    store->store_len, on_entry_stored, store)) {
+        store->finish_async(false);
+    }
+}
+
+void RecordStore::on_erased(bool success, void *arg) {
+    RecordStore *store = (RecordStore *)arg;
+
+    // Even a failed erase may have wiped some slots, forget everything we knew about them
+    store->invalidate_slots();
+
+    if (success && store->is_store_after_erase) {
+        store->reset_header();
+        if (!store->start_store_async(0, store->num_entries)) {
+            store->finish_async(false);
+        }
+        return;
+    }
+
+    store->finish_async(success);
+}
+
+uint16_t RecordStore::num_blocks(uint16_t len) {
+    return (len + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+}
+
+bool RecordStore::is_newer(uint32_t a, uint32_t b) {
+    // Serial number arithmetic, survives the (theoretical) wrap of the sequence counter
+    return (int32_t)(a - b) > 0;
 }
 
 void RecordStore::reset_header() {
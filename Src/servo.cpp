@@ -1,19 +1,31 @@
 #include "servo.h"
 
+#include "clock.h"
+
 uint32_t Servo::Faults::to_int() {
     return ((no_encoder ? 1 : 0) << 0) | ((wrong_dir ? 1 : 0) << 1) | ((overcurrent ? 1 : 0) << 2) |
            ((excessive_pos_error ? 1 : 0) << 3);
 }
 
 Servo::Servo(uint32_t update_period_ms, DRV8873 *driver, Encoder *encoder,Pin *limit_switch, Config cfg, PID::Params vel_pid_params,
-             Range<float> vel_limits, PID::Params pos_pid_params, Range<float> pos_limits, bool is_inverted)
+             Range<float> vel_limits, PID::Params pos_pid_params, Range<float> pos_limits, PID::Params cur_pid_params, bool is_inverted)
     : driver(driver),
       encoder(encoder),
       limit_switch(limit_switch),
       config(cfg),
       period_ms(update_period_ms),
-      vel_pid(vel_pid_params, update_period_ms / 1000.0),
-      pos_pid(pos_pid_params, update_period_ms / 1000.0),
+      mode(Mode::OFF),
+      vel_pid(vel_pid_params, update_period_ms / 1000.0f),
+      pos_pid(pos_pid_params, update_period_ms / 1000.0f),
+      cur_pid(cur_pid_params, 1),  // Placeholder period until init() reads the PWM rate
+      velocity_estimator({.rad_per_count = 2 * (float)M_PI / cfg.counts_per_rev / cfg.gear_reduction,
+                          .min_window_us = VELOCITY_MIN_WINDOW_US,
+                          .timeout_us = VELOCITY_TIMEOUT_US}),
+      position_filter(POSITION_FILTER_HZ, 1000.0f / update_period_ms),
+      velocity_filter(VELOCITY_FILTER_HZ, 1000.0f / update_period_ms),
+      current_filter(CURRENT_FILTER_HZ, 1),  // Placeholder rate until init() reads the PWM rate
+      commanded_pos_filter(COMMAND_FILTER_HZ, 1000.0f / update_period_ms),
+      commanded_vel_filter(COMMAND_FILTER_HZ, 1000.0f / update_period_ms),
       pos_limits(pos_limits),
       vel_limits(vel_limits),
       is_inverted(is_inverted),
@@ -25,18 +37,95 @@ Servo::Servo(uint32_t update_period_ms, DRV8873 *driver, Encoder *encoder,Pin *l
 
 void Servo::set_pos(float pos) {
     target_pos = pos;
+    is_following_trajectory = false;
+    ff_velocity = 0;
+    ff_accel = 0;
 }
 void Servo::set_pos_deg(float pos) {
-    target_pos = deg_to_rad(pos);
+    set_pos(deg_to_rad(pos));
+}
+
+void Servo::set_trajectory(float pos, float vel, float acc) {
+    target_pos = pos;
+    commanded_pos = pos;
+    trajectory_pos = pos;
+    trajectory_us = micros();
+    ff_velocity = vel;
+    ff_accel = acc;
+    is_following_trajectory = true;
+}
+
+void Servo::set_trajectory_deg(float pos, float vel, float acc) {
+    set_trajectory(deg_to_rad(pos), deg_to_rad(vel), deg_to_rad(acc));
 }
 
 void Servo::set_velocity(float vel) {
     target_velocity = vel;
 }
 
+void Servo::set_current(float amps) {
+    target_command = amps;
+}
+
+void Servo::set_cascade_enabled(bool enable) {
+    if (enable == is_cascade) {
+        return;
+    }
+
+    is_cascade = enable;
+    vel_pid.reset();
+    if (!enable) {
+        set_current_loop_enabled(false);
+        driver->set_pwm(0);
+    }
+}
+
+bool Servo::is_cascade_enabled() const {
+    return is_cascade;
+}
+
+void Servo::set_vel_pid_params(PID::Params const &params) {
+    vel_pid.set_params(params);
+}
+
+void Servo::set_pos_pid_params(PID::Params const &params) {
+    pos_pid.set_params(params);
+}
+
+void Servo::set_cur_pid_params(PID::Params const &params) {
+    // The ADC interrupt runs the current loop, keep it off the gains while they are folded in
+    bool was_enabled = is_current_loop_enabled;
+    set_current_loop_enabled(false);
+    cur_pid.set_params(params);
+    set_current_loop_enabled(was_enabled);
+}
+
+PID::Params const &Servo::get_vel_pid_params() const {
+    return vel_pid.get_params();
+}
+
+PID::Params const &Servo::get_pos_pid_params() const {
+    return pos_pid.get_params();
+}
+
+float Servo::get_unfiltered_position() {
+    return to_rad_at_output(last_pos);
+}
+
+float Servo::get_unfiltered_velocity() const {
+    return velocity_estimator.get();
+}
+
 void Servo::init() {
     encoder->reset();
+    set_current_loop_enabled(false);
     driver->set_pwm(0);
+
+    float pwm_hz = driver->get_pwm_frequency_hz();
+    cur_pid.set_period(1 / pwm_hz);
+    current_filter = OnePoleLowPass(CURRENT_FILTER_HZ, pwm_hz);
+    driver->set_sample_callback(on_current_sample, this);
+
     zero();
     reset();
 }
@@ -44,11 +133,16 @@ void Servo::init() {
 void Servo::zero() {
     last_pos = 0;
     position = 0;
+    position_filter.reset(0);
+    velocity = 0;
+    velocity_filter.reset(0);
+    velocity_estimator.reset(0, micros());
     encoder->reset();
     reset();
 }
 
 void Servo::reset() {
+    set_current_loop_enabled(false);
     vel_pid.reset();
     pos_pid.reset();
 
@@ -62,11 +156,11 @@ void Servo::reset() {
 }
 
 float Servo::to_rad_at_output(float x) {
-    return 2 * M_PI * x / (config.counts_per_rev) / config.gear_reduction;
+    return 2 * (float)M_PI * x / (config.counts_per_rev) / config.gear_reduction;
 }
 
 bool Servo::test_no_encoder_fault(int32_t counts) {
-    if (counts == 0 && fabsf(command) > .5) {
+    if (counts == 0 && fabsf(command) > .5f) {
         if (++no_encoder_counts > 500) {
             faults.no_encoder = true;
             return true;
@@ -78,7 +172,7 @@ bool Servo::test_no_encoder_fault(int32_t counts) {
 }
 
 bool Servo::test_wrong_direction() {
-    if (signof(velocity) != signof(target_velocity) && (fabsf(target_velocity - velocity) > 1.4)) {
+    if (signof(velocity) != signof(target_velocity) && (fabsf(target_velocity - velocity) > 1.4f)) {
         if (++wrong_dir_counts > 1000) {
             faults.wrong_dir = true;
             return true;
@@ -90,7 +184,7 @@ bool Servo::test_wrong_direction() {
 }
 
 bool Servo::test_excessive_pos_error() {
-    if (mode == Mode::POSITION && fabsf(target_pos - position) > (M_PI_2)) {
+    if (mode == Mode::POSITION && fabsf(target_pos - position) > (float)M_PI_2) {
         faults.excessive_pos_error = true;
         return true;
     }
@@ -98,19 +192,24 @@ bool Servo::test_excessive_pos_error() {
 }
 
 void Servo::update() {
-    int16_t next_pos = encoder->get();
-    int16_t counts = next_pos - last_pos;
+    int32_t next_pos = encoder->get();
+    int32_t counts = next_pos - last_pos;
 
-    // TODO: replace with a tested filter library
-    position = .9* position + .1 * to_rad_at_output(next_pos);
-    velocity = .98 * velocity + .02 * to_rad_at_output(counts) / (period_ms / 1000.0f);  // rad / s <--- Filter this
-    i_measured = .99 * i_measured + .01 * driver->get_current();
+    position = position_filter.update(to_rad_at_output(next_pos));
+    Encoder::Edge edge = encoder->get_last_edge();
+    velocity = velocity_filter.update(velocity_estimator.update(edge.count, edge.time_us, micros()));  // rad / s
+
+    // Every current sample since the last update, each filtered once at the rate it was taken
+    ISensor::Sample current;
+    while (driver->read_sample(&current)) {
+        i_measured = current_filter.update(current.value);
+    }
 
     test_no_encoder_fault(counts);
     test_wrong_direction();
     // test_excessive_pos_error();
 
-    if (fabsf(i_measured) >= 5.0) {
+    if (fabsf(i_measured) >= 5.0f) {
         if (++over_current_fault_counter > 200) {
             faults.overcurrent = true;
             over_current_fault_counter = 0;
@@ -121,27 +220,56 @@ void Servo::update() {
 
     if (faults.no_encoder || faults.wrong_dir || faults.overcurrent || faults.excessive_pos_error) {
         command = 0;
+        set_current_loop_enabled(false);
         driver->set_pwm(0);
     } else {
         if (mode == Mode::POSITION) {
-            commanded_pos = commanded_pos*.1 + target_pos *.9;
+            if (is_following_trajectory) {
+                // The planner's profile is already smooth, filtering it again only adds lag. Carry on along it for
+                // the time since the planner's last point instead, however far apart the updates come.
+                uint64_t since_us = time_since_us(trajectory_us);
+                commanded_pos = trajectory_pos + ff_velocity * (fminf(since_us, TRAJECTORY_HOLD_US) * 1e-6f);
+                if (since_us > TRAJECTORY_HOLD_US) {
+                    // Stopped there, the feed-forward would only push the arm on past it
+                    trajectory_pos = commanded_pos;
+                    ff_velocity = 0;
+                    ff_accel = 0;
+                }
+                commanded_pos_filter.reset(commanded_pos);
+            } else {
+                commanded_pos = commanded_pos_filter.update(target_pos);
+            }
             commanded_pos = pos_limits.saturate(commanded_pos);
 
-            set_velocity(pos_pid.update(commanded_pos, position));
+            set_velocity(pos_pid.update(commanded_pos, position, ff_velocity));
         }
 
         if (mode == Mode::VELOCITY || mode == Mode::POSITION) {
-            commanded_velocity = commanded_velocity*.1 + target_velocity *.9;
+            if (mode == Mode::POSITION && is_following_trajectory) {
+                commanded_velocity = target_velocity;
+                commanded_vel_filter.reset(commanded_velocity);
+            } else {
+                commanded_velocity = commanded_vel_filter.update(target_velocity);
+            }
             commanded_velocity = vel_limits.saturate(commanded_velocity);
-            command = vel_pid.update(commanded_velocity, velocity);
+            // The velocity loop's output limits are the current limit, or the duty without the cascade
+            command = vel_pid.update(commanded_velocity, velocity, ff_velocity, ff_accel);
+        } else if (mode == Mode::CURRENT) {
+            command = is_cascade ? vel_pid.get_params().output_limits.saturate(target_command) : 0;
+        }
 
+        if (mode != Mode::OFF) {
             // If the limit switch is depressed don't command any more movement into it. Allow movement away.
             if (limit_switch_pressed() && command < 0) {
                 command = 0;
             }
 
-
-            driver->set_pwm(command);
+            if (is_cascade) {
+                target_current = command;
+                set_current_loop_enabled(true);
+            } else {
+                driver->set_pwm(command);
+            }
         }
     }
 
@@ -150,6 +278,49 @@ void Servo::update() {
 
 bool Servo::limit_switch_pressed() { return !limit_switch->read(); }
 
+void Servo::update_current() {
+    // Runs at the PWM rate, fast enough to timestamp each encoder edge for the velocity estimate
+    encoder->capture_edge(micros());
+
+    // The sense output is unsigned, get_current() signs it by the direction currently driven
+    i_sample = driver->get_current();
+
+    if (is_current_loop_enabled) {
+        driver->set_pwm(cur_pid.update(target_current, i_sample));
+    }
+}
+
+void Servo::on_current_sample(void *arg) {
+    ((Servo *)arg)->update_current();
+}
+
+void Servo::set_current_loop_enabled(bool enable) {
+    if (enable == is_current_loop_enabled) {
+        return;
+    }
+
+    // Disabling first means the interrupt won't touch the PWM again once we return. Enabling starts the integrator
+    // from zero.
+    is_current_loop_enabled = false;
+    if (enable) {
+        cur_pid.reset();
+        is_current_loop_enabled = true;
+    }
+}
+
 void Servo::set_mode(Mode m) {
     mode = m;
+
+    if (mode == Mode::OFF) {
+        command = 0;
+        set_current_loop_enabled(false);
+        driver->set_pwm(0);
+    }
+
+    // Feed-forward only makes sense along a trajectory
+    if (mode != Mode::POSITION) {
+        is_following_trajectory = false;
+        ff_velocity = 0;
+        ff_accel = 0;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,260 @@
+#include "system_id_controller.h"
+
+#include <math.h>
+
+#include "clock.h"
+#include "math/dsp.h"
+#include "math/least_squares.h"
+
+static int16_t to_fixed(float x, float scale) {
+    return (int16_t)saturate(roundf(x * scale), -32767, 32767);
+}
+
+SystemIdController::SystemIdController(Servo *motor, DRV8873 *driver, ISensor *pressure_sensor, Parameters params)
+    : motor(motor),
+      driver(driver),
+      pressure_sensor(pressure_sensor),
+      params(params),
+      state(State::IDLE),
+      num_samples(0),
+      model({}) {}
+
+void SystemIdController::start(float contact_pos) {
+    bag_contact_pos = contact_pos;
+    num_samples = 0;
+    last_sample_ms = millis();
+    prbs = PRBS_SEED;
+    chirp_phase = 0;
+    model = {};
+
+    state = State::CAPTURE;
+    motor->set_mode(Servo::Mode::OFF);
+}
+
+bool SystemIdController::is_running() {
+    return state == State::CAPTURE;
+}
+
+bool SystemIdController::is_done() {
+    return state == State::DONE;
+}
+
+bool SystemIdController::is_failed() {
+    return state == State::FAILED;
+}
+
+SystemIdController::State SystemIdController::update() {
+    if (state != State::CAPTURE) {
+        return state;
+    }
+
+    if (motor->faults.to_int() || !params.travel.in(motor->position)) {
+        finish(State::FAILED);
+        return state;
+    }
+
+    uint32_t now = millis();
+    if (now - last_sample_ms < params.sample_period_ms) {
+        return state;
+    }
+    last_sample_ms += params.sample_period_ms;
+
+    // Triangle from sweep.min to sweep.max and back
+    float progress = (float)num_samples / NUM_SAMPLES;
+    float target = params.sweep.min + (params.sweep.max - params.sweep.min) * (1 - fabsf(2 * progress - 1));
+
+    float position = motor->get_unfiltered_position();
+    float duty = saturate(params.amplitude * excitation(num_samples) + params.hold_gain * (target - position), -1, 1);
+
+    samples[num_samples] = {.duty = to_fixed(duty, 32767),
+                            .position = to_fixed(position, 10000),
+                            .velocity = to_fixed(motor->get_unfiltered_velocity(), 1000),
+                            .current = to_fixed(motor->i_sample, 1000),
+                            .pressure = to_fixed(pressure_sensor->read(), 100)};
+    driver->set_pwm(duty);
+
+    if (++num_samples == NUM_SAMPLES) {
+        bool is_fit = fit(samples, num_samples, params.sample_period_ms / 1000.f, bag_contact_pos, &model);
+        finish(is_fit ? State::DONE : State::FAILED);
+    }
+
+    return state;
+}
+
+float SystemIdController::excitation(size_t k) {
+    switch (params.excitation) {
+        case Excitation::PRBS: {
+            // 16 bit Galois LFSR, a new bit every prbs_bit_ms
+            uint32_t samples_per_bit = params.prbs_bit_ms / params.sample_period_ms;
+            if (samples_per_bit == 0 || k % samples_per_bit == 0) {
+                bool lsb = prbs & 1;
+                prbs >>= 1;
+                if (lsb) {
+                    prbs ^= 0xB400u;
+                }
+            }
+            return (prbs & 1) ? 1 : -1;
+        }
+        case Excitation::CHIRP: {
+            float f = params.chirp_start_hz + (params.chirp_end_hz - params.chirp_start_hz) * k / NUM_SAMPLES;
+            chirp_phase += f * params.sample_period_ms / 1000.f;
+            chirp_phase -= floorf(chirp_phase);
+            return sinf(2 * (float)M_PI * chirp_phase);
+        }
+    }
+    return 0;
+}
+
+void SystemIdController::finish(State s) {
+    driver->set_pwm(0);
+    state = s;
+
+    motor->set_mode(Servo::Mode::POSITION);
+    motor->set_pos(motor->position);
+}
+
+bool SystemIdController::fit(Sample const *s, size_t n, float sample_period_s, float contact_pos,
+                             PlantModelConfig *model) {
+    LeastSquares<4> arm;
+    LeastSquares<3> undamped_arm;  // The arm without one of its losses, for when the other takes all of them
+    LeastSquares<3> frictionless_arm;
+    LeastSquares<2> winding;
+    LeastSquares<3> bag;
+
+    float t = sample_period_s;
+    for (size_t k = 0; k < n; k++) {
+        float x = s[k].position / 10000.f - contact_pos;
+        float p = s[k].pressure / 100.f;
+
+        if (x >= 0) {
+            bag.add({1, x, x * x}, p);
+        }
+
+        if (k + 3 > n) {
+            continue;
+        }
+
+        // Mean velocities over sample periods k and k + 1 from the encoder counts. Unlike the M/T velocity estimate
+        // they have no lag, which skews the fit badly at this time scale. Their difference is the acceleration at
+        // sample k + 1.
+        float w0 = (s[k + 1].position - s[k].position) / 10000.f / t;
+        float w1 = (s[k + 2].position - s[k + 1].position) / 10000.f / t;
+        float w = (w0 + w1) / 2;
+        float accel = (w1 - w0) / t;
+
+        // The current settles well within a sample period of a duty change, so a sample's current is the one that
+        // drove the arm over the period before it
+        float duty = s[k].duty / 32767.f;
+        float i0 = s[k + 1].current / 1000.f;
+        float i1 = s[k + 2].current / 1000.f;
+        float p1 = s[k + 1].pressure / 100.f;
+
+        // The DRV8873's mirror only sees current in the direction driven, a current the back EMF turned around reads 0.
+        // Those samples don't show the winding or what drove the arm.
+        bool is_sensed = s[k + 1].current != 0 && s[k + 2].current != 0;
+        if (is_sensed) {
+            winding.add({duty, w}, i0);
+        }
+
+        // Standing still the friction is whatever holds the arm, not the sliding friction of the model
+        if (is_sensed && w0 != 0 && w1 != 0) {
+            float i = (i0 + i1) / 2;
+            arm.add({i, w, signof(w), p1}, accel);
+            undamped_arm.add({i, signof(w), p1}, accel);
+            frictionless_arm.add({i, w, p1}, accel);
+        }
+    }
+
+    float a[4];
+    float g[2];
+    float c[3];
+    if (bag.get_count() < MIN_BAG_SAMPLES || !arm.solve(a) || !winding.solve(g) || !bag.solve(c)) {
+        return false;
+    }
+
+    PlantModelConfig m = {};
+    m.accel_per_amp = a[0];
+    m.damping = -a[1];
+    m.friction = -a[2];
+    m.load_per_pressure = -a[3];
+
+    // Where the arm hardly leaves one speed the damping and friction trade off against each other, and the fit can
+    // give one of them a negative share. Neither can be negative, fit the other alone.
+    float b[3];
+    if (m.damping < 0) {
+        if (!undamped_arm.solve(b)) {
+            return false;
+        }
+        m.accel_per_amp = b[0];
+        m.damping = 0;
+        m.friction = -b[1];
+        m.load_per_pressure = -b[2];
+    } else if (m.friction < 0) {
+        if (!frictionless_arm.solve(b)) {
+            return false;
+        }
+        m.accel_per_amp = b[0];
+        m.damping = -b[1];
+        m.friction = 0;
+        m.load_per_pressure = -b[2];
+    }
+
+    // A model that speeds the arm up as it goes, or has the current push it backwards, is no model of it
+    if (!(m.accel_per_amp > 0) || m.damping < 0 || m.friction < 0) {
+        return false;
+    }
+
+    m.current_per_duty = g[0];
+    m.current_per_velocity = -g[1];
+    m.bag_contact_pos = contact_pos;
+    for (size_t k = 0; k < 3; k++) {
+        m.bag_pressure_coeffs[k] = c[k];
+    }
+    *model = m;
+    return true;
+}
+
+SystemIdController::State SystemIdController::get_state() const {
+    return state;
+}
+
+PlantModelConfig const &SystemIdController::get_model() const {
+    return model;
+}
+
+SystemIdController::Sample const *SystemIdController::get_samples() const {
+    return samples;
+}
+
+size_t SystemIdController::get_num_samples() const {
+    return num_samples;
+}
+
+SystemIdCaptureRPC::SystemIdCaptureRPC(uint8_t id, SystemIdController *sysid)
+    : CommEndpoint(id, (void *const)NULL, sizeof(Chunk), false), sysid(sysid), index(0) {}
+
+uint8_t SystemIdCaptureRPC::write(void *data, size_t size) {
+    if (size != sizeof(uint16_t)) {
+        return (uint8_t)CommError::ERROR_SIZE;
+    }
+
+    index = *(uint16_t *)data;
+    return (uint8_t)CommError::ERROR_NONE;
+}
+
+uint8_t SystemIdCaptureRPC::read(void *data, size_t size) {
+    if (size != sizeof(Chunk)) {
+        return (uint8_t)CommError::ERROR_SIZE;
+    }
+
+    Chunk *chunk = (Chunk *)data;
+    size_t n = sysid->get_num_samples();
+    chunk->index = index;
+    chunk->num_samples = n;
+    chunk->state = (uint8_t)sysid->get_state();
+    for (size_t i = 0; i < SAMPLES_PER_CHUNK; i++) {
+        size_t k = index + i;
+        chunk->samples[i] = k < n ? sysid->get_samples()[k] : SystemIdController::Sample{};
+    }
+    return (uint8_t)CommError::ERROR_NONE;
+}
@@ -22,6 +22,7 @@
 
 /* USER CODE BEGIN 0 */
 
+// Microseconds up to the start of TIM3's current period. TIM3 free-runs at 1 MHz and only interrupts when it wraps.
 volatile uint64_t microseconds;
 
 /* USER CODE END 0 */
@@ -93,14 +94,18 @@ void MX_TIM2_Init(void)
 
   htim2.Instance = TIM2;
   htim2.Init.Prescaler = 0;
-  htim2.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim2.Init.Period = 3600;
+  htim2.Init.CounterMode = TIM_COUNTERMODE_CENTERALIGNED3;
+  htim2.Init.Period = 1800;
   htim2.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim2.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
   if (HAL_TIM_PWM_Init(&htim2) != HAL_OK)
   {
     Error_Handler();
   }
+  if (HAL_TIM_OC_Init(&htim2) != HAL_OK)
+  {
+    Error_Handler();
+  }
   sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
   if (HAL_TIMEx_MasterConfigSynchronization(&htim2, &sMasterConfig) != HAL_OK)
@@ -119,6 +124,12 @@ void MX_TIM2_Init(void)
   {
     Error_Handler();
   }
+  sConfigOC.OCMode = TIM_OCMODE_TIMING;
+  sConfigOC.Pulse = 1800;
+  if (HAL_TIM_OC_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_2) != HAL_OK)
+  {
+    Error_Handler();
+  }
   HAL_TIM_MspPostInit(&htim2);
 
 }
@@ -131,7 +142,7 @@ void MX_TIM3_Init(void)
   htim3.Instance = TIM3;
   htim3.Init.Prescaler = 71;
   htim3.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim3.Init.Period = 10;
+  htim3.Init.Period = 65535;
   htim3.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim3.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
   if (HAL_TIM_Base_Init(&htim3) != HAL_OK)
@@ -385,17 +396,33 @@ void HAL_TIM_Encoder_MspDeInit(TIM_HandleTypeDef* tim_encoderHandle)
 /* USER CODE BEGIN 1 */
 
 uint64_t TIM_GetMicros() {
-  return microseconds + __HAL_TIM_GET_COUNTER(&htim3);
+  uint64_t base;
+  uint32_t count;
+
+  // The 64 bit read can tear and the counter can wrap between reading it and the base. Retry until the interrupt
+  // didn't run part way through.
+  do {
+    base = microseconds;
+    count = __HAL_TIM_GET_COUNTER(&htim3);
+
+    // Wrapped but the interrupt hasn't run yet, e.g. when called with interrupts masked. Read the counter again, it
+    // may have been read before the wrap.
+    if (__HAL_TIM_GET_FLAG(&htim3, TIM_FLAG_UPDATE)) {
+      count = __HAL_TIM_GET_COUNTER(&htim3) + htim3.Init.Period + 1;
+    }
+  } while (base != microseconds);
+
+  return base + count;
 }
 
 void TIM_DelayMicros(uint32_t micros) {
-  uint64_t start_us = microseconds;
-  while (microseconds < start_us + micros);
+  uint64_t start_us = TIM_GetMicros();
+  while (TIM_GetMicros() - start_us < micros);
 }
 
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim) {
   if (htim->Instance == TIM3) {
-    microseconds += __HAL_TIM_GET_COUNTER(&htim3);
+    microseconds += htim3.Init.Period + 1;
   }
 }
 
@@ -343,6 +343,13 @@ void UI_V1::set_alarm(Alarms const &a) {
                     controls->set_status_led(ControlPanel::STATUS_LED_3, true);
                     set_audio_alert(AudioAlert::ALERT_CONTINUOUS_CRESCENDO);
 
+                    break;
+                case Alarms::SENSOR_FAULT:
+                    // Without the pressure nothing guards against over pressure
+                    controls->set_status_led(ControlPanel::STATUS_LED_3, true);
+                    controls->set_status_led_blink(ControlPanel::STATUS_LED_3, 125);
+                    set_audio_alert(AudioAlert::ALERT_BEEPING);
+
                     break;
                 default:
                     break;
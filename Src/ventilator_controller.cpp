@@ -1,9 +1,13 @@
 #include "ventilator_controller.h"
 
-VentilatorController::VentilatorController(IMotionPlanner *motion, Servo *motor, ISensor *pressure_sensor, float tv_settings[], uint32_t num_tv_settings, float bpm_settings[], uint32_t num_bpm_settings)
+#include "clock.h"
+
+VentilatorController::VentilatorController(IMotionPlanner *motion, Servo *motor, ISensor *pressure_sensor, float tv_settings[], uint32_t num_tv_settings, float bpm_settings[], uint32_t num_bpm_settings,
+                                           IterativeLearningControl *ilc, PressureAutoZero *auto_zero)
     : motion(motion),
       motor(motor),
       state(State::GO_TO_IDLE),
+      next_state(State::GO_TO_IDLE),
       is_measure_plateau_cycle(true),
       is_operational(false),
       next_rate_idx(0),
@@ -13,117 +17,316 @@ VentilatorController::VentilatorController(IMotionPlanner *motion, Servo *motor,
       rate_settings(bpm_settings),
       num_rate_settings(num_bpm_settings),
       peak_pressure_limit_cmH2O(kVentRespirationConfig.default_peak_pressure_limit),
-      pressure_sensor(pressure_sensor) {}
+      pressure_sensor(pressure_sensor),
+      breath_settings{},
+      is_breath_pending(false),
+      ilc(ilc),
+      breath_start_ms(0),
+      auto_zero(auto_zero) {}
 
 void VentilatorController::start() {
     motor->set_pos_deg(0);
     motor->set_mode(Servo::Mode::POSITION);
     state = State::GO_TO_IDLE;
+    next_state = State::IDLE;
+
+    // Nothing is running yet, so the first breath can use the current settings straight away
+    update_breath_plan();
+    breath = pending_breath;
+    is_breath_pending = false;
+
+    // The bag and settings may have changed while stopped
+    if (ilc) {
+        ilc->reset();
+    }
 
-    motion->set_next({kVentMotionConfig.idle_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms});
-    motor->set_pos_deg(motion->run(motor->position));
+    motion->force_next(
+          {kVentMotionConfig.idle_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms, (uint32_t)State::GO_TO_IDLE});
+    run_motion(motor->position);
     is_operational = true;
 }
 
 void VentilatorController::stop() {
+    float pos = is_pressure_controlled ? pressure_pos_deg : motion->get_pos();
+    is_pressure_controlled = false;
+
     state = State::GO_TO_IDLE;
-    motion->force_next({kVentMotionConfig.idle_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms});
-    motor->set_pos_deg(motion->run(motion->get_pos()));
+    next_state = State::GO_TO_IDLE;
+    motion->force_next(
+          {kVentMotionConfig.idle_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms, (uint32_t)State::GO_TO_IDLE});
+    run_motion(pos);
     current_peak_pressure_cmH2O = 0;
     last_peak_pressure_cmH2O = 0;
     is_operational = false;
 }
 
 float VentilatorController::update() {
-    // Filter the pressure sensor data
-    pressure_cmH2O = .5 * pressure_cmH2O + .5 * pressure_sensor->read();
+    uint64_t now_us = micros();
+    float pressure = pressure_sensor->read();
+    if (is_update_timed) {
+        update_dt = saturate((now_us - last_update_us) * 1e-6f, MIN_UPDATE_S, MAX_UPDATE_S);
+        pressure_cmH2O += (update_dt / (PRESSURE_FILTER_TAU_S + update_dt)) * (pressure - pressure_cmH2O);
+    } else {
+        pressure_cmH2O = pressure;
+        is_update_timed = true;
+    }
+    last_update_us = now_us;
 
     if (pressure_cmH2O > current_peak_pressure_cmH2O) {
         current_peak_pressure_cmH2O = pressure_cmH2O;
     }
 
-    if (is_measure_plateau_cycle && (state == State::EXPIRATION)) {
+    if (is_measure_plateau_cycle && (state == State::INSPIRATORY_HOLD)) {
         current_plateau_pressure = min(pressure_cmH2O, current_plateau_pressure);
     }
 
-    if (pressure_cmH2O >= peak_pressure_limit_cmH2O && state != State::INSPIRATION) {
-        state = State::EXPIRATION;
-        motion->force_next({kVentMotionConfig.open_pos_deg, 0, kVentRespirationConfig.fast_open_time_ms});
-        motor->set_pos_deg(motion->run(motion->get_pos()));
-        is_fast_open = true;
+    // Keep up with the expiration once it has levelled off, the last value is where it ended
+    if (state == State::EXPIRATION && time_since_ms(expiration_start_ms) >= TRIGGER_LOCKOUT_MS && is_slope_valid &&
+        settle_slope >= -TRIGGER_SETTLED_SLOPE) {
+        end_expiration_cmH2O = pressure_cmH2O;
+        is_expiration_settled = true;
+    }
+
+    // Nothing to do if the bag is already opening
+    bool is_opening = state == State::EXPIRATION || state == State::GO_TO_START;
+
+    if (pressure_cmH2O >= peak_pressure_limit_cmH2O && !is_opening) {
+        fast_open();
+    } else if ((fabsf(motor->i_measured) >= 4.5f) && !is_opening) {
+        fast_open();
     }
 
-    if ((fabsf(motor->i_measured) >= 4.5) && state != State::INSPIRATION) {
-        state = State::EXPIRATION;
-        motion->force_next({kVentMotionConfig.open_pos_deg, 0, kVentRespirationConfig.fast_open_time_ms});
-        motor->set_pos_deg(motion->run(motion->get_pos()));
-        is_fast_open = true;
+    if (!is_operational && next_state != State::IDLE) {
+        next_state = State::GO_TO_IDLE;
     }
 
-    if (!is_operational && state != State::IDLE) {
-        state = State::GO_TO_IDLE;
+    update_breath_plan();
+
+    // Queue a breath at a time. The planner runs the segments back to back, so this only has work to do once the last
+    // segment of the breath has started.
+    if (motion->get_num_queued() == 0) {
+        plan_ahead();
     }
 
-    if (motion->is_idle()) {
-        switch (state) {
+    run_motion(motion->get_pos());
+
+    State running = motion->is_idle() ? State::IDLE : (State)motion->get_tag();
+    if (running != state) {
+        state = running;
+        on_segment_start(state);
+    }
+
+    return 0;
+}
+
+void VentilatorController::on_pressure_sample(ISensor::Sample const &sample) {
+    float pressure = sample.value;
+    int64_t step_us = (int64_t)(sample.time_us - last_sample_us);
+    float dt = step_us * 1e-6f;
+    last_sample_us = sample.time_us;
+
+    // The slopes run all the time so they have settled by the time the window opens. A step out of the converter's
+    // range would make one up, e.g. a clock that went back a little leaves two samples microseconds apart. Start over
+    // from this sample and don't trigger on them until they have run in step for a while.
+    if (step_us < (int64_t)SAMPLE_MIN_STEP_US || step_us > (int64_t)SAMPLE_MAX_STEP_US) {
+        trigger_slope = 0;
+        settle_slope = 0;
+        slope_start_us = sample.time_us;
+        dt = 0;
+    } else {
+        float slope = (pressure - last_sample_cmH2O) / dt;
+        trigger_slope += (dt / (TRIGGER_SLOPE_TAU_S + dt)) * (slope - trigger_slope);
+        settle_slope += (dt / (SETTLE_SLOPE_TAU_S + dt)) * (slope - settle_slope);
+    }
+    last_sample_cmH2O = pressure;
+    is_slope_valid = sample.time_us - slope_start_us >= SLOPE_SETTLE_US;
+
+    bool is_enabled =
+          kVentRespirationConfig.trigger_pressure_drop_cmH2O > 0 || kVentRespirationConfig.trigger_pressure_slope > 0;
+    bool is_window_open = is_operational && is_slope_valid && state == State::EXPIRATION &&
+                          time_since_ms(expiration_start_ms) >= TRIGGER_LOCKOUT_MS;
+
+    if (!is_enabled || !is_window_open) {
+        is_trigger_armed = false;
+        return;
+    }
+
+    if (!is_trigger_armed) {
+        // The exhalation's falling pressure looks just like an effort, wait for it to level off
+        if (settle_slope < -TRIGGER_SETTLED_SLOPE) {
+            return;
+        }
+        is_trigger_armed = true;
+        trigger_baseline_cmH2O = pressure;
+    }
+
+    if (is_triggered(pressure, dt)) {
+        trigger_breath();
+    }
+}
+
+bool VentilatorController::is_triggered(float pressure, float dt) {
+    float drop = kVentRespirationConfig.trigger_pressure_drop_cmH2O;
+    float slope = kVentRespirationConfig.trigger_pressure_slope;
+    if ((drop > 0 && trigger_baseline_cmH2O - pressure >= drop) || (slope > 0 && trigger_slope <= -slope)) {
+        return true;
+    }
+
+    // Slow enough that an effort stands out against it, drift in the end expiratory pressure doesn't build up into one
+    trigger_baseline_cmH2O += (dt / (TRIGGER_BASELINE_TAU_S + dt)) * (pressure - trigger_baseline_cmH2O);
+    return false;
+}
+
+void VentilatorController::trigger_breath() {
+    // Drop the rest of the expiration and plan the next breath from where the arm is now
+    float pos = motion->get_pos();
+    motion->reset();
+    is_fast_open = false;
+    is_trigger_armed = false;
+    next_state = State::INSPIRATION;
+    plan_ahead();
+    run_motion(pos);
+
+    // The cut short cycle would teach the wrong correction, and the effort already pulled the pressure down
+    if (ilc) {
+        ilc->discard_cycle();
+    }
+    is_expiration_settled = false;
+
+    state = State::INSPIRATION;
+    on_segment_start(state);
+    num_triggered_breaths++;
+}
+
+void VentilatorController::fast_open() {
+    // The pressure loop may have stopped the arm short of where the planner has it
+    float pos = is_pressure_controlled ? pressure_pos_deg : motion->get_pos();
+    is_pressure_controlled = false;
+
+    state = State::EXPIRATION;
+    next_state = State::EXPIRATION;
+    motion->force_next(
+          {kVentMotionConfig.open_pos_deg, 0, kVentRespirationConfig.fast_open_time_ms, (uint32_t)State::EXPIRATION});
+    run_motion(pos);
+    is_fast_open = true;
+    expiration_start_ms = millis();
+
+    // The breath was cut short, its errors would teach the wrong correction
+    if (ilc) {
+        ilc->discard_cycle();
+    }
+}
+
+void VentilatorController::plan_ahead() {
+    while (true) {
+        State resume = next_state;
+        State planning = next_state;
+        MotionPlan plan;
+
+        switch (planning) {
             case State::IDLE:
-                if (is_operational) {
-                    state = State::GO_TO_START;
-                    motion->set_next({kVentMotionConfig.open_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms});
+                if (!is_operational) {
+                    return;
                 }
+                // Move to open, then wait there for a beat before the first breath
+                planning = State::GO_TO_START;
+                next_state = State::GO_TO_START;
+                plan = {kVentMotionConfig.open_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms};
                 break;
             case State::GO_TO_START:
-                state = State::INSPIRATION;
-                motion->set_next({kVentMotionConfig.open_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms});
+                next_state = State::INSPIRATION;
+                plan = {kVentMotionConfig.open_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms};
                 break;
             case State::INSPIRATION:
-                last_plateau_pressure = current_plateau_pressure;
-                last_peak_pressure_cmH2O = current_peak_pressure_cmH2O;
-                current_peak_pressure_cmH2O = 0;
-
-                current_rate_idx = next_rate_idx;
-                current_tv_idx = next_tv_idx;
-                if (is_measure_plateau_cycle) {
-                    current_plateau_pressure = INFINITY;
-
-                    state = State::INSPIRATORY_HOLD;
-                } else {
-                    state = State::EXPIRATION;
+                // Breath boundary, new settings take effect here all at once and never part way through a breath
+                if (is_breath_pending) {
+                    breath = pending_breath;
+                    is_breath_pending = false;
+                    // What was learned was for the old trajectory
+                    if (ilc) {
+                        ilc->reset();
+                    }
                 }
-
-                motion->set_next({tidal_volume_settings[current_tv_idx], 0, inspiration_time()});
+                next_state = is_measure_plateau_cycle ? State::INSPIRATORY_HOLD : State::EXPIRATION;
+                plan = breath.inspiration;
                 break;
             case State::INSPIRATORY_HOLD:
-                state = State::EXPIRATION;
-                motion->set_next({tidal_volume_settings[current_tv_idx], 0, kVentRespirationConfig.plateau_time_ms});
+                next_state = State::EXPIRATION;
+                plan = breath.hold;
                 break;
-            case State::EXPIRATION: {
-                state = State::INSPIRATION;
-                plateau_time = is_measure_plateau_cycle ? kVentRespirationConfig.plateau_time_ms : 0;
-                if (is_fast_open) {
-                    plateau_time = kVentRespirationConfig.fast_open_time_ms;
-                    is_fast_open = false;
-                }
-                motion->set_next({kVentMotionConfig.open_pos_deg, 0, expiration_time()});
+            case State::EXPIRATION:
+                next_state = State::INSPIRATION;
+                plan = is_fast_open ? breath.expiration_after_fast_open : breath.expiration;
+                is_fast_open = false;
                 break;
-            }
             case State::GO_TO_IDLE:
-                state = State::IDLE;
-                motion->set_next({kVentMotionConfig.idle_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms});
+                next_state = State::IDLE;
+                plan = {kVentMotionConfig.idle_pos_deg, 0, kVentRespirationConfig.time_to_idle_ms};
                 break;
             default:
-                break;
+                return;
+        }
+
+        plan.tag = (uint32_t)planning;
+        if (!motion->set_next(plan)) {
+            next_state = resume;
+            return;
+        }
+
+        // A breath ends with its expiration
+        if (planning == State::EXPIRATION || planning == State::GO_TO_IDLE) {
+            return;
         }
     }
+}
 
-    motor->set_pos_deg(motion->run(motion->get_pos()));
+void VentilatorController::on_segment_start(State s) {
+    bool was_expiration_settled = is_expiration_settled;
+    is_expiration_settled = false;
 
-    return 0;
+    if (s == State::INSPIRATION) {
+        if (auto_zero && was_expiration_settled) {
+            auto_zero->on_expiration_plateau(end_expiration_cmH2O);
+        }
+
+        last_plateau_pressure = current_plateau_pressure;
+        last_peak_pressure_cmH2O = current_peak_pressure_cmH2O;
+        current_peak_pressure_cmH2O = 0;
+
+        if (is_measure_plateau_cycle) {
+            current_plateau_pressure = INFINITY;
+        }
+
+        breath_start_ms = millis();
+        if (breath.mode == VentMode::PRESSURE) {
+            start_pressure_control();
+            // The arm doesn't follow the planner, there is nothing to learn
+            if (ilc) {
+                ilc->discard_cycle();
+            }
+        } else if (ilc) {
+            ilc->start_cycle(breath.period_ms);
+        }
+    } else if (s == State::EXPIRATION) {
+        expiration_start_ms = millis();
+    } else if (s == State::GO_TO_IDLE && ilc) {
+        ilc->discard_cycle();
+    }
+}
+
+bool VentilatorController::set_motion_planner(IMotionPlanner *planner) {
+    if (is_operational) {
+        return false;
+    }
+
+    motion = planner;
+    return true;
 }
 
 void VentilatorController::reset() {
     is_operational = false;
     state = State::GO_TO_IDLE;
+    next_state = State::GO_TO_IDLE;
     motor->reset();
 }
 
@@ -141,12 +344,108 @@ float VentilatorController::get_plateau_pressure_cmH2O() {
     }
 }
 
-float VentilatorController::inspiration_time() const {
-    return (1 / (kVentMotionConfig.expiration_part + 1)) * bpm_to_time_ms(rate_settings[current_rate_idx]);
+void VentilatorController::run_motion(float pos) {
+    float next_pos = motion->run(pos);
+
+    if (is_pressure_controlled) {
+        State running = motion->is_idle() ? State::IDLE : (State)motion->get_tag();
+        if (running == State::INSPIRATION || running == State::INSPIRATORY_HOLD) {
+            float last_pos = pressure_pos_deg;
+            float pressure_pos = run_pressure_control();
+            motor->set_trajectory_deg(pressure_pos, (pressure_pos - last_pos) / update_dt, 0);
+            return;
+        }
+
+        // Inspiration is over. The planner starts the expiration from the tidal volume position, start it from where
+        // the pressure loop left the arm instead.
+        is_pressure_controlled = false;
+        MotionPlan expiration = breath.expiration;
+        expiration.tag = (uint32_t)State::EXPIRATION;
+        motion->force_next(expiration);
+        next_pos = motion->run(pressure_pos_deg);
+    }
+
+    // Learn against the plain reference, the correction only goes to the servo
+    float correction = 0;
+    if (ilc) {
+        uint32_t t = time_since_ms(breath_start_ms);
+        ilc->record(t, next_pos - rad_to_deg(motor->position));
+        correction = ilc->get_correction(t);
+    }
+
+    motor->set_trajectory_deg(next_pos + correction, motion->get_vel(), motion->get_acc());
+}
+
+void VentilatorController::start_pressure_control() {
+    pressure_pid.set_params(kVentPressureConfig.pressure_pid_params);
+    pressure_pid.reset();
+
+    pressure_start_cmH2O = pressure_cmH2O;
+    pressure_pos_limits = {motion->get_pos(), breath.inspiration.p_target};
+    pressure_pos_deg = pressure_pos_limits.min;
+    is_pressure_controlled = true;
+}
+
+float VentilatorController::run_pressure_control() {
+    float t = time_since_ms(breath_start_ms);
+    float target = breath.target_pressure_cmH2O;
+    float target_rate = 0;  // cmH2O/s
+
+    if (t < breath.rise_time_ms) {
+        target_rate = (target - pressure_start_cmH2O) / breath.rise_time_ms * 1000;
+        target = pressure_start_cmH2O + target_rate * t / 1000;
+    }
+
+    // The loop sets the arm's velocity rather than its position. Holding a pressure takes a steady flow into the lungs
+    // while they fill, which the integrator supplies without a standing pressure error.
+    pressure_pid.set_period(update_dt);
+    float velocity = pressure_pid.update(target, pressure_cmH2O, target_rate);
+    pressure_pos_deg = pressure_pos_limits.saturate(pressure_pos_deg + velocity * update_dt);
+    return pressure_pos_deg;
+}
+
+void VentilatorController::update_breath_plan() {
+    BreathSettings settings = {
+          .tidal_volume_pos_deg = tidal_volume_settings[next_tv_idx],
+          .rate_bpm = rate_settings[next_rate_idx],
+          .expiration_part = kVentMotionConfig.expiration_part,
+          .open_pos_deg = kVentMotionConfig.open_pos_deg,
+          // Signed in the config for its layout, never negative
+          .plateau_time_ms = (uint32_t)kVentRespirationConfig.plateau_time_ms,
+          .fast_open_time_ms = (uint32_t)kVentRespirationConfig.fast_open_time_ms,
+          .is_measure_plateau_cycle = is_measure_plateau_cycle,
+          .mode = kVentPressureConfig.mode,
+          .target_pressure_cmH2O = kVentPressureConfig.target_pressure_cmH2O,
+          .rise_time_ms = kVentPressureConfig.rise_time_ms,
+    };
+
+    // Runs every update, the timing math below only runs when something changed
+    if (settings == breath_settings) {
+        return;
+    }
+    breath_settings = settings;
+
+    uint32_t plateau_time = settings.is_measure_plateau_cycle ? settings.plateau_time_ms : 0;
+
+    pending_breath = {
+          .inspiration = {settings.tidal_volume_pos_deg, 0, inspiration_time(settings)},
+          .hold = {settings.tidal_volume_pos_deg, 0, (float)settings.plateau_time_ms},
+          .expiration = {settings.open_pos_deg, 0, expiration_time(settings, plateau_time)},
+          .expiration_after_fast_open = {settings.open_pos_deg, 0,
+                                         expiration_time(settings, settings.fast_open_time_ms)},
+          .period_ms = bpm_to_time_ms(settings.rate_bpm),
+          .mode = settings.mode,
+          .target_pressure_cmH2O = settings.target_pressure_cmH2O,
+          .rise_time_ms = settings.rise_time_ms,
+    };
+    is_breath_pending = true;
+}
+
+float VentilatorController::inspiration_time(BreathSettings const &settings) {
+    return (1 / (settings.expiration_part + 1)) * bpm_to_time_ms(settings.rate_bpm);
 }
 
-float VentilatorController::expiration_time() const {
-    return ((kVentMotionConfig.expiration_part / (kVentMotionConfig.expiration_part + 1)) *
-            bpm_to_time_ms(rate_settings[current_rate_idx])) -
+float VentilatorController::expiration_time(BreathSettings const &settings, uint32_t plateau_time) {
+    return ((settings.expiration_part / (settings.expiration_part + 1)) * bpm_to_time_ms(settings.rate_bpm)) -
            plateau_time;
 }
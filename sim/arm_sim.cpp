@@ -0,0 +1,63 @@
+#include "arm_sim.h"
+
+constexpr ArmSim::Parameters ArmSim::kDefaults;
+
+ArmSim::ArmSim(Parameters params, float position)
+    : params(params), time_us(0), position(position), velocity(0), current(0), count(0), edge_us(0) {
+    count = (int32_t)floorf(position / params.rad_per_count);
+}
+
+void ArmSim::run(float current_cmd, uint32_t duration_us, float load) {
+    float dt = STEP_US * 1e-6f;
+    for (uint32_t t = 0; t < duration_us; t += STEP_US) {
+        step(current_cmd, dt, load);
+        time_us += STEP_US;
+
+        int32_t next_count = (int32_t)floorf(position / params.rad_per_count);
+        if (next_count != count) {
+            count = next_count;
+            edge_us = time_us;
+        }
+    }
+}
+
+void ArmSim::step(float current_cmd, float dt, float load) {
+    current += (current_cmd - current) * dt / params.current_tau_s;
+
+    float drive = params.accel_per_amp * current - load;
+    float friction;
+    if (fabsf(velocity) > 1e-4f) {
+        friction = velocity > 0 ? params.friction : -params.friction;
+    } else {
+        // Stuck until the drive overcomes it
+        friction = fabsf(drive) < params.friction ? drive : (drive > 0 ? params.friction : -params.friction);
+    }
+
+    float accel = drive - params.damping * velocity - friction;
+    velocity += accel * dt;
+    position += velocity * dt;
+}
+
+uint64_t ArmSim::now_us() const {
+    return time_us;
+}
+
+float ArmSim::get_position() const {
+    return position;
+}
+
+float ArmSim::get_velocity() const {
+    return velocity;
+}
+
+float ArmSim::get_current() const {
+    return current;
+}
+
+int32_t ArmSim::get_count() const {
+    return count;
+}
+
+uint64_t ArmSim::get_edge_us() const {
+    return edge_us;
+}
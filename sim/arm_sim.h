@@ -0,0 +1,67 @@
+#ifndef ARM_SIM_H
+#define ARM_SIM_H
+
+#include <math.h>
+#include <stdint.h>
+
+/**
+ * Host stand-in for the arm: the motor under its closed current loop, the gearbox and arm, and the encoder on the motor
+ * shaft. Not part of the firmware build, the native env builds it for the unit tests.
+ *
+ *   current loop   a first order lag of current_tau_s behind the commanded current
+ *   arm            dw/dt = accel_per_amp * i - damping * w - friction * sign(w) - load
+ *   encoder        whole counts of rad_per_count, each edge stamped with the PWM period it was seen in, like
+ *                  Servo::update_current() captures them
+ *
+ * The arm is the same model SystemIdController fits (PlantModelConfig), load is whatever the test pushes back with,
+ * e.g. the bag. Static friction holds the arm until the drive overcomes it.
+ */
+class ArmSim {
+public:
+    struct Parameters {
+        float accel_per_amp;  // rads/s^2 / A
+        float damping;        // 1/s
+        float friction;       // rads/s^2
+        float current_tau_s;
+        float rad_per_count;
+    };
+
+    // Close to the 188:1, 28 count per rev motor on the bench
+    static constexpr Parameters kDefaults = {.accel_per_amp = 6,
+                                             .damping = .5f,
+                                             .friction = .8f,
+                                             .current_tau_s = .002f,
+                                             .rad_per_count = 2 * (float)M_PI / 28 / 188};
+
+    static constexpr uint32_t STEP_US = 50;  // The 20 kHz PWM period
+
+    explicit ArmSim(Parameters params = kDefaults, float position = 0);
+
+    /**
+     * Hold current_cmd for duration_us, integrated in STEP_US steps. load is in rads/s^2 like the friction.
+     */
+    void run(float current_cmd, uint32_t duration_us, float load = 0);
+
+    uint64_t now_us() const;
+    float get_position() const;  // rads
+    float get_velocity() const;  // rads/s
+    float get_current() const;   // A
+
+    int32_t get_count() const;
+    uint64_t get_edge_us() const;  // When get_count() last changed
+
+private:
+    Parameters params;
+
+    uint64_t time_us;
+    float position;
+    float velocity;
+    float current;
+
+    int32_t count;
+    uint64_t edge_us;
+
+    void step(float current_cmd, float dt, float load);
+};
+
+#endif  // ARM_SIM_H
@@ -0,0 +1,111 @@
+/**
+ * DRV8873 on the host, in place of Src/drv8873.cpp. The duty goes to the bridge in drv8873_sim.h and the current sense
+ * reads it back from there. The register and pin control is left out, nothing on the host has a fault to clear.
+ */
+#include "drv8873_sim.h"
+
+#include <math.h>
+
+#include "clock.h"
+#include "math/dsp.h"
+
+static constexpr float PWM_HZ = 20000;
+
+static float bridge_duty = 0;
+static float sensed_amps = 0;
+
+float drv8873_sim_get_duty() {
+    return bridge_duty;
+}
+
+void drv8873_sim_set_current(float amps) {
+    sensed_amps = amps;
+}
+
+void drv8873_sim_reset() {
+    bridge_duty = 0;
+    sensed_amps = 0;
+}
+
+DRV8873::DRV8873(GPIO_TypeDef *sleep_port, uint16_t sleep_pin, GPIO_TypeDef *disable_port, uint16_t disable_pin,
+                 GPIO_TypeDef *fault_port, uint16_t fault_pin, TIM_HandleTypeDef *htim, uint32_t tim_channel_pwm1,
+                 uint32_t tim_channel_pwm2, SPI_HandleTypeDef *hspi, GPIO_TypeDef *cs_port, uint16_t cs_pin,
+                 bool is_inverted)
+    : is_inverted(is_inverted),
+      sleep_port(sleep_port),
+      sleep_pin(sleep_pin),
+      disable_port(disable_port),
+      disable_pin(disable_pin),
+      fault_port(fault_port),
+      fault_pin(fault_pin),
+      htim(htim),
+      tim_channel_pwm1(tim_channel_pwm1),
+      tim_channel_pwm2(tim_channel_pwm2),
+      hspi(hspi),
+      cs_port(cs_port),
+      cs_pin(cs_pin),
+      current_raw_sum(0),
+      sample_cb(nullptr),
+      sample_cb_arg(nullptr),
+      pwm_direction(false) {}
+
+void DRV8873::set_sample_callback(SampleCallback cb, void *arg) {
+    sample_cb_arg = arg;
+    sample_cb = cb;
+}
+
+float DRV8873::get_pwm_frequency_hz() const {
+    return PWM_HZ;
+}
+
+// The ADC's DMA interrupt, MotorSim runs it every PWM period
+void DRV8873::conversion_complete_isr(ADC_HandleTypeDef *hadc) {
+    (void)hadc;
+
+    uint64_t now = micros();
+    if (now <= last_sample_us) {
+        num_clock_faults++;
+    } else {
+        last_sample_us = now;
+        if (!samples.push({.time_us = now, .value = get_current(), .is_saturated = false, .is_held = false})) {
+            num_overruns++;
+        }
+    }
+
+    if (sample_cb) {
+        sample_cb(sample_cb_arg);
+    }
+}
+
+float DRV8873::get_current() {
+    // The sense output is unsigned, signed by the direction driven like the real one
+    // The mirror only sees current through the high side it is driving, a current back against the drive reads 0
+    float sign = get_sign_of_current();
+    return sign * fmaxf(sign * sensed_amps, 0);
+}
+
+float DRV8873::read() {
+    return get_current();
+}
+
+bool DRV8873::read_sample(Sample *sample) {
+    return samples.pop(sample);
+}
+
+uint32_t DRV8873::get_num_overruns() const {
+    return num_overruns;
+}
+
+uint32_t DRV8873::get_num_clock_faults() const {
+    return num_clock_faults;
+}
+
+void DRV8873::set_pwm(float value) {
+    value = saturate(value, -1, 1);
+    pwm_direction = (value < 0) ^ is_inverted;
+    bridge_duty = value;
+}
+
+float DRV8873::get_sign_of_current() const {
+    return (pwm_direction ^ is_inverted) ? -1 : 1;
+}
@@ -0,0 +1,20 @@
+#ifndef DRV8873_SIM_H
+#define DRV8873_SIM_H
+
+#include "drv8873.h"
+
+/**
+ * The H-bridge and current sense behind the host DRV8873. There is one on the board, so the bridge is kept here rather
+ * than in the driver. MotorSim drives the motor with it.
+ */
+
+// As the last set_pwm() left it, -1 to 1. In the servo's direction, is_inverted only swaps the outputs' wiring.
+float drv8873_sim_get_duty();
+
+// What the ADC reads on the next conversions, A
+void drv8873_sim_set_current(float amps);
+
+// Back to undriven with nothing sensed, for a fresh simulation
+void drv8873_sim_reset();
+
+#endif  // DRV8873_SIM_H
@@ -0,0 +1,341 @@
+#include "eeprom_sim.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint8_t erase_buf[EEPROMSim::PAGE_SIZE] = {0};
+
+EEPROMSim::EEPROMSim()
+    : fd(-1), mem(nullptr), allocator_offset(0), clock_us(0), blocked_us(0), transactions(0), write_counts{0} {
+    clear_faults();
+    set_seed(1);
+}
+
+EEPROMSim::~EEPROMSim() {
+    close();
+}
+
+bool EEPROMSim::open(const char *path) {
+    close();
+
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ftruncate(fd, TOTAL_SIZE) != 0) {
+        close();
+        return false;
+    }
+
+    void *map = mmap(nullptr, TOTAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close();
+        return false;
+    }
+    mem = (uint8_t *)map;
+
+    // ftruncate zero fills, a new part comes blank
+    if (st.st_size < TOTAL_SIZE) {
+        memset(&mem[st.st_size], 0xFF, TOTAL_SIZE - st.st_size);
+    }
+
+    return true;
+}
+
+void EEPROMSim::close() {
+    if (mem != nullptr) {
+        msync(mem, TOTAL_SIZE, MS_SYNC);
+        munmap(mem, TOTAL_SIZE);
+        mem = nullptr;
+    }
+
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool EEPROMSim::read(uint16_t addr, uint8_t *data, uint16_t len) {
+    if (is_busy()) return false;
+
+    uint64_t start_us = clock_us;
+    bool success = run_read(addr, data, len);
+    blocked_us += clock_us - start_us;
+    return success;
+}
+
+bool EEPROMSim::write(uint16_t addr, uint8_t *data, uint16_t len) {
+    if (is_busy()) return false;
+
+    uint64_t start_us = clock_us;
+    bool success = run_write(addr, data, len);
+    blocked_us += clock_us - start_us;
+    return success;
+}
+
+bool EEPROMSim::allocate(uint16_t size, uint16_t *addr) {
+    // Same page aligned bump allocator as the LC064 driver so addresses match the hardware
+    if ((allocator_offset + size) < TOTAL_SIZE) {
+        *addr = allocator_offset;
+        allocator_offset += size + (PAGE_SIZE - (size % PAGE_SIZE));
+        return true;
+    }
+
+    return false;
+}
+
+bool EEPROMSim::erase() {
+    if (is_busy()) return false;
+
+    uint64_t start_us = clock_us;
+    bool success = run_erase();
+    blocked_us += clock_us - start_us;
+    return success;
+}
+
+bool EEPROMSim::read_async(uint16_t addr, uint8_t *data, uint16_t len, Callback cb, void *arg) {
+    return enqueue({.is_write = false, .is_erase = false, .addr = addr, .data = data, .len = len, .cb = cb, .arg = arg});
+}
+
+bool EEPROMSim::write_async(uint16_t addr, uint8_t *data, uint16_t len, Callback cb, void *arg) {
+    return enqueue({.is_write = true, .is_erase = false, .addr = addr, .data = data, .len = len, .cb = cb, .arg = arg});
+}
+
+bool EEPROMSim::erase_async(Callback cb, void *arg) {
+    return enqueue(
+          {.is_write = true, .is_erase = true, .addr = 0, .data = erase_buf, .len = TOTAL_SIZE, .cb = cb, .arg = arg});
+}
+
+bool EEPROMSim::is_busy() {
+    return !queue.empty();
+}
+
+void EEPROMSim::update() {
+    if (queue.empty()) return;
+
+    // Pop first, the callback may queue the next transaction
+    Transaction t;
+    queue.pop(&t);
+
+    bool success;
+    if (t.is_erase) {
+        success = run_erase();
+    } else if (t.is_write) {
+        success = run_write(t.addr, t.data, t.len);
+    } else {
+        success = run_read(t.addr, t.data, t.len);
+    }
+
+    if (t.cb != nullptr) {
+        t.cb(success, t.arg);
+    }
+}
+
+bool EEPROMSim::device_write(uint16_t addr, uint8_t const *data, uint16_t len) {
+    assert(mem != nullptr);
+    assert(addr < TOTAL_SIZE);
+
+    if (!start_transaction(len)) return false;
+
+    // The address counter only increments within the page, anything past the end wraps to the start of it
+    uint16_t page_start = addr - (addr % PAGE_SIZE);
+    for (uint16_t i = 0; i < len; i++) {
+        program_byte(page_start + ((addr % PAGE_SIZE) + i) % PAGE_SIZE, data[i]);
+    }
+
+    write_counts[addr / PAGE_SIZE]++;
+    clock_us += WRITE_CYCLE_TIME_US;
+    return !is_power_lost;
+}
+
+void EEPROMSim::inject_nack(uint32_t after_transactions) {
+    nack_countdown = after_transactions;
+}
+
+void EEPROMSim::inject_bit_flip(uint16_t addr, uint8_t bit) {
+    assert(mem != nullptr);
+    assert(addr < TOTAL_SIZE);
+    mem[addr] ^= 1 << (bit % 8);
+}
+
+void EEPROMSim::inject_power_loss(uint32_t after_bytes) {
+    power_loss_countdown = after_bytes;
+}
+
+void EEPROMSim::set_read_bit_flip_rate(float probability) {
+    read_flip_rate = probability;
+}
+
+void EEPROMSim::set_seed(uint32_t seed) {
+    rng_state = seed != 0 ? seed : 1;
+}
+
+void EEPROMSim::clear_faults() {
+    nack_countdown = -1;
+    power_loss_countdown = -1;
+    is_power_lost = false;
+    read_flip_rate = 0;
+}
+
+bool EEPROMSim::is_powered() {
+    return !is_power_lost;
+}
+
+void EEPROMSim::power_cycle() {
+    // The driver state lives in the MCU's RAM, it goes with the reset
+    while (!queue.empty()) {
+        queue.free();
+    }
+    allocator_offset = 0;
+    is_power_lost = false;
+    power_loss_countdown = -1;
+}
+
+uint64_t EEPROMSim::now_us() {
+    return clock_us;
+}
+
+uint64_t EEPROMSim::blocking_us() {
+    return blocked_us;
+}
+
+uint32_t EEPROMSim::num_transactions() {
+    return transactions;
+}
+
+uint32_t EEPROMSim::page_writes(uint16_t page) {
+    assert(page < NUM_PAGES);
+    return write_counts[page];
+}
+
+uint32_t EEPROMSim::max_page_writes() {
+    uint32_t max_writes = 0;
+    for (uint16_t i = 0; i < NUM_PAGES; i++) {
+        if (write_counts[i] > max_writes) max_writes = write_counts[i];
+    }
+    return max_writes;
+}
+
+uint32_t EEPROMSim::total_page_writes() {
+    uint32_t total = 0;
+    for (uint16_t i = 0; i < NUM_PAGES; i++) {
+        total += write_counts[i];
+    }
+    return total;
+}
+
+void EEPROMSim::reset_counters() {
+    clock_us = 0;
+    blocked_us = 0;
+    transactions = 0;
+    memset(write_counts, 0, sizeof(write_counts));
+}
+
+bool EEPROMSim::run_read(uint16_t addr, uint8_t *data, uint16_t len) {
+    assert(mem != nullptr);
+    assert(addr + len <= TOTAL_SIZE);
+
+    if (!start_transaction(len)) return false;
+
+    memcpy(data, &mem[addr], len);
+
+    if (read_flip_rate > 0) {
+        for (uint16_t i = 0; i < len; i++) {
+            if ((next_random() & 0xFFFFFF) < read_flip_rate * 0x1000000) {
+                data[i] ^= 1 << (next_random() % 8);
+            }
+        }
+    }
+    return true;
+}
+
+bool EEPROMSim::run_write(uint16_t addr, uint8_t const *data, uint16_t len) {
+    assert(addr + len <= TOTAL_SIZE);
+
+    // Split on page boundaries like the LC064 driver
+    uint32_t bytes_written = 0;
+    do {
+        uint32_t max_bytes = PAGE_SIZE - ((addr + bytes_written) % PAGE_SIZE);
+        uint32_t bytes_to_write = len - bytes_written;
+        if (bytes_to_write > max_bytes) bytes_to_write = max_bytes;
+
+        if (!device_write(addr + bytes_written, &data[bytes_written], bytes_to_write)) {
+            return false;
+        }
+
+        bytes_written += bytes_to_write;
+    } while (bytes_written < len);
+
+    return true;
+}
+
+bool EEPROMSim::run_erase() {
+    uint8_t verify_buf[PAGE_SIZE];
+
+    // Same read back and skip as the LC064 driver, so wear and timing match
+    for (uint16_t addr = 0; addr < TOTAL_SIZE; addr += PAGE_SIZE) {
+        bool success = run_read(addr, verify_buf, PAGE_SIZE);
+        if (success && memcmp(verify_buf, erase_buf, PAGE_SIZE) == 0) continue;
+
+        if (!device_write(addr, erase_buf, PAGE_SIZE)) return false;
+    }
+    return true;
+}
+
+bool EEPROMSim::start_transaction(uint32_t bytes) {
+    if (is_power_lost) return false;
+
+    transactions++;
+
+    if (nack_countdown == 0) {
+        // The device address byte goes out and nothing acks it
+        nack_countdown = -1;
+        clock_us += transfer_time_us(0);
+        return false;
+    } else if (nack_countdown > 0) {
+        nack_countdown--;
+    }
+
+    clock_us += transfer_time_us(bytes);
+    return true;
+}
+
+void EEPROMSim::program_byte(uint16_t addr, uint8_t value) {
+    if (is_power_lost) return;
+
+    if (power_loss_countdown == 0) {
+        is_power_lost = true;
+        return;
+    } else if (power_loss_countdown > 0) {
+        power_loss_countdown--;
+    }
+
+    // Worn out cells start failing to hold a bit now and then
+    if (write_counts[addr / PAGE_SIZE] >= ENDURANCE_CYCLES && next_random() % 64 == 0) {
+        value ^= 1 << (next_random() % 8);
+    }
+
+    mem[addr] = value;
+}
+
+uint32_t EEPROMSim::transfer_time_us(uint32_t bytes) {
+    // Device address and two address bytes, 9 clocks a byte with the ack
+    return ((bytes + 3) * 9 * 1000000ULL) / BUS_FREQ_HZ;
+}
+
+uint32_t EEPROMSim::next_random() {
+    // xorshift32, repeatable runs for a given seed
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+bool EEPROMSim::enqueue(Transaction const &t) {
+    if (t.len == 0 || queue.full()) return false;
+    return queue.push(t);
+}
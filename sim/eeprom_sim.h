@@ -0,0 +1,128 @@
+#ifndef EEPROM_SIM_H
+#define EEPROM_SIM_H
+
+#include <stdint.h>
+
+#include "circular_buffer.h"
+#include "eeprom.h"
+
+/**
+ * Host (Linux) stand-in for the LC064, backed by an mmap'd file so the contents survive between runs like the real
+ * part does across power cycles. Not part of the firmware build, the native env builds it for the unit tests.
+ *
+ * Models the 24LC64:
+ *   - Page writes. A single device write that runs past the end of a 32 byte page wraps to the start of that page.
+ *     write() splits on page boundaries the same way the LC064 driver does.
+ *   - Timing. Each transaction advances a simulated clock by the I2C transfer time plus t_WC per page written.
+ *     Blocking calls also add to blocking_us(), the time the main loop would have been stuck on the bus.
+ *   - Endurance. Writes are counted per page. A page past its rated endurance occasionally fails to program a bit.
+ *   - Faults. NACKs, bit flips and power loss part way through a write can be injected.
+ */
+class EEPROMSim : public EEPROM<uint16_t, uint8_t> {
+public:
+    static constexpr uint16_t TOTAL_SIZE = 8192;  // bytes
+    static constexpr uint16_t PAGE_SIZE = 32;     // bytes
+    static constexpr uint16_t NUM_PAGES = TOTAL_SIZE / PAGE_SIZE;
+
+    static constexpr uint32_t BUS_FREQ_HZ = 400000;
+    static constexpr uint32_t WRITE_CYCLE_TIME_US = 5000;  // t_WC from the datasheet
+    static constexpr uint32_t ENDURANCE_CYCLES = 1000000;
+
+    EEPROMSim();
+    ~EEPROMSim();
+
+    /**
+     * Map path as the EEPROM contents. A new file is created blank (all 0xFF, like a new part).
+     */
+    bool open(const char *path);
+    void close();
+
+    bool read(uint16_t addr, uint8_t *data, uint16_t len) override;
+    bool write(uint16_t addr, uint8_t *data, uint16_t len) override;
+
+    bool allocate(uint16_t size, uint16_t *addr) override;
+
+    bool erase() override;
+
+    bool read_async(uint16_t addr, uint8_t *data, uint16_t len, Callback cb = nullptr, void *arg = nullptr) override;
+    bool write_async(uint16_t addr, uint8_t *data, uint16_t len, Callback cb = nullptr, void *arg = nullptr) override;
+    bool erase_async(Callback cb = nullptr, void *arg = nullptr) override;
+
+    bool is_busy() override;
+
+    /**
+     * Runs at most one queued transaction per call, like the real driver spreads them over main loop iterations.
+     */
+    void update() override;
+
+    /**
+     * A single device write transaction, with the page wrap of the real part.
+     */
+    bool device_write(uint16_t addr, uint8_t const *data, uint16_t len);
+
+    // Fault injection
+    void inject_nack(uint32_t after_transactions);  // The Nth transaction from now is NACKed, 0 for the next one
+    void inject_bit_flip(uint16_t addr, uint8_t bit);
+    void inject_power_loss(uint32_t after_bytes);  // Stop programming after this many more bytes are written
+    void set_read_bit_flip_rate(float probability);
+    void set_seed(uint32_t seed);
+    void clear_faults();
+
+    bool is_powered();
+    /**
+     * Reset the whole board, bringing the part back after an injected power loss. Queued transactions and allocations
+     * are dropped, add the entries to a fresh RecordStore afterwards like the firmware does at boot.
+     */
+    void power_cycle();
+
+    // Counters
+    uint64_t now_us();
+    uint64_t blocking_us();
+    uint32_t num_transactions();
+    uint32_t page_writes(uint16_t page);
+    uint32_t max_page_writes();
+    uint32_t total_page_writes();
+    void reset_counters();
+
+private:
+    static constexpr size_t QUEUE_SIZE = 16;
+
+    struct Transaction {
+        bool is_write;
+        bool is_erase;
+        uint16_t addr;
+        uint8_t *data;
+        uint16_t len;
+        Callback cb;
+        void *arg;
+    };
+
+    int fd;
+    uint8_t *mem;
+
+    uint16_t allocator_offset;
+
+    CircularBuffer<Transaction, QUEUE_SIZE> queue;
+
+    uint64_t clock_us;
+    uint64_t blocked_us;
+    uint32_t transactions;
+    uint32_t write_counts[NUM_PAGES];
+
+    int64_t nack_countdown;  // -1 when disabled
+    int64_t power_loss_countdown;
+    bool is_power_lost;
+    float read_flip_rate;
+    uint32_t rng_state;
+
+    bool run_read(uint16_t addr, uint8_t *data, uint16_t len);
+    bool run_write(uint16_t addr, uint8_t const *data, uint16_t len);
+    bool run_erase();
+    bool start_transaction(uint32_t bytes);
+    void program_byte(uint16_t addr, uint8_t value);
+    uint32_t transfer_time_us(uint32_t bytes);
+    uint32_t next_random();
+    bool enqueue(Transaction const &t);
+};
+
+#endif  // EEPROM_SIM_H
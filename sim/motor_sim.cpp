@@ -0,0 +1,40 @@
+#include "motor_sim.h"
+
+#include "drv8873_sim.h"
+#include "sim_clock.h"
+
+constexpr MotorSim::Parameters MotorSim::kDefaults;
+
+MotorSim::MotorSim(Parameters params)
+    : driver(nullptr, 0, nullptr, 0, nullptr, 0, nullptr, 0, 0, nullptr, nullptr, 0),
+      encoder(&encoder_tim),
+      limit_switch{&limit_port, 1},
+      params(params),
+      arm(params.arm),
+      encoder_timer{},
+      encoder_tim{&encoder_timer},
+      limit_port{} {
+    drv8873_sim_reset();
+    encoder_timer.CNT = 32768;
+    limit_port.IDR = 1;  // The switch pulls it low
+}
+
+void MotorSim::run(uint32_t duration_us, float load) {
+    for (uint32_t t = 0; t < duration_us; t += ArmSim::STEP_US) {
+        float current_cmd =
+              params.current_per_duty * drv8873_sim_get_duty() - params.current_per_velocity * arm.get_velocity();
+        int32_t last_count = arm.get_count();
+        arm.run(current_cmd, ArmSim::STEP_US, load);
+        sim_clock_advance_us(ArmSim::STEP_US);
+
+        int32_t counts = arm.get_count() - last_count;
+        encoder_timer.CNT = (uint16_t)(encoder_timer.CNT + (encoder.is_inverted ? -counts : counts));
+
+        drv8873_sim_set_current(arm.get_current());
+        driver.conversion_complete_isr(nullptr);
+    }
+}
+
+ArmSim const &MotorSim::get_arm() const {
+    return arm;
+}
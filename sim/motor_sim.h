@@ -0,0 +1,57 @@
+#ifndef MOTOR_SIM_H
+#define MOTOR_SIM_H
+
+#include "arm_sim.h"
+#include "drivers/pin.h"
+#include "drv8873.h"
+#include "encoder.h"
+
+/**
+ * The hardware under Servo on the host, so the real Servo runs on a simulated arm: the DRV8873 driving the motor
+ * winding, the encoder's timer and the limit switch. Hand driver, encoder and limit_switch to the Servo and call its
+ * init() as abvm_init() does.
+ *
+ *   winding   the bridge puts current_per_duty of current through it at full duty, less current_per_velocity of back
+ *             EMF, the winding's L/R is the arm's current_tau_s
+ *   encoder   the arm's whole counts moved on the timer's CNT, the way the Servo reads them back (is_inverted)
+ *   current   sampled and the driver's callback run at the end of every PWM period, like the ADC's DMA interrupt
+ *
+ * The simulated clock runs with the motor, run() advances it. The arm starts at 0, where Servo::init() zeroes it.
+ */
+class MotorSim {
+public:
+    struct Parameters {
+        ArmSim::Parameters arm;
+        float current_per_duty;      // A at full duty and standstill, 12 V across the winding
+        float current_per_velocity;  // A / (rads/s) at the output
+    };
+
+    static constexpr Parameters kDefaults = {.arm = ArmSim::kDefaults,
+                                             .current_per_duty = 6,
+                                             .current_per_velocity = 2};
+
+    explicit MotorSim(Parameters params = kDefaults);
+
+    /**
+     * duration_us of PWM periods, with whatever duty the driver was last set to. load is in rads/s^2 against the
+     * arm, see ArmSim.
+     */
+    void run(uint32_t duration_us, float load = 0);
+
+    ArmSim const &get_arm() const;
+
+    DRV8873 driver;
+    Encoder encoder;
+    Pin limit_switch;  // Never pressed
+
+private:
+    Parameters params;
+    ArmSim arm;
+
+    // Only their addresses are taken before they are set up
+    TIM_TypeDef encoder_timer;
+    TIM_HandleTypeDef encoder_tim;
+    GPIO_TypeDef limit_port;
+};
+
+#endif  // MOTOR_SIM_H
@@ -0,0 +1,31 @@
+#include "sim_clock.h"
+
+#include "clock.h"
+
+static uint64_t now_us = 0;
+
+void sim_clock_set_us(uint64_t us) {
+    now_us = us;
+}
+
+void sim_clock_advance_us(uint64_t us) {
+    now_us += us;
+}
+
+uint32_t millis() {
+    return now_us / 1000;
+}
+
+uint64_t micros() {
+    return now_us;
+}
+
+uint32_t delay_ms(uint32_t x) {
+    now_us += x * 1000ull;
+    return x;
+}
+
+uint32_t delay_us(uint32_t x) {
+    now_us += x;
+    return x;
+}
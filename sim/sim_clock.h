@@ -0,0 +1,12 @@
+#ifndef SIM_CLOCK_H
+#define SIM_CLOCK_H
+
+#include <stdint.h>
+
+/**
+ * clock.h on the host. Time stands still until the test moves it, the firmware only ever sees the simulated time.
+ */
+void sim_clock_set_us(uint64_t now_us);
+void sim_clock_advance_us(uint64_t us);
+
+#endif  // SIM_CLOCK_H
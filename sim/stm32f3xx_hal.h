@@ -0,0 +1,69 @@
+#ifndef STM32F3XX_HAL_SIM_H
+#define STM32F3XX_HAL_SIM_H
+
+/**
+ * Host stand-in for the STM32 HAL, found ahead of the real one by the native env's -I sim. Only the types and macros the
+ * firmware's headers need to parse, and the few functions the encoder and pin drivers call. Those work on the register
+ * structs below, which the simulations move, so the drivers under Servo run on the host unchanged. Anything else that
+ * talks to a peripheral doesn't belong in the native build.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define __IO volatile
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    __IO uint32_t IDR;
+    __IO uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef struct {
+    __IO uint32_t CNT;
+    __IO uint32_t ARR;
+    __IO uint32_t CCR1;
+} TIM_TypeDef;
+
+typedef struct {
+    TIM_TypeDef *Instance;
+} TIM_HandleTypeDef;
+
+typedef struct {
+    void *Instance;
+} SPI_HandleTypeDef;
+
+typedef struct {
+    void *Instance;
+} ADC_HandleTypeDef;
+
+typedef enum { HAL_OK = 0, HAL_ERROR, HAL_BUSY, HAL_TIMEOUT } HAL_StatusTypeDef;
+
+typedef enum { GPIO_PIN_RESET = 0, GPIO_PIN_SET } GPIO_PinState;
+
+#define TIM_CHANNEL_ALL 0x3CU
+
+static inline GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *port, uint16_t pin) {
+    return (port->IDR & pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+static inline void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state) {
+    port->ODR = state == GPIO_PIN_SET ? (port->ODR | pin) : (port->ODR & ~pin);
+}
+
+// The timer's CNT is the simulation's to move
+static inline HAL_StatusTypeDef HAL_TIM_Encoder_Start(TIM_HandleTypeDef *htim, uint32_t channel) {
+    (void)htim;
+    (void)channel;
+    return HAL_OK;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // STM32F3XX_HAL_SIM_H
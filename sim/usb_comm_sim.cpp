@@ -0,0 +1,10 @@
+/**
+ * USBComm on the host, in place of Src/usb_comm.cpp. There is no host on the other end, whatever is sent is dropped.
+ */
+#include "usb_comm.h"
+
+bool USBComm::send(uint8_t *data, size_t len) {
+    (void)data;
+    (void)len;
+    return true;
+}
@@ -0,0 +1,266 @@
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include <random>
+
+#include "config.h"
+#include "controls/trapezoidal_planner.h"
+#include "motor_sim.h"
+#include "sim_clock.h"
+#include "ventilator_controller.h"
+
+// The bag on the bench: squeezed by the arm past the open position, refilled through its intake valve
+static constexpr float kBagVolumePerDeg = 12;  // mL
+static constexpr float kBagCompliance = 3;     // mL/cmH2O
+
+static constexpr float kCompliance = 30;   // mL/cmH2O
+static constexpr float kResistance = .02f;  // cmH2O / (mL/s)
+static constexpr float kPEEP = 5;           // cmH2O
+
+static constexpr uint32_t kSensorPeriodUs = 12500;  // The ADS1231 at 80 SPS
+static constexpr uint32_t kEffortUs = 600000;       // A breath in, 1 - cos shaped
+static constexpr uint32_t kStepUs = 100;
+
+// abvm.cpp runs the controller once more than 10 ms have passed, the rest of the main loop holds it up a little more
+static constexpr uint32_t kVentPeriodUs = 11000;
+static constexpr uint32_t kVentJitterMs = 2;
+
+// A lung breathing out through the PEEP valve, the pressure measured at the airway. The patient's effort pulls the
+// alveolar pressure down, through the closed valves the airway follows it.
+struct Patient {
+    float bag_out = 0;  // mL pushed out of the bag since it last refilled
+    float lung_volume = kPEEP * kCompliance;
+    float effort = 0;  // cmH2O, of the patient's muscles
+    float airway_pressure = 0;
+
+    void run(float arm_deg, float dt) {
+        float displaced = kBagVolumePerDeg * fmaxf(arm_deg - kVentMotionConfig.open_pos_deg, 0);
+        float bag_pressure = (displaced - bag_out) / kBagCompliance;
+        if (bag_pressure < 0) {
+            bag_out = displaced;
+            bag_pressure = 0;
+        }
+
+        float alveolar_pressure = lung_volume / kCompliance - effort;
+        if (bag_pressure > alveolar_pressure && bag_pressure > 0) {
+            float flow = (bag_pressure - alveolar_pressure) / kResistance;
+            bag_out += flow * dt;
+            lung_volume += flow * dt;
+            airway_pressure = bag_pressure;
+        } else if (alveolar_pressure > kPEEP) {
+            lung_volume -= (alveolar_pressure - kPEEP) / kResistance * dt;
+            airway_pressure = kPEEP + .3f * (alveolar_pressure - kPEEP);
+        } else {
+            airway_pressure = alveolar_pressure;
+        }
+    }
+};
+
+struct PressureSensor : ISensor {
+    float value = 0;
+
+    float read() override {
+        return value;
+    }
+
+    bool read_sample(Sample *sample) override {
+        (void)sample;
+        return false;
+    }
+};
+
+struct TriggerResult {
+    uint32_t num_efforts;    // Started in an expiration, after the first few breaths
+    uint32_t num_caught;     // Triggered a breath before the effort was over
+    uint32_t num_triggered;  // Breaths the controller put down to the patient
+    float latency_ms;        // Mean, from the start of the effort
+    float max_latency_ms;
+};
+
+// 120 s at 14 bpm with an effort every effort_period_us, the controller and servo at abvm.cpp's rates. Every sample
+// goes to on_pressure_sample() as the ADS1231's interrupt would hand it over. Half way between efforts the samples'
+// timestamps jump by clock_step_us.
+static TriggerResult run_efforts(float effort_cmH2O, uint32_t effort_period_us, float noise_cmH2O,
+                                 int32_t clock_step_us = 0) {
+    Patient patient;
+    PressureSensor sensor;
+    MotorSim motor_sim;
+    Servo motor(1, &motor_sim.driver, &motor_sim.encoder, &motor_sim.limit_switch, kMotorConfig.motor_params, kMotorConfig.motor_vel_pid_params,
+                kMotorConfig.motor_vel_limits, kMotorConfig.motor_pos_pid_params, kMotorConfig.motor_pos_limits,
+                kMotorCurrentConfig.motor_cur_pid_params);
+    TrapezoidalPlanner planner({.4f, .4f});
+    VentilatorController vent(&planner, &motor, &sensor, kVentTVSettings, 6, kVentRateSettings, 6);
+    vent.bump_tv(2);
+    vent.bump_rate(3);
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> noise(-noise_cmH2O, noise_cmH2O);
+    std::uniform_int_distribution<uint32_t> jitter(0, kVentJitterMs);
+
+    sim_clock_set_us(1000000);
+    motor.init();
+    vent.start();
+
+    TriggerResult result = {};
+    double latency_sum = 0;
+    bool is_effort_pending = false;
+    uint32_t effort_start_us = 0;
+    uint32_t num_triggered = 0;
+    int64_t clock_offset_us = 0;
+    uint32_t next_vent_us = kVentPeriodUs;
+
+    for (uint32_t t_us = kStepUs; t_us <= 120000000; t_us += kStepUs) {
+        uint32_t phase_us = t_us % effort_period_us;
+        if (phase_us == effort_period_us / 2) {
+            clock_offset_us += clock_step_us;
+        }
+        float phase = (float)phase_us / kEffortUs;
+        patient.effort = effort_cmH2O > 0 && phase < 1 ? effort_cmH2O * (1 - cosf(2 * (float)M_PI * phase)) / 2 : 0;
+
+        // Only efforts that start in an expiration can trigger
+        bool is_expiration =
+              !planner.is_idle() && planner.get_tag() == (uint32_t)VentilatorController::State::EXPIRATION;
+        if (effort_cmH2O > 0 && phase_us == 0 && t_us > 8000000 && is_expiration) {
+            is_effort_pending = true;
+            effort_start_us = t_us;
+            result.num_efforts++;
+        }
+
+        patient.run(rad_to_deg(motor.position), kStepUs * 1e-6f);
+        motor_sim.run(kStepUs);
+
+        if (t_us % kSensorPeriodUs == 0) {
+            sensor.value = patient.airway_pressure + noise(rng);
+            vent.on_pressure_sample(
+                  {.time_us = micros() + clock_offset_us, .value = sensor.value, .is_saturated = false});
+        }
+        if (t_us % 1000 == 0) {
+            motor.update();
+        }
+        if (t_us >= next_vent_us) {
+            vent.update();
+            next_vent_us = t_us + kVentPeriodUs + jitter(rng) * 1000;
+        }
+
+        if (vent.get_num_triggered_breaths() != num_triggered) {
+            num_triggered = vent.get_num_triggered_breaths();
+            if (is_effort_pending) {
+                float latency_ms = (t_us - effort_start_us) / 1000.f;
+                latency_sum += (double)latency_ms;
+                result.max_latency_ms = fmaxf(result.max_latency_ms, latency_ms);
+                result.num_caught++;
+                is_effort_pending = false;
+            }
+        }
+        if (is_effort_pending && t_us - effort_start_us >= kEffortUs) {
+            is_effort_pending = false;
+        }
+    }
+
+    result.num_triggered = num_triggered;
+    result.latency_ms = result.num_caught ? (float)(latency_sum / result.num_caught) : 0;
+    return result;
+}
+
+static void report(const char *name, TriggerResult const &r) {
+    char msg[192];
+    snprintf(msg, sizeof(msg),
+             "%s: %u of %u efforts caught, %u triggered breaths, %.0f ms after the effort started (at most %.0f ms)",
+             name, (unsigned)r.num_caught, (unsigned)r.num_efforts, (unsigned)r.num_triggered, (double)r.latency_ms,
+             (double)r.max_latency_ms);
+    TEST_MESSAGE(msg);
+}
+
+void setUp() {
+    kVentPressureConfig.mode = VentMode::VOLUME;
+    kVentRespirationConfig.trigger_pressure_drop_cmH2O = 0;
+    kVentRespirationConfig.trigger_pressure_slope = 0;
+}
+
+void tearDown() {}
+
+// A 3 cmH2O effort every 3.5 s against the 4.3 s backup breath
+void test_pressure_drop_catches_efforts() {
+    kVentRespirationConfig.trigger_pressure_drop_cmH2O = 1;
+    TriggerResult r = run_efforts(3, 3500000, .1f);
+    report("1 cmH2O drop", r);
+
+    TEST_ASSERT_GREATER_THAN_UINT32(20, r.num_efforts);
+    TEST_ASSERT_EQUAL_UINT32(r.num_efforts, r.num_caught);
+    TEST_ASSERT_EQUAL_UINT32(r.num_caught, r.num_triggered);
+    TEST_ASSERT_LESS_THAN_FLOAT(200, r.max_latency_ms);
+}
+
+void test_slope_catches_efforts() {
+    kVentRespirationConfig.trigger_pressure_slope = 10;
+    TriggerResult r = run_efforts(3, 3500000, .1f);
+    report("10 cmH2O/s slope", r);
+
+    TEST_ASSERT_GREATER_THAN_UINT32(20, r.num_efforts);
+    TEST_ASSERT_EQUAL_UINT32(r.num_efforts, r.num_caught);
+    TEST_ASSERT_EQUAL_UINT32(r.num_caught, r.num_triggered);
+    TEST_ASSERT_LESS_THAN_FLOAT(200, r.max_latency_ms);
+}
+
+// Without an effort the exhalation doesn't look like one. The drop holds up to twice the usual sensor noise. The slope
+// of the noise between samples is what the slope trigger sees, at twice the noise 10 cmH2O/s is too sensitive.
+void test_no_false_triggers() {
+    struct {
+        float drop;
+        float slope;
+        float noise;
+    } settings[] = {{1, 0, .1f}, {1, 0, .2f}, {0, 10, .1f}, {0, 20, .2f}};
+
+    for (auto const &s : settings) {
+        kVentRespirationConfig.trigger_pressure_drop_cmH2O = s.drop;
+        kVentRespirationConfig.trigger_pressure_slope = s.slope;
+        TriggerResult r = run_efforts(0, 3500000, s.noise);
+        char name[64];
+        snprintf(name, sizeof(name), "no effort, drop %.0f, slope %.0f, noise %.1f", (double)s.drop, (double)s.slope,
+                 (double)s.noise);
+        report(name, r);
+        TEST_ASSERT_EQUAL_UINT32(0, r.num_triggered);
+    }
+}
+
+// The timestamps jumping a second either way, or back by nearly a sample so the next one comes right after the last,
+// neither triggers a breath nor stops the efforts from triggering them
+void test_clock_steps() {
+    kVentRespirationConfig.trigger_pressure_drop_cmH2O = 1;
+    kVentRespirationConfig.trigger_pressure_slope = 10;
+    int32_t steps[] = {-1000000, -12400, 1000000};
+
+    for (int32_t step : steps) {
+        char name[48];
+        snprintf(name, sizeof(name), "clock step %+d us", (int)step);
+
+        TriggerResult r = run_efforts(0, 3500000, .1f, step);
+        report(name, r);
+        TEST_ASSERT_EQUAL_UINT32(0, r.num_triggered);
+
+        r = run_efforts(3, 3500000, .1f, step);
+        report(name, r);
+        TEST_ASSERT_GREATER_THAN_UINT32(20, r.num_efforts);
+        TEST_ASSERT_EQUAL_UINT32(r.num_efforts, r.num_caught);
+        TEST_ASSERT_EQUAL_UINT32(r.num_caught, r.num_triggered);
+    }
+}
+
+// Both off is time cycled, whatever the patient does
+void test_off_ignores_efforts() {
+    TriggerResult r = run_efforts(3, 3500000, .1f);
+    report("off", r);
+    TEST_ASSERT_GREATER_THAN_UINT32(20, r.num_efforts);
+    TEST_ASSERT_EQUAL_UINT32(0, r.num_triggered);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_pressure_drop_catches_efforts);
+    RUN_TEST(test_slope_catches_efforts);
+    RUN_TEST(test_no_false_triggers);
+    RUN_TEST(test_off_ignores_efforts);
+    RUN_TEST(test_clock_steps);
+    return UNITY_END();
+}
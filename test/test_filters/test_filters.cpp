@@ -0,0 +1,207 @@
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include <chrono>
+#include <complex>
+
+#include "math/filters.h"
+
+static constexpr float kSampleHz = 1000;
+
+// Worked out at compile time, the point of the constexpr coefficients
+static constexpr Biquad::Coeffs kLowPass = Biquad::low_pass(50, kSampleHz);
+static constexpr Biquad::Coeffs kHighPass = Biquad::high_pass(50, kSampleHz);
+static constexpr Biquad::Coeffs kNotch = Biquad::notch(50, kSampleHz, 5);
+static_assert(OnePoleLowPass::alpha_for(16.77f, kSampleHz) > .0999f &&
+                  OnePoleLowPass::alpha_for(16.77f, kSampleHz) < .1001f,
+              "alpha_for() isn't a constant expression or is off");
+
+// Amplitude of the filter's steady state response to a unit sine. Correlated against the input over whole cycles, after
+// a few seconds to settle.
+template <typename Filter>
+static float measure_gain(Filter *filter, float freq_hz) {
+    constexpr int kSettle = 4000;
+    int n = (int)lroundf(kSampleHz / freq_hz * ceilf(freq_hz));  // A whole number of cycles, about a second
+    double i_sum = 0;
+    double q_sum = 0;
+    for (int k = 0; k < kSettle + n; k++) {
+        double w = 2 * M_PI * (double)freq_hz * k / (double)kSampleHz;
+        float y = filter->update((float)sin(w));
+        if (k >= kSettle) {
+            i_sum += (double)y * sin(w);
+            q_sum += (double)y * cos(w);
+        }
+    }
+    return (float)(2 * sqrt(i_sum * i_sum + q_sum * q_sum) / n);
+}
+
+// |H(e^jw)| of the coefficients, what the filter should measure
+static float biquad_gain(Biquad::Coeffs const &c, float freq_hz) {
+    std::complex<double> z = std::polar(1.0, 2 * M_PI * (double)freq_hz / (double)kSampleHz);
+    std::complex<double> z1 = 1.0 / z;
+    std::complex<double> h = ((double)c.b0 + (double)c.b1 * z1 + (double)c.b2 * z1 * z1) /
+                             (1.0 + (double)c.a1 * z1 + (double)c.a2 * z1 * z1);
+    return (float)std::abs(h);
+}
+
+// The analog Butterworth the low pass is designed from
+static float butterworth_gain(float cutoff_hz, float freq_hz) {
+    return 1 / sqrtf(1 + powf(freq_hz / cutoff_hz, 4));
+}
+
+static float to_db(float gain) {
+    return 20 * log10f(gain);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_constexpr_math() {
+    float max_trig_err = 0;
+    for (float x = 0; x <= (float)M_PI; x += .001f) {
+        max_trig_err = fmaxf(max_trig_err, fabsf(cx::sin(x) - sinf(x)));
+        max_trig_err = fmaxf(max_trig_err, fabsf(cx::cos(x) - cosf(x)));
+    }
+
+    float max_exp_err = 0;
+    for (float x = 0; x > -20; x -= .01f) {
+        max_exp_err = fmaxf(max_exp_err, fabsf(cx::exp_neg(x) - expf(x)) / expf(x));
+    }
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "sin/cos max abs error %.1e, exp max rel error %.1e", (double)max_trig_err,
+             (double)max_exp_err);
+    TEST_MESSAGE(msg);
+
+    TEST_ASSERT_LESS_THAN_FLOAT(1e-6f, max_trig_err);
+    TEST_ASSERT_LESS_THAN_FLOAT(2e-5f, max_exp_err);
+}
+
+void test_low_pass_response() {
+    float freqs[] = {5, 25, 50, 100, 200, 400};
+    for (float f : freqs) {
+        Biquad filter(kLowPass);
+        float gain = measure_gain(&filter, f);
+
+        char msg[96];
+        snprintf(msg, sizeof(msg), "low pass 50 Hz: %3.0f Hz %6.2f dB, analog Butterworth %6.2f dB", (double)f,
+                 (double)to_db(gain), (double)to_db(butterworth_gain(50, f)));
+        TEST_MESSAGE(msg);
+
+        TEST_ASSERT_FLOAT_WITHIN(.01f * biquad_gain(kLowPass, f), biquad_gain(kLowPass, f), gain);
+    }
+
+    // -3 dB at the cutoff, and the bilinear transform's warping only shows well above it
+    Biquad filter(kLowPass);
+    TEST_ASSERT_FLOAT_WITHIN(.05f, -3.01f, to_db(measure_gain(&filter, 50)));
+    TEST_ASSERT_FLOAT_WITHIN(.01f, 1, biquad_gain(kLowPass, 5));
+    TEST_ASSERT_FLOAT_WITHIN(.5f, to_db(butterworth_gain(50, 100)), to_db(biquad_gain(kLowPass, 100)));
+}
+
+void test_high_pass_response() {
+    Biquad filter(kHighPass);
+    TEST_ASSERT_FLOAT_WITHIN(.05f, -3.01f, to_db(measure_gain(&filter, 50)));
+    TEST_ASSERT_LESS_THAN_FLOAT(-35, to_db(biquad_gain(kHighPass, 5)));
+    TEST_ASSERT_FLOAT_WITHIN(.01f, 1, biquad_gain(kHighPass, 400));
+}
+
+void test_notch_response() {
+    Biquad filter(kNotch);
+    TEST_ASSERT_LESS_THAN_FLOAT(-40, to_db(measure_gain(&filter, 50)));
+    TEST_ASSERT_FLOAT_WITHIN(.02f, 1, biquad_gain(kNotch, 5));
+    TEST_ASSERT_FLOAT_WITHIN(.02f, 1, biquad_gain(kNotch, 200));
+}
+
+void test_one_pole_response() {
+    float alpha = OnePoleLowPass::alpha_for(16.77f, kSampleHz);
+    float freqs[] = {1, 16.77f, 50};
+    for (float f : freqs) {
+        OnePoleLowPass filter(16.77f, kSampleHz);
+        float gain = measure_gain(&filter, f);
+
+        // y[n] = y[n-1] + alpha (x[n] - y[n-1])
+        std::complex<double> z1 = std::polar(1.0, -2 * M_PI * (double)f / (double)kSampleHz);
+        float expected = (float)std::abs((double)alpha / (1.0 - (1.0 - (double)alpha) * z1));
+
+        char msg[96];
+        snprintf(msg, sizeof(msg), "one pole 16.77 Hz: %5.2f Hz %6.2f dB", (double)f, (double)to_db(gain));
+        TEST_MESSAGE(msg);
+
+        TEST_ASSERT_FLOAT_WITHIN(.01f * expected, expected, gain);
+    }
+
+    OnePoleLowPass filter(16.77f, kSampleHz);
+    TEST_ASSERT_FLOAT_WITHIN(.1f, -3.01f, to_db(measure_gain(&filter, 16.77f)));
+}
+
+void test_biquad_reset_starts_settled() {
+    Biquad filter(kLowPass);
+    filter.reset(10);
+    for (int k = 0; k < 100; k++) {
+        TEST_ASSERT_FLOAT_WITHIN(1e-4f, 10, filter.update(10));
+    }
+}
+
+void test_median_drops_spikes() {
+    MedianFilter<5> filter;
+    float in[] = {1, 1, 50, 1, 1, 2, 2, -40, 2, 2};
+    float out[] = {1, 1, 1, 1, 1, 1, 2, 1, 2, 2};  // Neither spike ever gets through
+    for (size_t i = 0; i < sizeof(in) / sizeof(in[0]); i++) {
+        TEST_ASSERT_EQUAL_FLOAT(out[i], filter.update(in[i]));
+    }
+}
+
+void test_moving_average() {
+    MovingAverage<4> filter;
+    float in[] = {4, 8, 0, 4, 4, 8};
+    float out[] = {4, 6, 4, 4, 4, 4};
+    for (size_t i = 0; i < sizeof(in) / sizeof(in[0]); i++) {
+        TEST_ASSERT_EQUAL_FLOAT(out[i], filter.update(in[i]));
+    }
+}
+
+template <typename Filter>
+static void bench(const char *name, Filter *filter) {
+    constexpr int N = 1000000;
+    volatile float out = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < N; k++) {
+        out = filter->update((float)(k & 255));
+    }
+    (void)out;
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / N;
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%-14s %.1f ns per sample on the host", name, ns);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_THAN_FLOAT(1000, (float)ns);
+}
+
+void test_update_cost() {
+    OnePoleLowPass one_pole(10, kSampleHz);
+    Biquad biquad(kLowPass);
+    MovingAverage<8> average;
+    MedianFilter<5> median;
+    bench("one pole", &one_pole);
+    bench("biquad", &biquad);
+    bench("moving avg 8", &average);
+    bench("median 5", &median);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_constexpr_math);
+    RUN_TEST(test_low_pass_response);
+    RUN_TEST(test_high_pass_response);
+    RUN_TEST(test_notch_response);
+    RUN_TEST(test_one_pole_response);
+    RUN_TEST(test_biquad_reset_starts_settled);
+    RUN_TEST(test_median_drops_spikes);
+    RUN_TEST(test_moving_average);
+    RUN_TEST(test_update_cost);
+    return UNITY_END();
+}
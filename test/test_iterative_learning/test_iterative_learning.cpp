@@ -0,0 +1,137 @@
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include "controls/iterative_learning.h"
+
+static IterativeLearningControl::Parameters const kParams = {.learning_gain = .5f,
+                                                             .forgetting = .98f,
+                                                             .max_correction = 5,
+                                                             .lead_bins = 2};
+
+static constexpr uint32_t kPeriodMs = 3000;
+static constexpr uint32_t kStepMs = 10;
+
+// A 30 degree stroke, 1 s in and 2 s out
+static float stroke(uint32_t t_ms) {
+    if (t_ms < 1000) {
+        return 30 * (1 - cosf((float)M_PI * t_ms / 1000)) / 2;
+    }
+    return 30 * (1 + cosf((float)M_PI * (t_ms - 1000) / 2000)) / 2;
+}
+
+// The servo as a first order lag, pushed back by the bag once the arm is past 10 degrees. Returns the RMS tracking
+// error of one breath, in degrees.
+static float run_breath(IterativeLearningControl *ilc, float *y) {
+    constexpr float tau = .06f;
+    float sum_sq = 0;
+    int n = 0;
+
+    for (uint32_t t = 0; t < kPeriodMs; t += kStepMs) {
+        float ref = stroke(t);
+        float err = ref - *y;
+        ilc->record(t, err);
+        sum_sq += err * err;
+        n++;
+
+        float cmd = ref + ilc->get_correction(t);
+        float load = *y > 10 ? .1f * (*y - 10) : 0;
+        *y += kStepMs * 1e-3f / tau * (cmd - load - *y);
+    }
+    return sqrtf(sum_sq / n);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_learns_the_stroke() {
+    IterativeLearningControl ilc(kParams);
+    float y = 0;
+    float rms[15];
+
+    ilc.start_cycle(kPeriodMs);
+    for (int b = 0; b < 15; b++) {
+        rms[b] = run_breath(&ilc, &y);
+        ilc.start_cycle(kPeriodMs);
+
+        char msg[64];
+        snprintf(msg, sizeof(msg), "breath %2d: rms error %.3f deg", b + 1, (double)rms[b]);
+        TEST_MESSAGE(msg);
+    }
+
+    TEST_ASSERT_FLOAT_WITHIN(.05f, 1.64f, rms[0]);
+    TEST_ASSERT_LESS_THAN_FLOAT(.35f, rms[3]);
+    TEST_ASSERT_LESS_THAN_FLOAT(.08f, rms[10]);
+
+    // Settled, not creeping back up as the forgetting factor bleeds the correction off
+    TEST_ASSERT_FLOAT_WITHIN(.005f, rms[10], rms[14]);
+    TEST_ASSERT_EQUAL_UINT16(15, ilc.get_num_cycles_learned());
+}
+
+void test_no_correction_in_the_first_cycle() {
+    IterativeLearningControl ilc(kParams);
+    ilc.start_cycle(kPeriodMs);
+    for (uint32_t t = 0; t < kPeriodMs; t += kStepMs) {
+        ilc.record(t, 1);
+        TEST_ASSERT_EQUAL_FLOAT(0, ilc.get_correction(t));
+    }
+
+    ilc.start_cycle(kPeriodMs);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, .98f * .5f, ilc.get_correction(kPeriodMs / 2));
+}
+
+void test_correction_is_clamped() {
+    IterativeLearningControl ilc(kParams);
+    ilc.start_cycle(kPeriodMs);
+    for (int b = 0; b < 20; b++) {
+        for (uint32_t t = 0; t < kPeriodMs; t += kStepMs) {
+            ilc.record(t, 100);
+        }
+        ilc.start_cycle(kPeriodMs);
+    }
+    TEST_ASSERT_EQUAL_FLOAT(5, ilc.get_correction(kPeriodMs / 2));
+}
+
+void test_discarded_cycle_is_not_learned() {
+    IterativeLearningControl ilc(kParams);
+    ilc.start_cycle(kPeriodMs);
+    for (uint32_t t = 0; t < kPeriodMs / 2; t += kStepMs) {
+        ilc.record(t, 1);
+    }
+
+    // Cut short by a fast open
+    ilc.discard_cycle();
+    TEST_ASSERT_EQUAL_FLOAT(0, ilc.get_correction(kPeriodMs / 4));
+
+    ilc.start_cycle(kPeriodMs);
+    TEST_ASSERT_EQUAL_UINT16(0, ilc.get_num_cycles_learned());
+    TEST_ASSERT_EQUAL_FLOAT(0, ilc.get_correction(kPeriodMs / 4));
+}
+
+void test_period_change_forgets() {
+    IterativeLearningControl ilc(kParams);
+    ilc.start_cycle(kPeriodMs);
+    for (int b = 0; b < 3; b++) {
+        for (uint32_t t = 0; t < kPeriodMs; t += kStepMs) {
+            ilc.record(t, 1);
+        }
+        ilc.start_cycle(kPeriodMs);
+    }
+    TEST_ASSERT_GREATER_THAN_FLOAT(0, ilc.get_correction(kPeriodMs / 2));
+
+    // A new rate, the corrections learned for the old one don't line up with it
+    ilc.start_cycle(2000);
+    TEST_ASSERT_EQUAL_UINT16(0, ilc.get_num_cycles_learned());
+    TEST_ASSERT_EQUAL_FLOAT(0, ilc.get_correction(1000));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_learns_the_stroke);
+    RUN_TEST(test_no_correction_in_the_first_cycle);
+    RUN_TEST(test_correction_is_clamped);
+    RUN_TEST(test_discarded_cycle_is_not_learned);
+    RUN_TEST(test_period_change_forgets);
+    return UNITY_END();
+}
@@ -0,0 +1,249 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unity.h>
+
+#include "arm_sim.h"
+#include "controls/pid.h"
+#include "controls/s_curve_planner.h"
+#include "controls/trapezoidal_planner.h"
+#include "controls/velocity_estimator.h"
+#include "math/filters.h"
+
+static constexpr float kDt = .001f;
+
+static uint64_t now_us = 0;
+
+static uint64_t clock_us() {
+    return now_us;
+}
+
+// The servo's defaults from config.cpp
+static PID::Params const kVelParams = {.Kp = 8,
+                                       .Ki = 40,
+                                       .Kd = 0,
+                                       .Kff_vel = 0,
+                                       .Kff_acc = 0,
+                                       .d_filter_hz = 0,
+                                       .output_limits = {-4, 4}};
+static PID::Params const kPosParams = {.Kp = 14.5,
+                                       .Ki = .1,
+                                       .Kd = 0,
+                                       .Kff_vel = 1,
+                                       .Kff_acc = 0,
+                                       .d_filter_hz = 0,
+                                       .output_limits = {-25 * 0.104719755f, 25 * 0.104719755f}};
+
+// The position and velocity loops of Servo::update() on the simulated arm, following a planner every 1 ms
+struct Cascade {
+    ArmSim arm;
+    PID pos_pid;
+    PID vel_pid;
+    MTVelocityEstimator velocity_estimator;
+    OnePoleLowPass velocity_filter;
+
+    Cascade()
+        : pos_pid(kPosParams, kDt),
+          vel_pid(kVelParams, kDt),
+          velocity_estimator({.rad_per_count = ArmSim::kDefaults.rad_per_count,
+                              .min_window_us = 500,
+                              .timeout_us = 100000}),
+          velocity_filter(40, 1000) {}
+
+    void update(float pos, float vel, float acc) {
+        float position = arm.get_count() * ArmSim::kDefaults.rad_per_count;
+        float velocity =
+            velocity_filter.update(velocity_estimator.update(arm.get_count(), arm.get_edge_us(), arm.now_us()));
+
+        float vel_cmd = pos_pid.update(pos, position, vel);
+        arm.run(vel_pid.update(vel_cmd, velocity, vel, acc), 1000);
+    }
+};
+
+struct StrokeResult {
+    float max_err;       // rads
+    float peak_current;  // A
+    float peak_slew;     // A/ms, how hard the current is kicked
+    float end_err;       // rads, once settled
+};
+
+// A .7 s inhale of .6 rad and a .7 s exhale back, about a 30 BPM stroke. The planner and the arm both run on the
+// simulated clock.
+static StrokeResult run_stroke(IMotionPlanner *planner) {
+    Cascade c;
+    StrokeResult r = {};
+
+    now_us = 0;
+    planner->reset();
+    planner->set_next({.p_target = .6f, .v_target = 0, .time_total_ms = 700, .tag = 1});
+    planner->set_next({.p_target = 0, .v_target = 0, .time_total_ms = 700, .tag = 2});
+
+    float last_current = 0;
+    for (int k = 0; k < 2000; k++) {
+        float pos = planner->run(planner->get_pos());
+        c.update(pos, planner->get_vel(), planner->get_acc());
+        now_us += 1000;
+
+        float current = c.arm.get_current();
+        r.max_err = fmaxf(r.max_err, fabsf(pos - c.arm.get_position()));
+        r.peak_current = fmaxf(r.peak_current, fabsf(current));
+        r.peak_slew = fmaxf(r.peak_slew, fabsf(current - last_current));
+        last_current = current;
+    }
+    r.end_err = fabsf(c.arm.get_position());
+    return r;
+}
+
+static void report(const char *name, StrokeResult const &r) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%s: tracking error max %.4f rad, peak current %.2f A, peak slew %.3f A/ms", name,
+             (double)r.max_err, (double)r.peak_current, (double)r.peak_slew);
+    TEST_MESSAGE(msg);
+}
+
+void setUp() {
+    now_us = 0;
+}
+
+void tearDown() {}
+
+void test_plans_end_on_target() {
+    TrapezoidalPlanner trapezoid({.t_a_percent = .4f, .t_d_percent = .4f}, clock_us);
+    SCurvePlanner s_curve({.t_a_percent = .4f, .t_d_percent = .4f, .jerk_percent = .5f}, clock_us);
+    IMotionPlanner *planners[] = {&trapezoid, &s_curve};
+
+    for (IMotionPlanner *planner : planners) {
+        now_us = 0;
+        planner->set_next({.p_target = 20, .v_target = 0, .time_total_ms = 1000, .tag = 1});
+        planner->run(0);
+        while (!planner->is_idle()) {
+            now_us += 1000;
+            planner->run(planner->get_pos());
+        }
+        TEST_ASSERT_EQUAL_FLOAT(20, planner->get_pos());
+        TEST_ASSERT_EQUAL_FLOAT(0, planner->get_vel());
+        TEST_ASSERT_EQUAL_UINT64(1000000, now_us);
+    }
+}
+
+// Breaths of an inhale, a hold and an exhale, 3 s apart (20 BPM). Queued a breath at a time like the ventilator does,
+// the queue only holds a little over one.
+static void queue_breaths(IMotionPlanner *planner, int *num_queued) {
+    if (*num_queued < 10 && planner->get_num_queued() <= IMotionPlanner::QUEUE_SIZE - 3) {
+        TEST_ASSERT_TRUE(planner->set_next({.p_target = 20, .v_target = 0, .time_total_ms = 1000, .tag = 0}));
+        TEST_ASSERT_TRUE(planner->set_next({.p_target = 20, .v_target = 0, .time_total_ms = 200, .tag = 1}));
+        TEST_ASSERT_TRUE(planner->set_next({.p_target = 0, .v_target = 0, .time_total_ms = 1800, .tag = 2}));
+        (*num_queued)++;
+    }
+}
+
+// The main loop runs every 10-15 ms, however long the rest of it took. The motion is a function of the time alone, so
+// it matches a planner run every 1 ms and a breath every 3 s stays exactly 20 BPM.
+void test_loop_jitter_keeps_bpm_exact() {
+    TrapezoidalPlanner trapezoid({.t_a_percent = .4f, .t_d_percent = .4f}, clock_us);
+    SCurvePlanner s_curve({.t_a_percent = .4f, .t_d_percent = .4f, .jerk_percent = .5f}, clock_us);
+    TrapezoidalPlanner trapezoid_ref({.t_a_percent = .4f, .t_d_percent = .4f}, clock_us);
+    SCurvePlanner s_curve_ref({.t_a_percent = .4f, .t_d_percent = .4f, .jerk_percent = .5f}, clock_us);
+    IMotionPlanner *planners[] = {&trapezoid, &s_curve};
+    IMotionPlanner *refs[] = {&trapezoid_ref, &s_curve_ref};
+
+    for (int i = 0; i < 2; i++) {
+        IMotionPlanner *planner = planners[i];
+        IMotionPlanner *ref = refs[i];
+        int num_queued = 0;
+        int num_ref_queued = 0;
+        srand(1);
+
+        now_us = 0;
+        queue_breaths(planner, &num_queued);
+        queue_breaths(ref, &num_ref_queued);
+        planner->run(0);
+        ref->run(0);
+
+        uint64_t ref_us = 0;
+        uint32_t last_tag = 0;
+        int num_breaths = 1;
+        float max_err = 0;
+        while (now_us < 31000000) {
+            uint64_t loop_us = now_us + 10000 + rand() % 5000;
+
+            // The 1 ms reference catches up to the same time
+            while (ref_us + 1000 < loop_us) {
+                ref_us += 1000;
+                now_us = ref_us;
+                queue_breaths(ref, &num_ref_queued);
+                ref->run(ref->get_pos());
+            }
+            now_us = loop_us;
+            ref->run(ref->get_pos());
+
+            queue_breaths(planner, &num_queued);
+            planner->run(planner->get_pos());
+
+            max_err = fmaxf(max_err, fabsf(planner->get_pos() - ref->get_pos()));
+            if (planner->get_tag() == 0 && last_tag != 0) {
+                num_breaths++;
+                // Seen at the first loop after it started, never more than a loop late
+                uint64_t start_us = (num_breaths - 1) * 3000000ull;
+                TEST_ASSERT_TRUE(now_us >= start_us && now_us - start_us < 15000);
+            }
+            last_tag = planner->get_tag();
+        }
+
+        TEST_ASSERT_EQUAL_INT(10, num_breaths);
+        TEST_ASSERT_TRUE(planner->is_idle());
+        TEST_ASSERT_EQUAL_FLOAT(0, planner->get_pos());
+        TEST_ASSERT_LESS_THAN_FLOAT(1e-4f, max_err);
+    }
+}
+
+// A reset part way through a move stops the references too, nothing carries over into the next plan
+void test_reset_stops() {
+    TrapezoidalPlanner trapezoid({.t_a_percent = .4f, .t_d_percent = .4f}, clock_us);
+    SCurvePlanner s_curve({.t_a_percent = .4f, .t_d_percent = .4f, .jerk_percent = .5f}, clock_us);
+    IMotionPlanner *planners[] = {&trapezoid, &s_curve};
+
+    for (IMotionPlanner *planner : planners) {
+        now_us = 0;
+        planner->set_next({.p_target = 20, .v_target = 0, .time_total_ms = 1000, .tag = 1});
+        planner->run(0);
+        now_us = 500000;
+        planner->run(planner->get_pos());
+        TEST_ASSERT_GREATER_THAN_FLOAT(0, planner->get_vel());
+
+        planner->reset();
+        TEST_ASSERT_TRUE(planner->is_idle());
+        TEST_ASSERT_EQUAL_FLOAT(0, planner->get_vel());
+        TEST_ASSERT_EQUAL_FLOAT(0, planner->get_acc());
+    }
+}
+
+// Same stroke, same gains. For the same move time the S-curve needs a little more peak velocity, so its tracking error
+// is about the same or slightly worse. What it buys is the current ramping instead of being kicked at every phase
+// change, about half the slew for the gear train and the bag.
+void test_s_curve_vs_trapezoid() {
+    TrapezoidalPlanner trapezoid({.t_a_percent = .4f, .t_d_percent = .4f}, clock_us);
+    SCurvePlanner s_curve({.t_a_percent = .4f, .t_d_percent = .4f, .jerk_percent = .5f}, clock_us);
+
+    StrokeResult t = run_stroke(&trapezoid);
+    StrokeResult s = run_stroke(&s_curve);
+    report("trapezoid", t);
+    report("s-curve", s);
+
+    TEST_ASSERT_LESS_THAN_FLOAT(.75f * t.peak_slew, s.peak_slew);
+    TEST_ASSERT_LESS_THAN_FLOAT(1.1f * t.peak_current, s.peak_current);
+    TEST_ASSERT_LESS_THAN_FLOAT(1.25f * t.max_err, s.max_err);
+    TEST_ASSERT_LESS_THAN_FLOAT(4, s.peak_current);  // Inside the current limit, the loops never saturate
+
+    TEST_ASSERT_LESS_THAN_FLOAT(.005f, t.end_err);
+    TEST_ASSERT_LESS_THAN_FLOAT(.005f, s.end_err);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_plans_end_on_target);
+    RUN_TEST(test_loop_jitter_keeps_bpm_exact);
+    RUN_TEST(test_reset_stops);
+    RUN_TEST(test_s_curve_vs_trapezoid);
+    return UNITY_END();
+}
@@ -0,0 +1,224 @@
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include <chrono>
+
+#include "arm_sim.h"
+#include "controls/pid.h"
+#include "controls/velocity_estimator.h"
+#include "math/filters.h"
+
+static constexpr float kDt = .001f;
+
+// The servo's defaults from config.cpp
+static PID::Params const kVelParams = {.Kp = 8,
+                                       .Ki = 40,
+                                       .Kd = 0,
+                                       .Kff_vel = 0,
+                                       .Kff_acc = 0,
+                                       .d_filter_hz = 0,
+                                       .output_limits = {-4, 4}};
+static PID::Params const kPosParams = {.Kp = 14.5,
+                                       .Ki = .1,
+                                       .Kd = 0,
+                                       .Kff_vel = 1,
+                                       .Kff_acc = 0,
+                                       .d_filter_hz = 0,
+                                       .output_limits = {-25 * 0.104719755f, 25 * 0.104719755f}};
+
+// The position and velocity loops of Servo::update() on the simulated arm, every 1 ms
+struct Cascade {
+    ArmSim arm;
+    PID pos_pid;
+    PID vel_pid;
+    MTVelocityEstimator velocity_estimator;
+    OnePoleLowPass velocity_filter;
+
+    Cascade(PID::Params pos_params, PID::Params vel_params)
+        : pos_pid(pos_params, kDt),
+          vel_pid(vel_params, kDt),
+          velocity_estimator({.rad_per_count = ArmSim::kDefaults.rad_per_count,
+                              .min_window_us = 500,
+                              .timeout_us = 100000}),
+          velocity_filter(40, 1000) {}
+
+    void update(float pos, float vel) {
+        float position = arm.get_count() * ArmSim::kDefaults.rad_per_count;
+        float velocity =
+            velocity_filter.update(velocity_estimator.update(arm.get_count(), arm.get_edge_us(), arm.now_us()));
+
+        float vel_cmd = pos_pid.update(pos, position, vel);
+        arm.run(vel_pid.update(vel_cmd, velocity), 1000);
+    }
+};
+
+// A stroke like the ventilator's, .6 rad out and back in 2 s
+static void stroke(float t, float *pos, float *vel) {
+    float w = (float)M_PI;
+    *pos = .3f * (1 - cosf(w * t));
+    *vel = .3f * w * sinf(w * t);
+}
+
+// Worst and RMS position error over a few strokes, after the first to let the integrators settle
+static void track(PID::Params pos_params, float *max_err, float *rms_err) {
+    Cascade c(pos_params, kVelParams);
+    float sum_sq = 0;
+    int n = 0;
+    *max_err = 0;
+    for (int k = 0; k < 8000; k++) {
+        float pos, vel;
+        stroke(k * kDt, &pos, &vel);
+        c.update(pos, vel);
+
+        float err = fabsf(pos - c.arm.get_position());
+        if (k >= 2000) {
+            *max_err = fmaxf(*max_err, err);
+            sum_sq += err * err;
+            n++;
+        }
+    }
+    *rms_err = sqrtf(sum_sq / n);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_tracks_stroke() {
+    float max_err, rms_err;
+    track(kPosParams, &max_err, &rms_err);
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "stroke tracking error: max %.4f rad, rms %.4f rad", (double)max_err, (double)rms_err);
+    TEST_MESSAGE(msg);
+
+    TEST_ASSERT_LESS_THAN_FLOAT(.01f, max_err);
+    TEST_ASSERT_LESS_THAN_FLOAT(.005f, rms_err);
+}
+
+void test_feed_forward_reduces_lag() {
+    float max_ff, rms_ff;
+    track(kPosParams, &max_ff, &rms_ff);
+
+    PID::Params no_ff = kPosParams;
+    no_ff.Kff_vel = 0;
+    float max_fb, rms_fb;
+    track(no_ff, &max_fb, &rms_fb);
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "without feed-forward: max %.4f rad, rms %.4f rad", (double)max_fb, (double)rms_fb);
+    TEST_MESSAGE(msg);
+
+    TEST_ASSERT_LESS_THAN_FLOAT(rms_fb / 3, rms_ff);
+}
+
+void test_integrator_holds_while_saturated() {
+    PID pid(kVelParams, kDt);
+
+    // Stalled against a target it can't reach, the output pinned at the limit for a second
+    for (int k = 0; k < 1000; k++) {
+        TEST_ASSERT_EQUAL_FLOAT(4, pid.update(10, 0));
+    }
+
+    // Just past the target the output comes straight off the limit instead of unwinding a second of integral
+    float out = pid.update(10, 10.1f);
+    TEST_ASSERT_LESS_THAN_FLOAT(0, out);
+}
+
+void test_integrator_unwinds_off_the_limit() {
+    PID pid(kVelParams, kDt);
+
+    // Small enough error not to saturate, the integrator does its job
+    for (int k = 0; k < 1000; k++) {
+        pid.update(.05f, 0);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(.01f, 8 * .05f + 40 * .05f, pid.update(.05f, 0));
+}
+
+void test_setpoint_step_has_no_derivative_kick() {
+    PID::Params params = kVelParams;
+    params.Ki = 0;
+    params.Kd = .5f;
+    params.d_filter_hz = 100;
+    params.output_limits = {-INFINITY, INFINITY};
+    PID pid(params, kDt);
+
+    pid.update(0, 0);
+    TEST_ASSERT_EQUAL_FLOAT(8 * 1, pid.update(1, 0));
+}
+
+void test_derivative_filter_cutoff() {
+    PID::Params params = kVelParams;
+    params.Kp = 0;
+    params.Ki = 0;
+    params.Kd = 1;
+    params.d_filter_hz = 10;
+    params.output_limits = {-INFINITY, INFINITY};
+    PID pid(params, kDt);
+
+    // A measurement ramp of 1/s, the derivative settles to -1 with the time constant of the cutoff
+    pid.update(0, 0);
+    float tau = 1 / (2 * (float)M_PI * params.d_filter_hz);
+    float alpha = kDt / (tau + kDt);
+    int n = (int)(tau / kDt);
+    float out = 0;
+    for (int k = 1; k <= n; k++) {
+        out = pid.update(0, k * kDt);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(1e-3f, -(1 - powf(1 - alpha, n)), out);
+
+    for (int k = n + 1; k <= 20 * n; k++) {
+        out = pid.update(0, k * kDt);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(.001f, -1, out);
+}
+
+void test_gain_change_is_bumpless() {
+    PID pid(kVelParams, kDt);
+    for (int k = 0; k < 100; k++) {
+        pid.update(.1f, 0);
+    }
+    float before = pid.update(.1f, 0);
+
+    PID::Params params = kVelParams;
+    params.Ki = 400;
+    pid.set_params(params);
+
+    // Only one step of the new integral gain, the accumulated integral carries over as is
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, before + 400 * kDt * .1f, pid.update(.1f, 0));
+}
+
+void test_update_cost() {
+    PID pid(kVelParams, kDt);
+    volatile float meas = 0;
+    volatile float out;
+
+    constexpr int N = 1000000;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < N; k++) {
+        out = pid.update(1, meas, .5f, .1f);
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / N;
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "update(): %.1f ns on the host", ns);
+    TEST_MESSAGE(msg);
+
+    // A handful of multiply-adds, nowhere near a microsecond even unoptimized
+    TEST_ASSERT_LESS_THAN_FLOAT(1000, (float)ns);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_tracks_stroke);
+    RUN_TEST(test_feed_forward_reduces_lag);
+    RUN_TEST(test_integrator_holds_while_saturated);
+    RUN_TEST(test_integrator_unwinds_off_the_limit);
+    RUN_TEST(test_setpoint_step_has_no_derivative_kick);
+    RUN_TEST(test_derivative_filter_cutoff);
+    RUN_TEST(test_gain_change_is_bumpless);
+    RUN_TEST(test_update_cost);
+    return UNITY_END();
+}
@@ -0,0 +1,245 @@
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include <random>
+
+#include "pressure_auto_zero.h"
+#include "sim_clock.h"
+
+// abvm.cpp's
+static PressureAutoZero::Parameters const kParams = {.settle_ms = 1000,
+                                                     .max_capture_spread = .5f,
+                                                     .max_capture_trend = .1f,
+                                                     .max_zero = 10,
+                                                     .drift_gain = .02f,
+                                                     .drift_step = 1,
+                                                     .max_drift = 2,
+                                                     .store_threshold = .25f};
+
+static constexpr uint64_t kSensorPeriodUs = 12500;  // The ADS1231 at 80 SPS
+static constexpr float kOffset = 2.3f;              // cmH2O, the bridge's
+
+static std::mt19937 rng;
+static float zero;
+static uint64_t now_us;
+
+// From the start of the settling to the last sample of the capture
+static constexpr uint64_t kCaptureUs = 1000000 + (PressureAutoZero::NUM_CAPTURE_SAMPLES - 1) * kSensorPeriodUs;
+
+static float noise(float amplitude) {
+    return std::uniform_real_distribution<float>(-amplitude, amplitude)(rng);
+}
+
+// The next sample of a raw reading, with the zero taken off as the ADS1231 does
+static void feed(PressureAutoZero &az, float raw) {
+    now_us += kSensorPeriodUs;
+    sim_clock_set_us(now_us);
+    az.on_sample({.time_us = now_us, .value = raw - zero, .is_saturated = false});
+}
+
+void setUp() {
+    rng.seed(1);
+    zero = 0;
+    now_us = 1000000;
+    sim_clock_set_us(now_us);
+}
+
+void tearDown() {}
+
+// Every 11th reading a spike, the median doesn't follow them
+void test_capture_ignores_outliers() {
+    PressureAutoZero az(kParams, &zero);
+    az.start_capture();
+    for (uint32_t k = 0; az.is_capturing() && k < 1000; k++) {
+        feed(az, kOffset + noise(.05f) + (k % 11 == 0 ? 20 : 0));
+    }
+
+    TEST_ASSERT_FALSE(az.is_capturing());
+    TEST_ASSERT_EQUAL_UINT16(1, az.get_num_captures());
+    TEST_ASSERT_FLOAT_WITHIN(.03f, kOffset, zero);
+    TEST_ASSERT_TRUE(az.take_store_request());
+    TEST_ASSERT_FALSE(az.take_store_request());
+    PressureAutoZero::on_stored(true, &az);
+    TEST_ASSERT_FALSE(az.take_store_request());
+}
+
+// Expirations a cmH2O over the reference, the zero moves drift_gain of it each one
+static void drift(PressureAutoZero &az, uint32_t breaths) {
+    for (uint32_t breath = 0; breath < breaths; breath++) {
+        az.on_expiration_plateau(6);
+    }
+}
+
+// A store that fails or is never started is asked for again. One that succeeds with the zero moved on since it
+// started is asked for again too.
+void test_store_request_stays_until_stored() {
+    zero = kOffset;
+    PressureAutoZero az(kParams, &zero);
+    az.reset();
+    az.on_expiration_plateau(5);
+    drift(az, 20);
+    TEST_ASSERT_TRUE(az.take_store_request());
+    PressureAutoZero::on_stored(false, &az);
+
+    TEST_ASSERT_TRUE(az.take_store_request());
+    drift(az, 20);
+    PressureAutoZero::on_stored(true, &az);
+
+    TEST_ASSERT_TRUE(az.take_store_request());
+    PressureAutoZero::on_stored(true, &az);
+    TEST_ASSERT_FALSE(az.take_store_request());
+}
+
+// The settling starts when the capture does, samples still queued from before it don't count towards it
+void test_capture_settles_first() {
+    PressureAutoZero az(kParams, &zero);
+    uint64_t queued_us = now_us;
+    now_us += 200000;
+    sim_clock_set_us(now_us);
+    az.start_capture();
+    for (uint32_t k = 0; k < 16; k++) {
+        az.on_sample({.time_us = queued_us + k * kSensorPeriodUs, .value = 20, .is_saturated = false});
+    }
+
+    uint64_t start_us = now_us;
+    while (az.is_capturing() && now_us - start_us < 10000000) {
+        bool is_settling = now_us - start_us < kParams.settle_ms * 1000;
+        feed(az, kOffset + (is_settling ? 20 : 0));
+    }
+
+    TEST_ASSERT_EQUAL_UINT16(1, az.get_num_captures());
+    TEST_ASSERT_FLOAT_WITHIN(.001f, kOffset, zero);
+    TEST_ASSERT_EQUAL_UINT64(kCaptureUs, now_us - start_us);
+}
+
+// A sample lost or a clock stepped back while settling or capturing starts the settling over. Without it, the step
+// back would have had the capture take the readings of the circuit still emptying.
+void test_out_of_step_samples_settle_again() {
+    int64_t steps[] = {-(int64_t)kParams.settle_ms * 1000, 300000};
+    for (int64_t step : steps) {
+        PressureAutoZero az(kParams, &zero);
+        az.start_capture();
+        for (uint32_t k = 0; k < 60; k++) {
+            feed(az, kOffset);
+        }
+
+        now_us += step;
+        uint64_t restart_us = now_us + kSensorPeriodUs;
+        for (uint32_t k = 0; az.is_capturing() && k < 1000; k++) {
+            feed(az, kOffset + (k < 40 ? 20 : 0));
+        }
+
+        TEST_ASSERT_FLOAT_WITHIN(.001f, kOffset, zero);
+        TEST_ASSERT_EQUAL_UINT64(kCaptureUs, now_us - restart_us);
+        zero = 0;
+    }
+}
+
+// The last exhalation still leaving the circuit, still a fraction of a cmH2O once settle_ms is up. The capture sees
+// it die away and waits until it has.
+void test_capture_while_flowing() {
+    PressureAutoZero az(kParams, &zero);
+    az.start_capture();
+    for (uint32_t k = 0; az.is_capturing() && k < 1000; k++) {
+        feed(az, kOffset + 4 * expf(-(k * kSensorPeriodUs * 1e-6f) / .6f) + noise(.05f));
+    }
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "flowing: %u captured, %u failed, zero %.3f", (unsigned)az.get_num_captures(),
+             (unsigned)az.get_num_failed_captures(), (double)zero);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_EQUAL_UINT16(1, az.get_num_captures());
+    TEST_ASSERT_GREATER_THAN_UINT32(0, az.get_num_failed_captures());
+    TEST_ASSERT_FLOAT_WITHIN(.1f, kOffset, zero);
+}
+
+// Noise may look like a trend first and have it settle again, but the capture doesn't end with a zero
+void test_rejects_noisy_or_implausible_captures() {
+    struct {
+        float offset;
+        float noise;
+    } captures[] = {{kOffset, 1}, {12, .05f}, {-12, .05f}};
+
+    for (auto const &c : captures) {
+        PressureAutoZero az(kParams, &zero);
+        az.start_capture();
+        for (uint32_t k = 0; az.is_capturing() && k < 1000; k++) {
+            feed(az, c.offset + noise(c.noise));
+        }
+        TEST_ASSERT_FALSE(az.is_capturing());
+        TEST_ASSERT_EQUAL_UINT16(0, az.get_num_captures());
+        TEST_ASSERT_GREATER_THAN_UINT32(0, az.get_num_failed_captures());
+        TEST_ASSERT_EQUAL_FLOAT(0, zero);
+        TEST_ASSERT_FALSE(az.take_store_request());
+    }
+}
+
+void test_cancelled_capture_leaves_the_zero() {
+    PressureAutoZero az(kParams, &zero);
+    az.start_capture();
+    for (uint32_t k = 0; k < 40; k++) {
+        feed(az, kOffset);
+    }
+    az.cancel_capture();
+    for (uint32_t k = 0; k < 1000; k++) {
+        feed(az, kOffset);
+    }
+    TEST_ASSERT_EQUAL_UINT16(0, az.get_num_captures() + az.get_num_failed_captures());
+    TEST_ASSERT_EQUAL_FLOAT(0, zero);
+}
+
+// 1.5 cmH2O of drift over 1500 breaths, with the PEEP valve turned from 5 to 8 cmH2O half way. The zero follows the
+// drift but not the PEEP, a little behind, and the EEPROM is written once every store_threshold of it. The new
+// reference is taken with the zero as far behind as it was then.
+void test_tracks_drift() {
+    zero = kOffset;
+    PressureAutoZero az(kParams, &zero);
+    az.reset();
+
+    float worst_error = 0;
+    uint32_t num_stores = 0;
+    for (uint32_t breath = 0; breath < 2000; breath++) {
+        float drift = 1.5f * fminf(breath, 1500) / 1500;
+        float peep = breath < 700 ? 5 : 8;
+        az.on_expiration_plateau(peep + kOffset + drift - zero + noise(.1f));
+        worst_error = fmaxf(worst_error, fabsf(kOffset + drift - zero));
+        if (az.take_store_request()) {
+            PressureAutoZero::on_stored(true, &az);
+            num_stores++;
+        }
+    }
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "drift: worst error %.3f cmH2O, %u stores", (double)worst_error, (unsigned)num_stores);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_THAN_FLOAT(.2f, worst_error);
+    TEST_ASSERT_FLOAT_WITHIN(.15f, kOffset + 1.5f, zero);
+    TEST_ASSERT_TRUE(num_stores >= 4 && num_stores <= 8);
+}
+
+// However far the expirations wander, the zero stays within max_drift of the last capture
+void test_drift_is_limited() {
+    zero = kOffset;
+    PressureAutoZero az(kParams, &zero);
+    az.reset();
+    for (uint32_t breath = 0; breath < 2000; breath++) {
+        float drift = 5.f * breath / 2000;
+        az.on_expiration_plateau(5 + kOffset + drift - zero);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(.001f, kOffset + kParams.max_drift, zero);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_capture_ignores_outliers);
+    RUN_TEST(test_store_request_stays_until_stored);
+    RUN_TEST(test_capture_settles_first);
+    RUN_TEST(test_out_of_step_samples_settle_again);
+    RUN_TEST(test_capture_while_flowing);
+    RUN_TEST(test_rejects_noisy_or_implausible_captures);
+    RUN_TEST(test_cancelled_capture_leaves_the_zero);
+    RUN_TEST(test_tracks_drift);
+    RUN_TEST(test_drift_is_limited);
+    return UNITY_END();
+}
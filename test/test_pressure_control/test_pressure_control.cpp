@@ -0,0 +1,241 @@
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include <random>
+
+#include "config.h"
+#include "controls/trapezoidal_planner.h"
+#include "motor_sim.h"
+#include "sim_clock.h"
+#include "ventilator_controller.h"
+
+// The bag on the bench: squeezed by the arm past the open position, refilled through its intake valve
+static constexpr float kBagVolumePerDeg = 12;  // mL
+static constexpr float kBagCompliance = 3;     // mL/cmH2O
+
+static constexpr float kSensorPeriodMs = 12.5f;  // The ADS1231 at 80 SPS
+static constexpr float kSensorNoise = .1f;       // cmH2O, uniform
+
+static constexpr uint32_t kStepUs = 100;
+
+// abvm.cpp runs the controller once more than 10 ms have passed, the rest of the main loop holds it up a little more
+static constexpr uint32_t kVentPeriodMs = 11;
+static constexpr uint32_t kVentJitterMs = 2;
+
+// The bag driving a single compartment lung through the airway. The exhalation goes out to the room through the same
+// resistance.
+struct Patient {
+    float compliance;  // mL/cmH2O
+    float resistance;  // cmH2O / (mL/s)
+
+    float bag_out = 0;      // mL pushed out of the bag since it last refilled
+    float lung_volume = 0;  // mL above the end expiratory volume
+    float bag_pressure = 0;
+
+    void run(float arm_deg, float dt) {
+        float displaced = kBagVolumePerDeg * fmaxf(arm_deg - kVentMotionConfig.open_pos_deg, 0);
+        bag_pressure = (displaced - bag_out) / kBagCompliance;
+        if (bag_pressure < 0) {
+            bag_out = displaced;
+            bag_pressure = 0;
+        }
+
+        float lung_pressure = lung_volume / compliance;
+        if (bag_pressure > lung_pressure) {
+            float flow = (bag_pressure - lung_pressure) / resistance;
+            bag_out += flow * dt;
+            lung_volume += flow * dt;
+        } else {
+            lung_volume -= lung_pressure / resistance * dt;
+        }
+    }
+};
+
+struct PressureSensor : ISensor {
+    float value = 0;
+
+    float read() override {
+        return value;
+    }
+
+    bool read_sample(Sample *sample) override {
+        (void)sample;
+        return false;
+    }
+};
+
+// Of the last breath of a run, from the true bag pressure
+struct BreathResult {
+    float rise_ms;        // 10 to 90% of the step from the end expiratory pressure to the target
+    float overshoot;      // cmH2O over the target
+    float plateau_error;  // cmH2O, mean absolute error once 700 ms into the breath
+    float tidal_volume;   // mL
+    float peak_arm_deg;
+    float end_arm_deg;  // Where inspiration left the arm
+};
+
+// 14 bpm at the largest tidal volume position, which in pressure mode is only the arm's limit. The servo runs every
+// 1 ms, the controller every 11 to 13 ms.
+static BreathResult run_breaths(float compliance, float resistance_cmH2O_per_L_s) {
+    Patient patient = {.compliance = compliance, .resistance = resistance_cmH2O_per_L_s / 1000};
+    PressureSensor sensor;
+    MotorSim motor_sim;
+    Servo motor(1, &motor_sim.driver, &motor_sim.encoder, &motor_sim.limit_switch, kMotorConfig.motor_params, kMotorConfig.motor_vel_pid_params,
+                kMotorConfig.motor_vel_limits, kMotorConfig.motor_pos_pid_params, kMotorConfig.motor_pos_limits,
+                kMotorCurrentConfig.motor_cur_pid_params);
+    TrapezoidalPlanner planner({.4f, .4f});
+    VentilatorController vent(&planner, &motor, &sensor, kVentTVSettings, 6, kVentRateSettings, 6);
+    vent.bump_tv(5);
+    vent.bump_rate(3);
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> noise(-kSensorNoise, kSensorNoise);
+    std::uniform_int_distribution<uint32_t> jitter(0, kVentJitterMs);
+    float target = kVentPressureConfig.target_pressure_cmH2O;
+
+    sim_clock_set_us(1000000);
+    motor.init();
+    vent.start();
+
+    BreathResult result = {};
+    BreathResult breath = {};
+    uint32_t breath_start_us = 0;
+    float start_pressure = 0;
+    float t10 = -1;
+    float t90 = -1;
+    double error_sum = 0;
+    uint32_t error_count = 0;
+    uint32_t last_tag = 0;
+    float next_sample_ms = 0;
+    uint32_t next_vent_ms = kVentPeriodMs;
+
+    for (uint32_t t_us = 0; t_us < 30000000; t_us += kStepUs) {
+        patient.run(rad_to_deg(motor.position), kStepUs * 1e-6f);
+        motor_sim.run(kStepUs);
+
+        if ((t_us + kStepUs) % 1000 != 0) {
+            continue;
+        }
+        float ms = (t_us + kStepUs) / 1000.f;
+        if (ms >= next_sample_ms) {
+            sensor.value = patient.bag_pressure + noise(rng);
+            next_sample_ms += kSensorPeriodMs;
+        }
+        motor.update();
+        if (ms >= next_vent_ms) {
+            vent.update();
+            next_vent_ms = (uint32_t)ms + kVentPeriodMs + jitter(rng);
+        }
+
+        uint32_t tag = planner.is_idle() ? 0 : planner.get_tag();
+        bool is_inspiring = tag == (uint32_t)VentilatorController::State::INSPIRATION ||
+                            tag == (uint32_t)VentilatorController::State::INSPIRATORY_HOLD;
+        if (tag == (uint32_t)VentilatorController::State::INSPIRATION && tag != last_tag) {
+            if (t90 >= 0) {
+                breath.rise_ms = t90 - t10;
+                breath.plateau_error = (float)(error_sum / error_count);
+                result = breath;
+            }
+            breath = {};
+            breath_start_us = t_us;
+            start_pressure = patient.bag_pressure;
+            t10 = t90 = -1;
+            error_sum = 0;
+            error_count = 0;
+        }
+        last_tag = tag;
+
+        if (is_inspiring) {
+            float t = (t_us - breath_start_us) / 1000.f;
+            float p = patient.bag_pressure;
+            if (t10 < 0 && p >= start_pressure + .1f * (target - start_pressure)) {
+                t10 = t;
+            }
+            if (t90 < 0 && p >= start_pressure + .9f * (target - start_pressure)) {
+                t90 = t;
+            }
+            if (t > 700) {
+                error_sum += (double)fabsf(p - target);
+                error_count++;
+            }
+            breath.overshoot = fmaxf(breath.overshoot, p - target);
+            breath.tidal_volume = fmaxf(breath.tidal_volume, patient.lung_volume);
+            breath.peak_arm_deg = fmaxf(breath.peak_arm_deg, rad_to_deg(motor.position));
+            breath.end_arm_deg = rad_to_deg(motor.position);
+        }
+    }
+    return result;
+}
+
+static void report(float compliance, float resistance, BreathResult const &r) {
+    char msg[192];
+    snprintf(msg, sizeof(msg),
+             "C %.0f mL/cmH2O, R %.0f cmH2O/L/s: rise %.0f ms, overshoot %.2f cmH2O, plateau error %.2f cmH2O, "
+             "%.0f mL, arm peak %.1f deg",
+             (double)compliance, (double)resistance, (double)r.rise_ms, (double)r.overshoot, (double)r.plateau_error,
+             (double)r.tidal_volume, (double)r.peak_arm_deg);
+    TEST_MESSAGE(msg);
+}
+
+void setUp() {
+    kVentPressureConfig.mode = VentMode::PRESSURE;
+    kVentPressureConfig.target_pressure_cmH2O = 15;
+}
+
+void tearDown() {}
+
+void test_holds_the_target_pressure() {
+    struct {
+        float compliance;
+        float resistance;
+    } lungs[] = {{15, 20}, {30, 20}, {50, 20}, {30, 50}};
+
+    for (auto const &lung : lungs) {
+        BreathResult r = run_breaths(lung.compliance, lung.resistance);
+        report(lung.compliance, lung.resistance, r);
+
+        TEST_ASSERT_LESS_THAN_FLOAT(kVentPressureConfig.rise_time_ms, r.rise_ms);
+        TEST_ASSERT_LESS_THAN_FLOAT(2, r.overshoot);
+        TEST_ASSERT_LESS_THAN_FLOAT(1, r.plateau_error);
+        // Still short of the tidal volume position, the pressure stopped the arm
+        TEST_ASSERT_LESS_THAN_FLOAT(kVentTVSettings[5] - 1, r.peak_arm_deg);
+    }
+}
+
+// Little airway resistance lets the bag empty as fast as the arm can squeeze it. The arm is at its speed limit and the
+// rise is slower and overshoots further, but the pressure still settles.
+void test_low_resistance_is_speed_limited() {
+    BreathResult r = run_breaths(30, 5);
+    report(30, 5, r);
+    TEST_ASSERT_LESS_THAN_FLOAT(500, r.rise_ms);
+    TEST_ASSERT_LESS_THAN_FLOAT(5, r.overshoot);
+    TEST_ASSERT_LESS_THAN_FLOAT(2, r.plateau_error);
+}
+
+// The tidal volume position is the limit, a target the lungs can't reach at that volume holds the arm there. It gets
+// there at full speed and the servo carries it a few degrees past before it stops.
+void test_stops_at_the_tidal_volume_position() {
+    kVentPressureConfig.target_pressure_cmH2O = 35;
+    BreathResult r = run_breaths(100, 20);
+    report(100, 20, r);
+    TEST_ASSERT_FLOAT_WITHIN(.5f, kVentTVSettings[5], r.end_arm_deg);
+    TEST_ASSERT_LESS_THAN_FLOAT(kVentTVSettings[5] + 5, r.peak_arm_deg);
+}
+
+// Volume mode still drives the arm to the tidal volume position, whatever the pressure
+void test_volume_mode_is_unchanged() {
+    kVentPressureConfig.mode = VentMode::VOLUME;
+    BreathResult r = run_breaths(50, 20);
+    report(50, 20, r);
+    TEST_ASSERT_FLOAT_WITHIN(.5f, kVentTVSettings[5], r.end_arm_deg);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_holds_the_target_pressure);
+    RUN_TEST(test_low_resistance_is_speed_limited);
+    RUN_TEST(test_stops_at_the_tidal_volume_position);
+    RUN_TEST(test_volume_mode_is_unchanged);
+    return UNITY_END();
+}
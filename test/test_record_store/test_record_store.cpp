@@ -0,0 +1,505 @@
+#include <string.h>
+#include <unistd.h>
+#include <unity.h>
+
+#include "config.h"
+#include "crc16.h"
+#include "eeprom_sim.h"
+#include "record_store.h"
+
+static constexpr const char *kEEPROMPath = "test_record_store.bin";
+static constexpr uint16_t kMaxSize = 54;
+
+static EEPROMSim eeprom;
+
+struct Record {
+    uint32_t count;
+    float values[10];
+};
+
+static Record record;
+static Record other;
+
+static Record const kDefaults = {7, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10}};
+static Record const kOld = {100, {-1, -2, -3, -4, -5, -6, -7, -8, -9, -10}};
+static Record const kNew = {200, {.5, .5, .5, .5, .5, .5, .5, .5, .5, .5}};
+
+// What the firmware does at boot, on a fresh RecordStore like the one in RAM after a reset
+static bool boot(RecordStore *store) {
+    record = kDefaults;
+    other = kDefaults;
+
+    store->init();
+    store->add_entry("Record", &record, sizeof(record), kMaxSize, 1);
+    store->add_entry("Other", &other, sizeof(other), kMaxSize, 1);
+    store->add_legacy_entry("Record", sizeof(record));
+    store->add_legacy_entry("Other", sizeof(other));
+    return store->first_load();
+}
+
+static bool is_equal(Record const &a, Record const &b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static void run_async() {
+    while (eeprom.is_busy()) {
+        eeprom.update();
+    }
+}
+
+// The first store layout, VERSION_NUM 1: the data then its CRC, each on the next block
+static void write_legacy(uint16_t *addr, void const *data, uint16_t size) {
+    uint8_t buf[RecordStore::MAX_BUFFER_SIZE_BYTES + 2];
+    memcpy(buf, data, size);
+    uint16_t crc = CRC16::calc(buf, size);
+    memcpy(&buf[size], &crc, sizeof(crc));
+
+    TEST_ASSERT_TRUE(eeprom.write(*addr, buf, size + sizeof(crc)));
+    *addr += size + sizeof(crc) + (32 - (size + sizeof(crc)) % 32);
+}
+
+static void write_legacy_layout(Record const &value) {
+    struct {
+        uint32_t magic_num;
+        uint32_t version;
+    } header = {0x4142564D, 1};
+
+    uint16_t addr = 0;
+    write_legacy(&addr, &header, sizeof(header));
+    write_legacy(&addr, &value, sizeof(value));
+    write_legacy(&addr, &value, sizeof(value));
+}
+
+void setUp() {
+    unlink(kEEPROMPath);
+    TEST_ASSERT_TRUE(eeprom.open(kEEPROMPath));
+    eeprom.clear_faults();
+    eeprom.power_cycle();
+    eeprom.reset_counters();
+}
+
+void tearDown() {
+    eeprom.close();
+    unlink(kEEPROMPath);
+}
+
+void test_blank_eeprom_gets_defaults() {
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+    TEST_ASSERT_EQUAL_MEMORY(&kDefaults, &record, sizeof(record));
+
+    eeprom.power_cycle();
+    RecordStore next(&eeprom);
+    TEST_ASSERT_TRUE(boot(&next));
+    TEST_ASSERT_EQUAL_MEMORY(&kDefaults, &record, sizeof(record));
+}
+
+void test_round_trip() {
+    {
+        RecordStore store(&eeprom);
+        TEST_ASSERT_TRUE(boot(&store));
+        record.count = 42;
+        record.values[9] = -1.5f;
+        other.count = 3;
+        TEST_ASSERT_TRUE(store.store_all());
+    }
+
+    eeprom.power_cycle();
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+    TEST_ASSERT_EQUAL_UINT32(42, record.count);
+    TEST_ASSERT_EQUAL_FLOAT(-1.5f, record.values[9]);
+    TEST_ASSERT_EQUAL_UINT32(3, other.count);
+}
+
+void test_unchanged_entries_are_skipped() {
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+
+    uint32_t writes = eeprom.total_page_writes();
+    TEST_ASSERT_TRUE(store.store_all());
+    TEST_ASSERT_EQUAL_UINT32(writes, eeprom.total_page_writes());
+    TEST_ASSERT_EQUAL_UINT16(0, store.get_stats()->pages_written);
+
+    // Only the entry that changed goes out
+    other.count++;
+    TEST_ASSERT_TRUE(store.store_all());
+    TEST_ASSERT_EQUAL_UINT16(2, store.get_stats()->pages_written);
+    TEST_ASSERT_EQUAL_UINT32(writes + 2, eeprom.total_page_writes());
+}
+
+void test_async_store_does_not_block() {
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+    uint64_t blocked_us = eeprom.blocking_us();
+
+    static bool is_done = false;
+    static bool is_success = false;
+    auto on_done = [](bool success, void *) {
+        is_done = true;
+        is_success = success;
+    };
+
+    record.count = 99;
+    TEST_ASSERT_TRUE(store.store_all_async(on_done));
+    TEST_ASSERT_TRUE(store.is_busy());
+
+    // The live struct may change once the store has started, the snapshot is what gets written
+    record.count = 100;
+    run_async();
+
+    TEST_ASSERT_TRUE(is_done);
+    TEST_ASSERT_TRUE(is_success);
+    TEST_ASSERT_FALSE(store.is_busy());
+    TEST_ASSERT_EQUAL_UINT64(blocked_us, eeprom.blocking_us());
+
+    eeprom.power_cycle();
+    RecordStore next(&eeprom);
+    TEST_ASSERT_TRUE(boot(&next));
+    TEST_ASSERT_EQUAL_UINT32(99, record.count);
+}
+// Only the entry asked for, the other one's unsaved change stays unsaved
+void test_async_store_of_one_entry() {
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+
+    static bool is_success = false;
+    auto on_done = [](bool success, void *) { is_success = success; };
+
+    record.count = 5;
+    other.count = 6;
+    TEST_ASSERT_FALSE(store.store_async("Missing", on_done));
+    TEST_ASSERT_TRUE(store.store_async("Other", on_done));
+    TEST_ASSERT_FALSE(store.store_async("Record", on_done));
+    run_async();
+    TEST_ASSERT_TRUE(is_success);
+    TEST_ASSERT_EQUAL_UINT16(2, store.get_stats()->pages_written);
+
+    eeprom.power_cycle();
+    RecordStore next(&eeprom);
+    TEST_ASSERT_TRUE(boot(&next));
+    TEST_ASSERT_EQUAL_UINT32(kDefaults.count, record.count);
+    TEST_ASSERT_EQUAL_UINT32(6, other.count);
+}
+
+static uint32_t command_status(ConfigCommandRPC *cmd) {
+    uint32_t status = 0;
+    cmd->read(&status, sizeof(status));
+    return status;
+}
+
+// The USB interrupt only takes the command, the store isn't touched until the main loop gets to it
+void test_config_command_runs_from_the_main_loop() {
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+    ConfigCommandRPC cmd(0x64, &store);
+
+    record.count = 42;
+    uint32_t save = 0x45564153;  // "SAVE"
+    TEST_ASSERT_EQUAL_UINT8(0, cmd.write(&save, sizeof(save)));
+    TEST_ASSERT_EQUAL_UINT32(1, command_status(&cmd));  // BUSY
+    TEST_ASSERT_FALSE(store.is_busy());
+
+    // One at a time
+    TEST_ASSERT_TRUE(cmd.write(&save, sizeof(save)) != 0);
+
+    cmd.update();
+    TEST_ASSERT_TRUE(store.is_busy());
+    run_async();
+    TEST_ASSERT_EQUAL_UINT32(0, command_status(&cmd));  // IDLE
+
+    // Nonsense is refused right away and leaves the status alone
+    uint32_t nonsense = 0x12345678;
+    TEST_ASSERT_TRUE(cmd.write(&nonsense, sizeof(nonsense)) != 0);
+    TEST_ASSERT_EQUAL_UINT32(0, command_status(&cmd));
+
+    eeprom.power_cycle();
+    RecordStore next(&eeprom);
+    TEST_ASSERT_TRUE(boot(&next));
+    TEST_ASSERT_EQUAL_UINT32(42, record.count);
+}
+
+void test_slots_spread_the_wear() {
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+    eeprom.reset_counters();
+
+    for (uint32_t i = 0; i < 80; i++) {
+        record.count = i;
+        TEST_ASSERT_TRUE(store.store_all());
+    }
+
+    // 80 stores of a 2 page record rotate through 8 slots
+    TEST_ASSERT_EQUAL_UINT32(160, eeprom.total_page_writes());
+    TEST_ASSERT_EQUAL_UINT32(10, eeprom.max_page_writes());
+
+    eeprom.power_cycle();
+    RecordStore next(&eeprom);
+    TEST_ASSERT_TRUE(boot(&next));
+    TEST_ASSERT_EQUAL_UINT32(79, record.count);
+}
+
+void test_failed_write_keeps_the_last_version() {
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+    record.count = 1;
+    TEST_ASSERT_TRUE(store.store_all());
+
+    record.count = 2;
+    eeprom.inject_nack(0);
+    TEST_ASSERT_FALSE(store.store_all());
+
+    eeprom.power_cycle();
+    RecordStore next(&eeprom);
+    TEST_ASSERT_TRUE(boot(&next));
+    TEST_ASSERT_EQUAL_UINT32(1, record.count);
+}
+
+void test_corrupt_slot_falls_back() {
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+    record.count = 1;
+    TEST_ASSERT_TRUE(store.store_all());
+    record.count = 0x5A5AA5A5;
+    TEST_ASSERT_TRUE(store.store_all());
+
+    // Find the newest version by its contents and flip a bit in it
+    uint16_t addr = 0;
+    for (; addr < EEPROMSim::TOTAL_SIZE - sizeof(uint32_t); addr++) {
+        uint32_t x;
+        eeprom.read(addr, (uint8_t *)&x, sizeof(x));
+        if (x == record.count) break;
+    }
+    TEST_ASSERT_LESS_THAN(EEPROMSim::TOTAL_SIZE - sizeof(uint32_t), addr);
+    eeprom.inject_bit_flip(addr + 1, 3);
+
+    eeprom.power_cycle();
+    RecordStore next(&eeprom);
+    TEST_ASSERT_TRUE(boot(&next));
+    TEST_ASSERT_EQUAL_UINT32(1, record.count);
+}
+
+// Schema 2 added a field at the end
+struct RecordV2 {
+    uint32_t count;
+    float values[10];
+    uint32_t added;
+};
+
+static uint16_t migrate_v1(uint8_t *buf, uint16_t size) {
+    if (size != sizeof(Record)) return 0;
+
+    uint32_t added = 1234;
+    memcpy(&buf[sizeof(Record)], &added, sizeof(added));
+    return sizeof(RecordV2);
+}
+
+void test_migration_runs_once() {
+    {
+        RecordStore store(&eeprom);
+        TEST_ASSERT_TRUE(boot(&store));
+        record.count = 5;
+        TEST_ASSERT_TRUE(store.store_all());
+    }
+
+    RecordV2 upgraded = {};
+    for (int i = 0; i < 2; i++) {
+        eeprom.power_cycle();
+        eeprom.reset_counters();
+
+        RecordStore store(&eeprom);
+        store.init();
+        store.add_entry("Record", &upgraded, sizeof(upgraded), kMaxSize, 2);
+        store.add_entry("Other", &other, sizeof(other), kMaxSize, 1);
+        TEST_ASSERT_TRUE(store.add_migration("Record", 1, migrate_v1));
+        TEST_ASSERT_TRUE(store.first_load());
+
+        TEST_ASSERT_EQUAL_UINT32(5, upgraded.count);
+        TEST_ASSERT_EQUAL_UINT32(1234, upgraded.added);
+
+        // Written back in the new layout the first time, just read after that
+        TEST_ASSERT_EQUAL_UINT32(i == 0 ? 2 : 0, eeprom.total_page_writes());
+    }
+}
+
+void test_no_migration_keeps_defaults() {
+    {
+        RecordStore store(&eeprom);
+        TEST_ASSERT_TRUE(boot(&store));
+        record.count = 5;
+        other.count = 6;
+        TEST_ASSERT_TRUE(store.store_all());
+    }
+
+    eeprom.power_cycle();
+    RecordV2 upgraded = {};
+    RecordStore store(&eeprom);
+    store.init();
+    store.add_entry("Record", &upgraded, sizeof(upgraded), kMaxSize, 2);
+    store.add_entry("Other", &other, sizeof(other), kMaxSize, 1);
+    store.first_load();
+
+    // The other record isn't affected
+    TEST_ASSERT_EQUAL_UINT32(0, upgraded.count);
+    TEST_ASSERT_EQUAL_UINT32(6, other.count);
+}
+
+void test_legacy_layout_is_imported() {
+    write_legacy_layout(kOld);
+
+    {
+        RecordStore store(&eeprom);
+        TEST_ASSERT_TRUE(boot(&store));
+        TEST_ASSERT_TRUE(is_equal(kOld, record));
+        TEST_ASSERT_TRUE(is_equal(kOld, other));
+    }
+
+    // And it stays imported
+    eeprom.power_cycle();
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+    TEST_ASSERT_TRUE(is_equal(kOld, record));
+    TEST_ASSERT_TRUE(is_equal(kOld, other));
+}
+
+void test_corrupt_legacy_record_keeps_defaults() {
+    write_legacy_layout(kOld);
+    eeprom.inject_bit_flip(32 + 4, 0);
+
+    RecordStore store(&eeprom);
+    TEST_ASSERT_TRUE(boot(&store));
+    TEST_ASSERT_TRUE(is_equal(kDefaults, record));
+    TEST_ASSERT_TRUE(is_equal(kOld, other));
+}
+
+void test_legacy_layout_is_migrated() {
+    write_legacy_layout(kOld);
+
+    RecordV2 upgraded = {};
+    RecordStore store(&eeprom);
+    store.init();
+    store.add_entry("Record", &upgraded, sizeof(upgraded), kMaxSize, 2);
+    store.add_entry("Other", &other, sizeof(other), kMaxSize, 1);
+    store.add_migration("Record", 1, migrate_v1);
+    store.add_legacy_entry("Record", sizeof(Record));
+    store.add_legacy_entry("Other", sizeof(Record));
+    TEST_ASSERT_TRUE(store.first_load());
+
+    TEST_ASSERT_EQUAL_UINT32(kOld.count, upgraded.count);
+    TEST_ASSERT_EQUAL_UINT32(1234, upgraded.added);
+    TEST_ASSERT_TRUE(is_equal(kOld, other));
+}
+
+/**
+ * Power is lost after each byte of a store in turn. Wherever it happens, the next boot has to find each record either
+ * as it was or as it was being stored, never torn and never back to the defaults.
+ */
+static void check_power_loss_at_every_byte(bool is_async) {
+    for (uint32_t after_bytes = 0;; after_bytes++) {
+        tearDown();
+        setUp();
+
+        {
+            RecordStore store(&eeprom);
+            TEST_ASSERT_TRUE(boot(&store));
+            record = kOld;
+            other = kOld;
+            TEST_ASSERT_TRUE(store.store_all());
+
+            record = kNew;
+            other = kNew;
+            eeprom.inject_power_loss(after_bytes);
+            if (is_async) {
+                store.store_all_async();
+                run_async();
+            } else {
+                store.store_all();
+            }
+        }
+
+        bool is_complete = eeprom.is_powered();
+
+        eeprom.power_cycle();
+        RecordStore store(&eeprom);
+        TEST_ASSERT_TRUE(boot(&store));
+        TEST_ASSERT_TRUE(is_equal(kOld, record) || is_equal(kNew, record));
+        TEST_ASSERT_TRUE(is_equal(kOld, other) || is_equal(kNew, other));
+
+        if (is_complete) {
+            TEST_ASSERT_TRUE(is_equal(kNew, record));
+            TEST_ASSERT_TRUE(is_equal(kNew, other));
+            TEST_ASSERT_GREATER_THAN(2 * sizeof(Record), after_bytes);
+            break;
+        }
+    }
+}
+
+void test_power_loss_at_every_byte() {
+    check_power_loss_at_every_byte(false);
+}
+
+void test_power_loss_at_every_byte_async() {
+    check_power_loss_at_every_byte(true);
+}
+
+// Same for the first boot, which writes out the defaults, and for the import of the first layout
+static void check_power_loss_at_every_byte_of_first_load(bool is_legacy) {
+    Record const &expected = is_legacy ? kOld : kDefaults;
+
+    for (uint32_t after_bytes = 0;; after_bytes++) {
+        tearDown();
+        setUp();
+        if (is_legacy) {
+            write_legacy_layout(kOld);
+        }
+
+        {
+            eeprom.inject_power_loss(after_bytes);
+            RecordStore store(&eeprom);
+            boot(&store);
+        }
+
+        bool is_complete = eeprom.is_powered();
+
+        eeprom.power_cycle();
+        RecordStore store(&eeprom);
+        TEST_ASSERT_TRUE(boot(&store));
+        TEST_ASSERT_TRUE(is_equal(expected, record));
+        TEST_ASSERT_TRUE(is_equal(expected, other));
+
+        if (is_complete) {
+            break;
+        }
+    }
+}
+
+void test_power_loss_at_every_byte_of_first_load() {
+    check_power_loss_at_every_byte_of_first_load(false);
+}
+
+void test_power_loss_at_every_byte_of_import() {
+    check_power_loss_at_every_byte_of_first_load(true);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_blank_eeprom_gets_defaults);
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_unchanged_entries_are_skipped);
+    RUN_TEST(test_async_store_does_not_block);
+    RUN_TEST(test_async_store_of_one_entry);
+    RUN_TEST(test_config_command_runs_from_the_main_loop);
+    RUN_TEST(test_slots_spread_the_wear);
+    RUN_TEST(test_failed_write_keeps_the_last_version);
+    RUN_TEST(test_corrupt_slot_falls_back);
+    RUN_TEST(test_migration_runs_once);
+    RUN_TEST(test_no_migration_keeps_defaults);
+    RUN_TEST(test_legacy_layout_is_imported);
+    RUN_TEST(test_corrupt_legacy_record_keeps_defaults);
+    RUN_TEST(test_legacy_layout_is_migrated);
+    RUN_TEST(test_power_loss_at_every_byte);
+    RUN_TEST(test_power_loss_at_every_byte_async);
+    RUN_TEST(test_power_loss_at_every_byte_of_first_load);
+    RUN_TEST(test_power_loss_at_every_byte_of_import);
+    return UNITY_END();
+}
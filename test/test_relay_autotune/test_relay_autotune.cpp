@@ -0,0 +1,284 @@
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include "arm_sim.h"
+#include "controls/pid.h"
+#include "controls/relay_autotune.h"
+#include "controls/velocity_estimator.h"
+#include "math/filters.h"
+
+static constexpr float kDt = .001f;
+static constexpr float kDegToRad = (float)M_PI / 180;
+
+// AutotuneController's parameters from abvm.cpp
+static PID::Params const kCascadeVelParams = {.Kp = 8,
+                                              .Ki = 40,
+                                              .Kd = 0,
+                                              .Kff_vel = 0,
+                                              .Kff_acc = 0,
+                                              .d_filter_hz = 0,
+                                              .output_limits = {-4, 4}};
+static PID::Params const kPosParams = {.Kp = 14.5,
+                                       .Ki = .1,
+                                       .Kd = 0,
+                                       .Kff_vel = 1,
+                                       .Kff_acc = 0,
+                                       .d_filter_hz = 0,
+                                       .output_limits = {-25 * 0.104719755f, 25 * 0.104719755f}};
+static constexpr float kSpinUpVelocity = .8f;
+static constexpr uint32_t kSpinUpMs = 200;
+static RelayAutotune::Parameters const kVelocityRelay = {.amplitude = 2,
+                                                         .bias = 0,
+                                                         .hysteresis = .02f,
+                                                         .num_cycles = 6,
+                                                         .timeout_ms = 2000};
+static RelayAutotune::Parameters const kPositionRelay = {.amplitude = .5f,
+                                                         .bias = 0,
+                                                         .hysteresis = .005f,
+                                                         .num_cycles = 6,
+                                                         .timeout_ms = 5000};
+static constexpr float kPositionTarget = 20 * kDegToRad;
+
+// The bench arm, and one much weaker and one much stronger, e.g. a different gearbox or a stiff bag
+static ArmSim::Parameters const kNominal = ArmSim::kDefaults;
+static ArmSim::Parameters const kWeak = {.accel_per_amp = 2.5f,
+                                         .damping = .2f,
+                                         .friction = .5f,
+                                         .current_tau_s = .002f,
+                                         .rad_per_count = ArmSim::kDefaults.rad_per_count};
+static ArmSim::Parameters const kStrong = {.accel_per_amp = 12,
+                                           .damping = 1,
+                                           .friction = 1.5f,
+                                           .current_tau_s = .003f,
+                                           .rad_per_count = ArmSim::kDefaults.rad_per_count};
+
+// Servo::update() on the simulated arm: the measurement filters and the cascade, every 1 ms
+struct ServoSim {
+    ArmSim arm;
+    float rad_per_count;
+    PID pos_pid;
+    PID vel_pid;
+    MTVelocityEstimator velocity_estimator;
+    OnePoleLowPass position_filter;
+    OnePoleLowPass velocity_filter;
+    OnePoleLowPass commanded_vel_filter;
+
+    float position = 0;
+    float velocity = 0;
+    float command = 0;
+
+    ServoSim(ArmSim::Parameters plant, PID::Params vel_params, PID::Params pos_params)
+        : arm(plant),
+          rad_per_count(plant.rad_per_count),
+          pos_pid(pos_params, kDt),
+          vel_pid(vel_params, kDt),
+          velocity_estimator({.rad_per_count = plant.rad_per_count, .min_window_us = 500, .timeout_us = 100000}),
+          position_filter(16.8f, 1000),
+          velocity_filter(40, 1000),
+          commanded_vel_filter(366, 1000) {}
+
+    void run_current(float current) {
+        command = current;
+        arm.run(current, 1000);
+        position = position_filter.update(arm.get_count() * rad_per_count);
+        velocity = velocity_filter.update(velocity_estimator.update(arm.get_count(), arm.get_edge_us(), arm.now_us()));
+    }
+
+    void run_velocity(float target) {
+        run_current(vel_pid.update(commanded_vel_filter.update(target), velocity));
+    }
+
+    void run_position(float target) {
+        run_velocity(pos_pid.update(target, position));
+    }
+};
+
+struct AutotuneResult {
+    RelayAutotune::State state;
+    RelayAutotune::Result velocity;
+    RelayAutotune::Result position;
+    PID::Params vel_params;
+    PID::Params pos_params;
+    uint32_t duration_ms;
+    float min_position;  // rads
+    float max_position;
+};
+
+// The stages of AutotuneController in turn: spin up and measure the bias, relay the velocity loop, apply its gains and
+// relay the position loop
+static AutotuneResult autotune(ArmSim::Parameters plant) {
+    ServoSim s(plant, kCascadeVelParams, kPosParams);
+    AutotuneResult r = {};
+    r.min_position = INFINITY;
+    r.max_position = -INFINITY;
+    uint32_t t = 0;
+
+    auto step = [&](float position) {
+        r.min_position = fminf(r.min_position, position);
+        r.max_position = fmaxf(r.max_position, position);
+        t++;
+    };
+
+    float bias_sum = 0;
+    uint32_t bias_count = 0;
+    for (; t < kSpinUpMs;) {
+        s.run_velocity(kSpinUpVelocity);
+        if (t >= kSpinUpMs / 2) {
+            bias_sum += s.command;
+            bias_count++;
+        }
+        step(s.position);
+    }
+
+    RelayAutotune velocity_relay(kVelocityRelay);
+    velocity_relay.set_bias(bias_sum / bias_count);
+    velocity_relay.start(t);
+    while (velocity_relay.get_state() == RelayAutotune::State::RUNNING) {
+        s.run_current(velocity_relay.update(kSpinUpVelocity - s.velocity, t));
+        step(s.position);
+    }
+    r.state = velocity_relay.get_state();
+    if (r.state != RelayAutotune::State::DONE) {
+        return r;
+    }
+    r.velocity = velocity_relay.get_result();
+    r.vel_params = RelayAutotune::tune(RelayAutotune::Rule::TYREUS_LUYBEN_PI, r.velocity, kCascadeVelParams);
+    s.vel_pid.set_params(r.vel_params);
+
+    RelayAutotune position_relay(kPositionRelay);
+    position_relay.start(t);
+    while (position_relay.get_state() == RelayAutotune::State::RUNNING) {
+        s.run_velocity(position_relay.update(kPositionTarget - s.position, t));
+        step(s.position);
+    }
+    r.state = position_relay.get_state();
+    r.position = position_relay.get_result();
+    r.pos_params = RelayAutotune::tune(RelayAutotune::Rule::CONSERVATIVE_P, r.position, kPosParams);
+    r.duration_ms = t;
+    return r;
+}
+
+struct StepResult {
+    float vel_overshoot;  // %
+    float pos_overshoot;  // %
+    float pos_settle_ms;  // To within 2%
+};
+
+// A 1 rad/s velocity step and a .3 rad position step from rest
+static StepResult step_response(ArmSim::Parameters plant, PID::Params vel_params, PID::Params pos_params) {
+    StepResult r = {};
+
+    ServoSim v(plant, vel_params, pos_params);
+    float v_peak = 0;
+    for (int k = 0; k < 1000; k++) {
+        v.run_velocity(1);
+        v_peak = fmaxf(v_peak, v.velocity);
+    }
+    r.vel_overshoot = 100 * (v_peak - 1);
+
+    ServoSim p(plant, vel_params, pos_params);
+    float p_peak = 0;
+    for (int k = 0; k < 1500; k++) {
+        p.run_position(.3f);
+        p_peak = fmaxf(p_peak, p.position);
+        if (fabsf(.3f - p.position) > .006f) {
+            r.pos_settle_ms = k + 1;
+        }
+    }
+    r.pos_overshoot = 100 * (p_peak - .3f) / .3f;
+    return r;
+}
+
+static void report(const char *name, AutotuneResult const &a, StepResult const &tuned, StepResult const &fixed) {
+    char msg[160];
+    snprintf(msg, sizeof(msg), "%s: vel Ku %.2f Tu %.1f ms -> Kp %.2f Ki %.1f, pos Ku %.2f Tu %.1f ms -> Kp %.2f, %u ms",
+             name, (double)a.velocity.ultimate_gain, (double)(a.velocity.ultimate_period_s * 1000),
+             (double)a.vel_params.Kp, (double)a.vel_params.Ki, (double)a.position.ultimate_gain,
+             (double)(a.position.ultimate_period_s * 1000), (double)a.pos_params.Kp, (unsigned)a.duration_ms);
+    TEST_MESSAGE(msg);
+    snprintf(msg, sizeof(msg),
+             "%s: overshoot vel %.1f%% (default gains %.1f%%), pos %.1f%% (%.1f%%), pos settle %.0f ms (%.0f ms)", name,
+             (double)tuned.vel_overshoot, (double)fixed.vel_overshoot, (double)tuned.pos_overshoot,
+             (double)fixed.pos_overshoot, (double)tuned.pos_settle_ms, (double)fixed.pos_settle_ms);
+    TEST_MESSAGE(msg);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_tunes_each_plant() {
+    struct {
+        const char *name;
+        ArmSim::Parameters plant;
+    } plants[] = {{"nominal", kNominal}, {"weak", kWeak}, {"strong", kStrong}};
+
+    for (auto const &p : plants) {
+        AutotuneResult a = autotune(p.plant);
+        TEST_ASSERT_TRUE(a.state == RelayAutotune::State::DONE);
+
+        StepResult tuned = step_response(p.plant, a.vel_params, a.pos_params);
+        StepResult fixed = step_response(p.plant, kCascadeVelParams, kPosParams);
+        report(p.name, a, tuned, fixed);
+
+        // Inside AutotuneController's travel, and a few seconds of the calibration
+        TEST_ASSERT_GREATER_THAN_FLOAT(-5 * kDegToRad, a.min_position);
+        TEST_ASSERT_LESS_THAN_FLOAT(60 * kDegToRad, a.max_position);
+        TEST_ASSERT_LESS_THAN_UINT32(4000, a.duration_ms);
+
+        // The limits and feed-forward are carried over from the base gains
+        TEST_ASSERT_EQUAL_FLOAT(4, a.vel_params.output_limits.max);
+        TEST_ASSERT_EQUAL_FLOAT(1, a.pos_params.Kff_vel);
+        TEST_ASSERT_EQUAL_FLOAT(kPosParams.Ki, a.pos_params.Ki);
+
+        // The defaults were tuned by hand on the nominal arm and the relay only about matches them there. Off nominal
+        // it keeps the position loop from overshooting, where the defaults overshoot the weak arm by over 20%.
+        TEST_ASSERT_LESS_THAN_FLOAT(5, tuned.pos_overshoot);
+        TEST_ASSERT_LESS_THAN_FLOAT(15, tuned.vel_overshoot);
+        TEST_ASSERT_LESS_THAN_FLOAT(600, tuned.pos_settle_ms);
+    }
+}
+
+// An integrator with a pure delay. Tu = 4 L, and the error is a triangle wave of amplitude K L for a unit relay, so the
+// describing function reads Ku = 4 / (pi K L). About 80% of the exact pi / (2 K L), the usual relay approximation.
+void test_relay_finds_ultimate_point() {
+    constexpr float K = 2;
+    constexpr uint32_t L = 25;  // ms
+    float delay[L] = {};
+    float y = 0;
+
+    RelayAutotune relay({.amplitude = 1, .bias = 0, .hysteresis = 0, .num_cycles = 6, .timeout_ms = 10000});
+    relay.start(0);
+    for (uint32_t t = 0; relay.get_state() == RelayAutotune::State::RUNNING; t++) {
+        float u = relay.update(-y, t);
+        y += K * delay[t % L] * kDt;
+        delay[t % L] = u;
+    }
+
+    TEST_ASSERT_TRUE(relay.get_state() == RelayAutotune::State::DONE);
+    RelayAutotune::Result const &r = relay.get_result();
+    float ku = 4 / ((float)M_PI * K * L * kDt);
+    TEST_ASSERT_FLOAT_WITHIN(.05f * ku, ku, r.ultimate_gain);
+    TEST_ASSERT_FLOAT_WITHIN(.002f, 4 * L * kDt, r.ultimate_period_s);
+}
+
+void test_times_out_without_oscillation() {
+    RelayAutotune relay(kVelocityRelay);
+    relay.start(0);
+    for (uint32_t t = 0; t < 2000; t++) {
+        // Stuck, the error never crosses the hysteresis
+        relay.update(.01f, t);
+        TEST_ASSERT_TRUE(relay.get_state() == RelayAutotune::State::RUNNING);
+    }
+    TEST_ASSERT_EQUAL_FLOAT(0, relay.update(.01f, 2000));
+    TEST_ASSERT_TRUE(relay.get_state() == RelayAutotune::State::FAILED);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_tunes_each_plant);
+    RUN_TEST(test_relay_finds_ultimate_point);
+    RUN_TEST(test_times_out_without_oscillation);
+    return UNITY_END();
+}
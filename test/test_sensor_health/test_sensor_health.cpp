@@ -0,0 +1,237 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unity.h>
+
+#include <random>
+
+#include "drivers/sensor_health.h"
+
+// abvm.cpp's, updated every 10 ms
+static SensorHealth::Parameters const kParams = {.max_gap_ms = 500,
+                                                 .stuck_ms = 1000,
+                                                 .window_samples = 32,
+                                                 .max_noise = 15};
+static constexpr uint32_t kUpdatePeriodMs = 10;
+
+static constexpr uint32_t kStepUs = 500;
+
+static constexpr uint32_t kFailureMs = 20000;
+
+enum class Failure {
+    NONE,
+    STUCK,        // The same code over and over
+    OPEN_BRIDGE,  // Pinned at the end of the range
+    FLOATING,     // The input left floating, anything at all
+    NO_DATA,      // Data ready stopped
+    HELD,         // Outliers the converter's filter held at the last reading, 10 at a time
+    CLOCK_STEPS,  // The timestamps jumping a second either way
+};
+
+struct HealthResult {
+    int32_t first_fault_ms;  // After the failure, -1 if there was none
+    uint32_t faults;         // The first ones raised
+    uint32_t num_held;
+};
+
+// 15 bpm: a 1 s rise to 25 cmH2O, a short hold and a fast open down to the PEEP
+static float breath_pressure(float t) {
+    float phase = fmodf(t, 4);
+    if (phase < 1) {
+        return 5 + 20 * phase;
+    }
+    if (phase < 1.2f) {
+        return 22;
+    }
+    return 5 + 17 * expf(-(phase - 1.2f) / .15f);
+}
+
+// 60 s of breaths sampled at sps with a little noise, failing from kFailureMs. The health is updated every 10 ms, as
+// in abvm.cpp.
+static HealthResult run(uint32_t sps, Failure failure) {
+    SensorHealth health(kParams, kUpdatePeriodMs);
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> noise(-.05f, .05f);
+    std::uniform_real_distribution<float> floating(-80, 80);
+
+    uint32_t sample_period_us = 1000000 / sps;
+    int64_t clock_offset_us = 0;
+    float last_value = 0;
+    HealthResult result = {.first_fault_ms = -1, .faults = 0, .num_held = 0};
+
+    for (uint32_t t_us = kStepUs; t_us <= 60000000; t_us += kStepUs) {
+        bool is_failed = t_us > kFailureMs * 1000;
+
+        if (t_us % sample_period_us == 0) {
+            ISensor::Sample sample = {.time_us = (uint64_t)(t_us + clock_offset_us),
+                                      .value = breath_pressure(t_us * 1e-6f) + noise(rng),
+                                      .is_saturated = false,
+                                      .is_held = false};
+            uint32_t n = t_us / sample_period_us;
+            bool is_sent = true;
+            if (is_failed) {
+                switch (failure) {
+                    case Failure::STUCK:
+                        sample.value = 12.34f;
+                        break;
+                    case Failure::OPEN_BRIDGE:
+                        sample.value = 158;
+                        sample.is_saturated = true;
+                        break;
+                    case Failure::FLOATING:
+                        sample.value = floating(rng);
+                        break;
+                    case Failure::NO_DATA:
+                        is_sent = false;
+                        break;
+                    case Failure::HELD:
+                        // Ten held then one through, a burst every 2 s
+                        if (n % (2 * sps) < 10) {
+                            sample.value = last_value;
+                            sample.is_held = true;
+                        }
+                        break;
+                    case Failure::CLOCK_STEPS:
+                        if (n % (2 * sps) == 0) {
+                            clock_offset_us += n % (4 * sps) == 0 ? 1000000 : -1000000;
+                            sample.time_us = (uint64_t)(t_us + clock_offset_us);
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+            if (is_sent) {
+                health.on_sample(sample);
+                last_value = sample.value;
+            }
+        }
+
+        if (t_us % (kUpdatePeriodMs * 1000) == 0) {
+            health.update();
+        }
+
+        if (!health.is_healthy() && result.first_fault_ms < 0) {
+            result.first_fault_ms = (int32_t)(t_us / 1000) - (int32_t)kFailureMs;
+            result.faults = health.get_faults().to_int();
+        }
+    }
+
+    result.num_held = health.get_stats()->num_held;
+    return result;
+}
+
+static void report(const char *name, uint32_t sps, HealthResult const &r) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%s at %u SPS: first fault %d ms after the failure, faults 0x%x, %u held", name,
+             (unsigned)sps, (int)r.first_fault_ms, (unsigned)r.faults, (unsigned)r.num_held);
+    TEST_MESSAGE(msg);
+}
+
+static bool is_within(uint32_t delta, uint32_t expected_ms, int32_t actual_ms) {
+    return abs(actual_ms - (int32_t)expected_ms) <= (int32_t)delta;
+}
+
+static SensorHealth::Faults const kNoData = {.no_data = true, .stuck = false, .saturated = false, .noisy = false};
+static SensorHealth::Faults const kStuck = {.no_data = false, .stuck = true, .saturated = false, .noisy = false};
+static SensorHealth::Faults const kSaturated = {.no_data = false, .stuck = false, .saturated = true, .noisy = false};
+static SensorHealth::Faults const kNoisy = {.no_data = false, .stuck = false, .saturated = false, .noisy = true};
+
+static uint32_t const kRates[] = {80, 10};
+
+void setUp() {}
+
+void tearDown() {}
+
+// Breathing is a live sensor at either rate, fast opens and all
+void test_breaths_are_healthy() {
+    for (uint32_t sps : kRates) {
+        HealthResult r = run(sps, Failure::NONE);
+        report("healthy", sps, r);
+        TEST_ASSERT_EQUAL_INT32(-1, r.first_fault_ms);
+    }
+}
+
+// Noticed with the sample after stuck_ms is up
+void test_stuck() {
+    for (uint32_t sps : kRates) {
+        HealthResult r = run(sps, Failure::STUCK);
+        report("stuck", sps, r);
+        TEST_ASSERT_EQUAL_UINT32(kStuck.to_int(), r.faults);
+        TEST_ASSERT_TRUE(is_within(2 * 1000 / sps + kUpdatePeriodMs, kParams.stuck_ms, r.first_fault_ms));
+    }
+}
+
+// Caught by the window the first saturated sample lands in, the sample itself flags it
+void test_open_bridge() {
+    for (uint32_t sps : kRates) {
+        HealthResult r = run(sps, Failure::OPEN_BRIDGE);
+        report("open bridge", sps, r);
+        TEST_ASSERT_EQUAL_UINT32(kSaturated.to_int(), r.faults);
+        TEST_ASSERT_TRUE(r.first_fault_ms >= 0 && r.first_fault_ms <= (int32_t)(1000 / sps));
+    }
+}
+
+// Caught once a window full of it is in
+void test_floating() {
+    for (uint32_t sps : kRates) {
+        HealthResult r = run(sps, Failure::FLOATING);
+        report("floating", sps, r);
+        TEST_ASSERT_EQUAL_UINT32(kNoisy.to_int(), r.faults);
+        int32_t two_windows_ms = 2 * kParams.window_samples * 1000 / sps;
+        TEST_ASSERT_TRUE(r.first_fault_ms >= 0 && r.first_fault_ms <= two_windows_ms);
+    }
+}
+
+void test_no_data() {
+    for (uint32_t sps : kRates) {
+        HealthResult r = run(sps, Failure::NO_DATA);
+        report("no data", sps, r);
+        TEST_ASSERT_EQUAL_UINT32(kNoData.to_int(), r.faults);
+        TEST_ASSERT_TRUE(is_within(1000 / sps + kUpdatePeriodMs, kParams.max_gap_ms, r.first_fault_ms));
+    }
+}
+
+// At 10 SPS ten held samples are as long as stuck_ms. The converter behind them was moving, they aren't stuck.
+void test_held_outliers_are_not_stuck() {
+    for (uint32_t sps : kRates) {
+        HealthResult r = run(sps, Failure::HELD);
+        report("held outliers", sps, r);
+        TEST_ASSERT_EQUAL_INT32(-1, r.first_fault_ms);
+        TEST_ASSERT_EQUAL_UINT32(20 * 10, r.num_held);
+    }
+}
+
+// The faults are timed by update(), the timestamps jumping either way neither raises nor hides one
+void test_clock_steps() {
+    for (uint32_t sps : kRates) {
+        HealthResult r = run(sps, Failure::CLOCK_STEPS);
+        report("clock steps", sps, r);
+        TEST_ASSERT_EQUAL_INT32(-1, r.first_fault_ms);
+    }
+}
+
+// Once data ready comes back so does the sensor
+void test_recovers() {
+    SensorHealth health(kParams, kUpdatePeriodMs);
+    for (uint32_t ms = 0; ms < 1000; ms += kUpdatePeriodMs) {
+        health.update();
+    }
+    TEST_ASSERT_TRUE(health.get_faults().no_data);
+
+    health.on_sample({.time_us = 1000000, .value = 5, .is_saturated = false, .is_held = false});
+    TEST_ASSERT_TRUE(health.is_healthy());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_breaths_are_healthy);
+    RUN_TEST(test_stuck);
+    RUN_TEST(test_open_bridge);
+    RUN_TEST(test_floating);
+    RUN_TEST(test_no_data);
+    RUN_TEST(test_held_outliers_are_not_stuck);
+    RUN_TEST(test_clock_steps);
+    RUN_TEST(test_recovers);
+    return UNITY_END();
+}
@@ -0,0 +1,107 @@
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include <random>
+
+#include "config.h"
+#include "motor_sim.h"
+#include "servo.h"
+#include "sim_clock.h"
+
+static constexpr uint32_t kStepUs = 100;
+
+// The planner's points come every 10 ms, the servo's updates every 1 ms unless the main loop holds them up
+static constexpr uint32_t kPlannerPeriodUs = 10000;
+static constexpr uint32_t kMaxUpdateGapMs = 3;
+
+static constexpr float kSpeed = 1;          // rads/s, about an inspiration's
+static constexpr uint32_t kRampUs = 400000;  // Of planner points, then the planner stops
+static constexpr uint32_t kRunUs = 600000;
+static constexpr uint32_t kLastPointUs = kRampUs - kPlannerPeriodUs;
+static constexpr uint32_t kHoldUs = 50000;  // Servo's TRAJECTORY_HOLD_US
+
+struct RampResult {
+    float reference_error;  // rads, the most the commanded position was ever off the ramp
+    float tracking_error;   // rads, the most the arm was off it from 100 ms in
+    float end_pos;          // rads
+};
+
+// The servo following a ramp the planner sets a point of every kPlannerPeriodUs, updated every 1 ms, or when
+// is_uneven 1 to kMaxUpdateGapMs ms apart
+static RampResult run_ramp(bool is_uneven) {
+    MotorSim motor_sim;
+    Servo motor(1, &motor_sim.driver, &motor_sim.encoder, &motor_sim.limit_switch, kMotorConfig.motor_params,
+                kMotorConfig.motor_vel_pid_params, kMotorConfig.motor_vel_limits, kMotorConfig.motor_pos_pid_params,
+                kMotorConfig.motor_pos_limits, kMotorCurrentConfig.motor_cur_pid_params);
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<uint32_t> gap(1, kMaxUpdateGapMs);
+
+    sim_clock_set_us(1000000);
+    motor.init();
+    motor.set_mode(Servo::Mode::POSITION);
+
+    RampResult result = {};
+    uint32_t next_update_ms = 1;
+    for (uint32_t t_us = 0; t_us < kRunUs; t_us += kStepUs) {
+        if (t_us % kPlannerPeriodUs == 0 && t_us < kRampUs) {
+            motor.set_trajectory(kSpeed * t_us * 1e-6f, kSpeed, 0);
+        }
+        motor_sim.run(kStepUs);
+
+        uint32_t now_us = t_us + kStepUs;
+        if (now_us % 1000 != 0 || now_us / 1000 < next_update_ms) {
+            continue;
+        }
+        motor.update();
+        next_update_ms = now_us / 1000 + (is_uneven ? gap(rng) : 1);
+
+        float ramp = kSpeed * fminf(now_us, kLastPointUs + kHoldUs) * 1e-6f;
+        result.reference_error = fmaxf(result.reference_error, fabsf(motor.commanded_pos - ramp));
+        if (now_us >= 100000) {
+            result.tracking_error = fmaxf(result.tracking_error, fabsf(motor.position - ramp));
+        }
+    }
+
+    result.end_pos = motor.position;
+    return result;
+}
+
+static void report(const char *name, RampResult const &r) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%s: reference error %.5f rad, tracking error %.4f rad, end %.4f rad", name,
+             (double)r.reference_error, (double)r.tracking_error, (double)r.end_pos);
+    TEST_MESSAGE(msg);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+// Between the planner's points the reference carries on at the planner's speed by the time since the last one,
+// however the updates are spaced. Stepping it a fixed period per update would have it fall behind whenever they are
+// late, and jump forward at the next point.
+void test_trajectory_follows_real_time() {
+    RampResult even = run_ramp(false);
+    RampResult uneven = run_ramp(true);
+    report("every 1 ms", even);
+    report("1 to 3 ms apart", uneven);
+
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 0, even.reference_error);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 0, uneven.reference_error);
+    TEST_ASSERT_TRUE(uneven.tracking_error < 2 * even.tracking_error + .005f);
+}
+
+// Once the planner's points stop the reference holds TRAJECTORY_HOLD_US on from the last one, not running on
+void test_trajectory_holds_without_points() {
+    RampResult r = run_ramp(true);
+    TEST_ASSERT_FLOAT_WITHIN(.01f, kSpeed * (kLastPointUs + kHoldUs) * 1e-6f, r.end_pos);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_trajectory_follows_real_time);
+    RUN_TEST(test_trajectory_holds_without_points);
+    return UNITY_END();
+}
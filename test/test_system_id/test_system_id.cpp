@@ -0,0 +1,177 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include <random>
+
+#include "motor_sim.h"
+#include "sim_clock.h"
+#include "system_id_controller.h"
+
+// The plant the capture is fitted to, PlantModelConfig's model with the numbers it should come back with
+static constexpr float kAccelPerAmp = 6;
+static constexpr float kDamping = .5f;
+static constexpr float kFriction = .8f;
+static constexpr float kLoadPerPressure = .1f;  // rads/s^2 / cmH2O
+static constexpr float kCurrentPerDuty = 6;     // 12 V across 2 ohms
+static constexpr float kCurrentPerVelocity = 2;
+static constexpr float kBagContactPos = .28f;  // rads
+static constexpr float kBagCoeffs[3] = {0, 20, 80};
+
+// abvm.cpp's capture
+static SystemIdController::Parameters const kParams = {.excitation = SystemIdController::Excitation::PRBS,
+                                                       .amplitude = .25f,
+                                                       .prbs_bit_ms = 20,
+                                                       .chirp_start_hz = .5f,
+                                                       .chirp_end_hz = 8,
+                                                       .hold_gain = 2,
+                                                       .sweep = {deg_to_rad(10), deg_to_rad(45)},
+                                                       .travel = {deg_to_rad(-5), deg_to_rad(60)},
+                                                       .sample_period_ms = 10};
+
+static float bag_pressure(float position) {
+    float x = position - kBagContactPos;
+    return x < 0 ? 0 : kBagCoeffs[0] + kBagCoeffs[1] * x + kBagCoeffs[2] * x * x;
+}
+
+// The ADS1231 at 100 SPS, with noise
+struct PressureSensor : ISensor {
+    float value = 0;
+
+    float read() override {
+        return value;
+    }
+
+    bool read_sample(Sample *sample) override {
+        (void)sample;
+        return false;
+    }
+};
+
+// The last capture's samples
+static SystemIdController::Sample captured[SystemIdController::NUM_SAMPLES];
+
+struct CaptureResult {
+    SystemIdController::State state;
+    size_t num_samples;
+    PlantModelConfig model;
+};
+
+// A whole capture on the simulated arm, the real servo's measurements of it every millisecond. The controller drives
+// the PWM itself, straight across the motor winding.
+static CaptureResult capture(SystemIdController::Parameters const &params) {
+    MotorSim::Parameters motor_params = {.arm = {.accel_per_amp = kAccelPerAmp,
+                                                 .damping = kDamping,
+                                                 .friction = kFriction,
+                                                 .current_tau_s = .001f,  // The winding's L/R
+                                                 .rad_per_count = ArmSim::kDefaults.rad_per_count},
+                                         .current_per_duty = kCurrentPerDuty,
+                                         .current_per_velocity = kCurrentPerVelocity};
+    MotorSim motor_sim(motor_params);
+    PID::Params pid_params = {};
+    Servo motor(1, &motor_sim.driver, &motor_sim.encoder, &motor_sim.limit_switch,
+                {.gear_reduction = 188, .counts_per_rev = 28}, pid_params, {-1, 1}, pid_params, {-1, 1}, pid_params);
+    PressureSensor pressure;
+    SystemIdController sysid(&motor, &motor_sim.driver, &pressure, params);
+
+    std::mt19937 rng(1);
+    std::normal_distribution<float> pressure_noise(0, .3f);
+
+    sim_clock_set_us(0);
+    motor.init();
+    sysid.start(kBagContactPos);
+    for (uint32_t ms = 0; sysid.is_running(); ms++) {
+        float position = motor_sim.get_arm().get_position();
+        motor_sim.run(1000, kLoadPerPressure * bag_pressure(position));
+        if (ms % 10 == 0) {
+            pressure.value = bag_pressure(position) + pressure_noise(rng);
+        }
+        motor.update();
+        sysid.update();
+    }
+    memcpy(captured, sysid.get_samples(), sysid.get_num_samples() * sizeof(captured[0]));
+    return {sysid.get_state(), sysid.get_num_samples(), sysid.get_model()};
+}
+
+static void report(const char *name, PlantModelConfig const &m) {
+    char msg[200];
+    snprintf(msg, sizeof(msg),
+             "%s: accel/A %.2f (%.0f), damping %.2f (%.1f), friction %.2f (%.1f), load/cmH2O %.3f (%.1f), i/duty %.2f "
+             "(%.0f), i/w %.2f (%.0f), bag %.2f + %.1f x + %.1f x^2",
+             name, (double)m.accel_per_amp, (double)kAccelPerAmp, (double)m.damping, (double)kDamping,
+             (double)m.friction, (double)kFriction, (double)m.load_per_pressure, (double)kLoadPerPressure,
+             (double)m.current_per_duty, (double)kCurrentPerDuty, (double)m.current_per_velocity,
+             (double)kCurrentPerVelocity, (double)m.bag_pressure_coeffs[0], (double)m.bag_pressure_coeffs[1],
+             (double)m.bag_pressure_coeffs[2]);
+    TEST_MESSAGE(msg);
+}
+
+// The drive is the current the capture's amplitude pushes through the stalled motor. Against it the damping and
+// friction are a few percent, below what the 10 ms differences of whole encoder counts resolve, and as the arm hardly
+// leaves one speed the two trade off against each other. Their sum at that speed is what the capture does pin down.
+static void check_model(PlantModelConfig const &m) {
+    constexpr float kDriveAccel = kAccelPerAmp * kCurrentPerDuty * .25f;  // kParams.amplitude
+    constexpr float kSpeed = .5f;                                         // rads/s
+    TEST_ASSERT_TRUE(m.damping >= 0);
+    TEST_ASSERT_TRUE(m.friction >= 0);
+    TEST_ASSERT_FLOAT_WITHIN(.1f * kAccelPerAmp, kAccelPerAmp, m.accel_per_amp);
+    TEST_ASSERT_FLOAT_WITHIN(.1f * kDriveAccel, kDamping * kSpeed + kFriction, m.damping * kSpeed + m.friction);
+    TEST_ASSERT_FLOAT_WITHIN(.2f * kLoadPerPressure, kLoadPerPressure, m.load_per_pressure);
+    TEST_ASSERT_FLOAT_WITHIN(.05f * kCurrentPerDuty, kCurrentPerDuty, m.current_per_duty);
+    TEST_ASSERT_FLOAT_WITHIN(.05f * kCurrentPerVelocity, kCurrentPerVelocity, m.current_per_velocity);
+    TEST_ASSERT_FLOAT_WITHIN(.05f * kBagCoeffs[1], kBagCoeffs[1], m.bag_pressure_coeffs[1]);
+    TEST_ASSERT_FLOAT_WITHIN(.1f * kBagCoeffs[2], kBagCoeffs[2], m.bag_pressure_coeffs[2]);
+    TEST_ASSERT_EQUAL_FLOAT(kBagContactPos, m.bag_contact_pos);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_prbs_capture_fits_the_plant() {
+    CaptureResult r = capture(kParams);
+    TEST_ASSERT_TRUE(r.state == SystemIdController::State::DONE);
+    TEST_ASSERT_EQUAL_UINT32(SystemIdController::NUM_SAMPLES, r.num_samples);
+    report("PRBS", r.model);
+    check_model(r.model);
+}
+
+void test_chirp_capture_fits_the_plant() {
+    SystemIdController::Parameters params = kParams;
+    params.excitation = SystemIdController::Excitation::CHIRP;
+    CaptureResult r = capture(params);
+    TEST_ASSERT_TRUE(r.state == SystemIdController::State::DONE);
+    report("chirp", r.model);
+    check_model(r.model);
+}
+
+// Swept short of the bag the arm only overshoots into it now and then, not enough to fit the bag or its load to
+void test_fit_fails_without_the_bag() {
+    SystemIdController::Parameters params = kParams;
+    params.sweep = {deg_to_rad(5), deg_to_rad(12)};
+    TEST_ASSERT_TRUE(capture(params).state == SystemIdController::State::FAILED);
+}
+
+// The motor wired the other way round, its current pushing the arm back. Nothing fits that as a model of the arm.
+void test_fit_rejects_a_backwards_arm() {
+    CaptureResult r = capture(kParams);
+    PlantModelConfig m;
+    TEST_ASSERT_TRUE(SystemIdController::fit(captured, r.num_samples, kParams.sample_period_ms / 1000.f,
+                                             kBagContactPos, &m));
+
+    for (size_t k = 0; k < r.num_samples; k++) {
+        captured[k].current = -captured[k].current;
+    }
+    TEST_ASSERT_FALSE(SystemIdController::fit(captured, r.num_samples, kParams.sample_period_ms / 1000.f,
+                                              kBagContactPos, &m));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_prbs_capture_fits_the_plant);
+    RUN_TEST(test_chirp_capture_fits_the_plant);
+    RUN_TEST(test_fit_fails_without_the_bag);
+    RUN_TEST(test_fit_rejects_a_backwards_arm);
+    return UNITY_END();
+}